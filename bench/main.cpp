@@ -0,0 +1,450 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#ifndef _WIN32
+#include <pthread.h>
+#include <time.h>
+#endif
+
+#include <falcon.h>
+#include <falcon_client.h>
+#include <falcon_server.h>
+#include "spdlog/spdlog.h"
+
+// Loopback benchmarks of a server and its clients in one process. Results go to stdout as JSON or CSV, one row per
+// measurement, so runs can be diffed; progress goes to stderr.
+//
+// Usage: falcon_bench [--format json|csv] [--filter name] [--clients count] [--duration-ms ms]
+
+using namespace std::chrono_literals;
+using Clock = std::chrono::steady_clock;
+
+namespace
+{
+    constexpr uint16_t PORT = 5555;
+    constexpr size_t PAYLOAD_SIZES[] = { 16, 64, 256, 1024, 4096 };
+
+    struct Options
+    {
+        bool csv = false;
+        // Only benchmarks whose name contains it run
+        std::string filter;
+        // Connected at once for the connect rate and server CPU benchmarks
+        int clients = 1000;
+        // Length of each timed phase
+        std::chrono::milliseconds duration{ 1000 };
+    };
+
+    struct Result
+    {
+        std::string benchmark;
+        // reliable or unreliable, empty when the benchmark has no such mode
+        std::string mode;
+        size_t payload_size = 0;
+        std::string metric;
+        double value = 0;
+    };
+
+    class Report
+    {
+    public:
+        void Add(std::string benchmark, std::string mode, size_t payload_size, std::string metric, double value)
+        {
+            std::cerr << benchmark << (mode.empty() ? "" : " " + mode) << (payload_size ? " " + std::to_string(payload_size) + " B" : "")
+                << ": " << metric << " = " << value << std::endl;
+            m_results.push_back({ std::move(benchmark), std::move(mode), payload_size, std::move(metric), value });
+        }
+
+        void Print(bool csv) const
+        {
+            if (csv)
+            {
+                std::cout << "benchmark,mode,payload_size,metric,value\n";
+                for (const Result& result : m_results)
+                {
+                    std::cout << result.benchmark << ',' << result.mode << ',' << result.payload_size << ',' << result.metric << ','
+                        << result.value << '\n';
+                }
+                return;
+            }
+            std::cout << "{\n  \"results\": [";
+            for (size_t i = 0; i < m_results.size(); i++)
+            {
+                const Result& result = m_results[i];
+                std::cout << (i ? ",\n" : "\n") << "    { \"benchmark\": \"" << result.benchmark << "\", \"mode\": \"" << result.mode
+                    << "\", \"payload_size\": " << result.payload_size << ", \"metric\": \"" << result.metric << "\", \"value\": "
+                    << result.value << " }";
+            }
+            std::cout << "\n  ]\n}\n";
+        }
+
+    private:
+        std::vector<Result> m_results;
+    };
+
+    template<typename Condition>
+    bool WaitFor(Condition&& condition, Clock::duration timeout)
+    {
+        const Clock::time_point deadline = Clock::now() + timeout;
+        while (!condition())
+        {
+            if (Clock::now() > deadline)
+            {
+                return false;
+            }
+            std::this_thread::sleep_for(100us);
+        }
+        return true;
+    }
+
+    double Seconds(Clock::duration duration)
+    {
+        return std::chrono::duration<double>(duration).count();
+    }
+
+    // The handshake is not retransmitted, a client whose CONNECT was lost tries again
+    std::unique_ptr<FalconClient> Connect()
+    {
+        for (int attempt = 0; attempt < 5; attempt++)
+        {
+            auto client = std::make_unique<FalconClient>();
+            client->ConnectTo("127.0.0.1", PORT);
+            if (WaitFor([&client]() { return client->IsConnected(); }, 500ms))
+            {
+                return client;
+            }
+        }
+        return nullptr;
+    }
+
+    // Waits for the first message of a client stream to reach the server, then counts those that follow on the listener thread
+    std::shared_ptr<Stream> CountOnServer(FalconServer& server, FalconClient& client, Stream& stream, std::atomic<uint64_t>& received)
+    {
+        std::shared_ptr<Stream> server_stream;
+        const bool opened = WaitFor([&]() {
+            client.SendData(std::string_view("open"), stream.GetStreamID());
+            std::this_thread::sleep_for(1ms);
+            server_stream = server.GetStream(client.GetId(), stream.GetStreamID());
+            return server_stream != nullptr;
+        }, 1s);
+        if (!opened)
+        {
+            return nullptr;
+        }
+        // Stray opening messages still in flight are counted out before the run starts
+        std::this_thread::sleep_for(20ms);
+        server_stream->SetMessageHandler([&received](const Message&) { received.fetch_add(1, std::memory_order_relaxed); });
+        std::this_thread::sleep_for(20ms);
+        received = 0;
+        return server_stream;
+    }
+
+    void BenchmarkConnectRate(const Options& options, Report& report)
+    {
+        FalconServer server;
+        server.Listen(PORT);
+
+        std::vector<std::unique_ptr<FalconClient>> clients;
+        clients.reserve(options.clients);
+        const Clock::time_point start = Clock::now();
+        for (int i = 0; i < options.clients; i++)
+        {
+            clients.push_back(std::make_unique<FalconClient>());
+            clients.back()->ConnectTo("127.0.0.1", PORT);
+        }
+        WaitFor([&]() { return server.GetActiveClientCount() == static_cast<uint32_t>(options.clients); }, 10s);
+        const double seconds = Seconds(Clock::now() - start);
+
+        const uint32_t connected = server.GetActiveClientCount();
+        report.Add("connect", "", 0, "connections_per_second", connected / seconds);
+        report.Add("connect", "", 0, "failed_connections", options.clients - static_cast<double>(connected));
+    }
+
+    void BenchmarkThroughput(const Options& options, Report& report, bool reliable, size_t payload_size)
+    {
+        FalconServer server;
+        server.Listen(PORT);
+        const std::unique_ptr<FalconClient> client = Connect();
+        if (!client)
+        {
+            std::cerr << "throughput: could not connect" << std::endl;
+            return;
+        }
+        const std::shared_ptr<Stream> stream = client->CreateStream(reliable);
+        std::atomic<uint64_t> received = 0;
+        if (!stream || !CountOnServer(server, *client, *stream, received))
+        {
+            std::cerr << "throughput: stream did not open" << std::endl;
+            return;
+        }
+
+        const std::string payload(payload_size, 'x');
+        uint64_t sent = 0;
+        Clock::time_point start = Clock::now();
+        Clock::time_point end;
+        if (reliable)
+        {
+            // Reliable messages wait in the send window rather than being dropped, a fixed amount of bytes is timed to delivery
+            const uint64_t count = std::clamp<uint64_t>(16 * 1024 * 1024 / payload_size, 1000, 20000);
+            while (sent < count)
+            {
+                if (client->SendData(payload, stream->GetStreamID()))
+                {
+                    sent++;
+                }
+                else
+                {
+                    std::this_thread::yield();
+                }
+            }
+            WaitFor([&]() { return received.load() >= sent; }, 30s);
+            end = Clock::now();
+        }
+        else
+        {
+            // As fast as the command queue takes them, what the link cannot carry is lost
+            while (Clock::now() - start < options.duration)
+            {
+                if (client->SendData(payload, stream->GetStreamID()))
+                {
+                    sent++;
+                }
+                else
+                {
+                    std::this_thread::yield();
+                }
+            }
+            end = Clock::now();
+            std::this_thread::sleep_for(100ms);
+        }
+
+        const double seconds = Seconds(end - start);
+        const char* mode = reliable ? "reliable" : "unreliable";
+        report.Add("throughput", mode, payload_size, "messages_per_second", received / seconds);
+        report.Add("throughput", mode, payload_size, "megabytes_per_second", received * payload_size / seconds / 1e6);
+        report.Add("throughput", mode, payload_size, "delivered_ratio", sent ? static_cast<double>(received) / sent : 0);
+    }
+
+    void BenchmarkLatency(const Options& options, Report& report, bool reliable)
+    {
+        FalconServer server;
+        server.Listen(PORT);
+        const std::unique_ptr<FalconClient> client = Connect();
+        if (!client)
+        {
+            std::cerr << "latency: could not connect" << std::endl;
+            return;
+        }
+        const std::shared_ptr<Stream> stream = client->CreateStream(reliable);
+        std::atomic<uint64_t> received = 0;
+        const std::shared_ptr<Stream> echo = stream ? CountOnServer(server, *client, *stream, received) : nullptr;
+        if (!echo)
+        {
+            std::cerr << "latency: stream did not open" << std::endl;
+            return;
+        }
+        // The server sends each message back on the same stream, the client stream takes it as the reply
+        echo->SetMessageHandler([&server, client_id = client->GetId(), stream_id = stream->GetStreamID()](const Message& message) {
+            server.SendData(message.data, client_id, stream_id);
+        });
+        std::atomic<uint64_t> replies = 0;
+        stream->SetMessageHandler([&replies](const Message&) { replies.fetch_add(1, std::memory_order_release); });
+        std::this_thread::sleep_for(20ms);
+
+        std::vector<double> round_trips;
+        uint64_t lost = 0;
+        const std::string payload(64, 'x');
+        const Clock::time_point start = Clock::now();
+        while (Clock::now() - start < options.duration)
+        {
+            const uint64_t expected = replies.load(std::memory_order_acquire) + 1;
+            const Clock::time_point sent_at = Clock::now();
+            if (!client->SendData(payload, stream->GetStreamID()))
+            {
+                continue;
+            }
+            // Spinning, a sleep would dominate loopback round trips
+            bool replied = false;
+            while (!(replied = replies.load(std::memory_order_acquire) >= expected) && Clock::now() - sent_at < 100ms)
+            {
+                std::this_thread::yield();
+            }
+            if (!replied)
+            {
+                // A late reply must not count for the next message
+                lost++;
+                WaitFor([&]() { return replies.load(std::memory_order_acquire) >= expected; }, 500ms);
+                continue;
+            }
+            round_trips.push_back(std::chrono::duration<double, std::micro>(Clock::now() - sent_at).count());
+        }
+        if (round_trips.empty())
+        {
+            std::cerr << "latency: no reply" << std::endl;
+            return;
+        }
+
+        std::sort(round_trips.begin(), round_trips.end());
+        const auto percentile = [&round_trips](double fraction) {
+            return round_trips[std::min(round_trips.size() - 1, static_cast<size_t>(fraction * round_trips.size()))];
+        };
+        const char* mode = reliable ? "reliable" : "unreliable";
+        report.Add("round_trip", mode, payload.size(), "p50_us", percentile(0.5));
+        report.Add("round_trip", mode, payload.size(), "p99_us", percentile(0.99));
+        report.Add("round_trip", mode, payload.size(), "p999_us", percentile(0.999));
+        report.Add("round_trip", mode, payload.size(), "max_us", round_trips.back());
+        report.Add("round_trip", mode, payload.size(), "samples", static_cast<double>(round_trips.size()));
+        report.Add("round_trip", mode, payload.size(), "lost", static_cast<double>(lost));
+    }
+
+#ifndef _WIN32
+    double ThreadCpuSeconds(clockid_t clock)
+    {
+        timespec time{};
+        clock_gettime(clock, &time);
+        return time.tv_sec + time.tv_nsec / 1e9;
+    }
+
+    // CPU time of the listener thread, idle with keepalives only and with every client sending updates at a game tick rate
+    void BenchmarkServerCpu(const Options& options, Report& report)
+    {
+        constexpr int TICK_RATE = 20;
+        constexpr size_t UPDATE_SIZE = 64;
+
+        FalconServer server;
+        // The connect callback runs on the listener thread, which hands over its CPU clock
+        std::atomic<bool> has_clock = false;
+        clockid_t listener_clock{};
+        server.m_on_client_connect = [&](uint64_t) {
+            if (!has_clock && pthread_getcpuclockid(pthread_self(), &listener_clock) == 0)
+            {
+                has_clock = true;
+            }
+        };
+        server.Listen(PORT);
+
+        std::vector<std::unique_ptr<FalconClient>> clients;
+        std::vector<std::shared_ptr<Stream>> streams;
+        for (int i = 0; i < options.clients; i++)
+        {
+            if (std::unique_ptr<FalconClient> client = Connect())
+            {
+                streams.push_back(client->CreateStream(false));
+                clients.push_back(std::move(client));
+            }
+        }
+        if (clients.empty() || !has_clock)
+        {
+            std::cerr << "server_cpu: could not connect" << std::endl;
+            return;
+        }
+        // Per 1000 clients, whatever the number connected
+        const double scale = 1000.0 / clients.size();
+
+        std::this_thread::sleep_for(200ms);
+        double cpu_start = ThreadCpuSeconds(listener_clock);
+        Clock::time_point start = Clock::now();
+        std::this_thread::sleep_for(options.duration);
+        report.Add("server_cpu", "idle", 0, "cpu_percent_per_1k_clients",
+            (ThreadCpuSeconds(listener_clock) - cpu_start) / Seconds(Clock::now() - start) * 100 * scale);
+
+        const std::string update(UPDATE_SIZE, 'u');
+        cpu_start = ThreadCpuSeconds(listener_clock);
+        start = Clock::now();
+        for (Clock::time_point tick = start; tick - start < options.duration; tick += std::chrono::milliseconds(1000 / TICK_RATE))
+        {
+            std::this_thread::sleep_until(tick);
+            for (size_t i = 0; i < clients.size(); i++)
+            {
+                if (streams[i])
+                {
+                    clients[i]->SendData(update, streams[i]->GetStreamID());
+                }
+            }
+        }
+        report.Add("server_cpu", "unreliable", UPDATE_SIZE, "cpu_percent_per_1k_clients",
+            (ThreadCpuSeconds(listener_clock) - cpu_start) / Seconds(Clock::now() - start) * 100 * scale);
+        report.Add("server_cpu", "", 0, "clients", static_cast<double>(clients.size()));
+    }
+#endif
+
+    bool ParseOptions(int argc, char** argv, Options& options)
+    {
+        for (int i = 1; i < argc; i++)
+        {
+            const std::string_view argument = argv[i];
+            const char* value = i + 1 < argc ? argv[i + 1] : nullptr;
+            if (argument == "--format" && value)
+            {
+                options.csv = std::string_view(value) == "csv";
+            }
+            else if (argument == "--filter" && value)
+            {
+                options.filter = value;
+            }
+            else if (argument == "--clients" && value)
+            {
+                options.clients = std::max(std::atoi(value), 1);
+            }
+            else if (argument == "--duration-ms" && value)
+            {
+                options.duration = std::chrono::milliseconds(std::max(std::atoi(value), 1));
+            }
+            else
+            {
+                return false;
+            }
+            i++;
+        }
+        return true;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+    if (!ParseOptions(argc, argv, options))
+    {
+        std::cerr << "Usage: falcon_bench [--format json|csv] [--filter name] [--clients count] [--duration-ms ms]" << std::endl;
+        return EXIT_FAILURE;
+    }
+    spdlog::set_level(spdlog::level::warn);
+    const auto selected = [&options](std::string_view name) { return name.find(options.filter) != std::string_view::npos; };
+
+    Report report;
+    if (selected("connect"))
+    {
+        BenchmarkConnectRate(options, report);
+    }
+    if (selected("throughput"))
+    {
+        for (const bool reliable : { false, true })
+        {
+            for (const size_t payload_size : PAYLOAD_SIZES)
+            {
+                BenchmarkThroughput(options, report, reliable, payload_size);
+            }
+        }
+    }
+    if (selected("round_trip"))
+    {
+        BenchmarkLatency(options, report, false);
+        BenchmarkLatency(options, report, true);
+    }
+#ifndef _WIN32
+    if (selected("server_cpu"))
+    {
+        BenchmarkServerCpu(options, report);
+    }
+#endif
+    report.Print(options.csv);
+    return EXIT_SUCCESS;
+}
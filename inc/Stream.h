@@ -2,28 +2,157 @@
 #define STREAM_H
 
 #include <memory>
+#include <algorithm>
 #include <span>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+#include <vector>
 #include "falcon.h"
+#include "part_bitmap.h"
+#include "reassembler.h"
+#include "mpsc_queue.h"
+#include "keepalive.h"
+#include "wire_format.h"
+#include "snapshot_delta.h"
+#include "lz_codec.h"
+
+// A message received on a stream. Polling into it again hands its buffer back to the stream, to hold a later message.
+struct Message
+{
+    uint64_t client_id = 0;
+    uint32_t stream_id = 0;
+    std::vector<char> data;
+};
 
 class Stream {
 private:
     uint32_t stream_id;
-    uint16_t msg_id;
+    std::atomic<uint16_t> msg_id = 0;
     uint64_t client_uuid;
 
-    uint16_t flags;
+    uint16_t flags = 0;
+    // Negotiated with the peer at CONNECT, parts are cut so the largest header of the version fits with them in a datagram
+    uint8_t m_wire_version = wire::VERSION_FIXED;
+    std::atomic<size_t> m_header_size = wire::FIXED_DATA_HEADER_SIZE;
 
-    IpPortPair target;
+    Endpoint target;
     Falcon* socket;
 
     std::string m_last_data = "";
+
+    // A reliable message kept until every part is acknowledged
+    struct OutgoingMessage
+    {
+        uint16_t msg_id = 0;
+        uint16_t part_total = 0;
+        // Every part but the last is this long, fixed when the message is queued so resends cut it the same way
+        uint16_t part_size = 0;
+        bool sent = false;
+        bool acked = false;
+        // Acknowledgements of resent messages are ambiguous and give no round trip sample
+        bool resent = false;
+        bool compressed = false;
+        // Sized to part_total
+        PartBitmap sent_parts;
+        PartBitmap acked_parts;
+        // Parts waiting for the congestion controller to let them out, new or presumed lost
+        PartBitmap pending_parts;
+        uint16_t acked_count = 0;
+        uint16_t pending_count = 0;
+        // Time the last part was sent
+        std::chrono::steady_clock::time_point sent_at;
+        std::vector<char> data;
+    };
+    // Oldest unacknowledged message first. Only messages within WINDOW_SIZE ids of the front are in flight, the rest wait for the window to slide.
+    std::deque<OutgoingMessage> m_send_window;
+    mutable std::mutex m_send_window_mutex;
+    std::shared_ptr<CongestionController> m_congestion;
+    // Sizes the parts of new messages, the base datagram size is used without it
+    std::shared_ptr<PathMtuDiscovery> m_path_mtu;
+    // Told about every datagram sent, so the connection skips its keepalives while the stream carries traffic
+    std::shared_ptr<Keepalive> m_keepalive;
+
+    // Every reliable message before m_receive_base is complete, bit i of m_receive_sack is message m_receive_base + 1 + i
+    uint16_t m_receive_base = 0;
+    uint64_t m_receive_sack = 0;
+    std::unordered_map<uint16_t, PartBitmap> m_partial_messages;
+    // Shared by the streams of a connection, created on the first multi-part message when the stream has none
+    std::shared_ptr<Reassembler> m_reassembler;
+
+    // Complete messages, queued by the listener thread for the application, and the buffers the application gave back
+    MpscQueue<Message> m_receive_queue;
+    MpscQueue<std::vector<char>> m_free_buffers;
+    std::atomic<size_t> m_dropped_messages = 0;
+
+    // Read by the server's send scheduler when the application sends on the stream
+    std::atomic<int> m_priority = 0;
+    std::atomic<uint32_t> m_weight = 1;
+
+    // Newest message delivered, only sequenced streams drop what is older
+    bool m_has_delivered = false;
+    uint16_t m_newest_message_id = 0;
+
+    // Ordered streams only, WINDOW_SIZE slots where complete messages after a gap wait. The receive window keeps them within
+    // WINDOW_SIZE ids of m_receive_base, so each has its own slot.
+    struct ReorderedMessage
+    {
+        bool complete = false;
+        uint16_t flags = 0;
+        std::string data;
+    };
+    std::vector<ReorderedMessage> m_reorder_buffer;
+    uint16_t m_next_delivery_id = 0;
+
+    // Snapshot streams only, used from the listener thread
+    std::unique_ptr<snapshot::Encoder> m_snapshot_encoder;
+    std::unique_ptr<snapshot::Decoder> m_snapshot_decoder;
+    std::vector<char> m_snapshot_buffer;
+    std::string m_snapshot_state;
+
+    // Messages are compressed when enabled, the receiver decompresses whatever carries COMPRESSED_FLAG
+    bool m_compression = false;
+    uint8_t m_compression_dictionary = 0;
+    std::vector<std::shared_ptr<const lz::Dictionary>> m_dictionaries;
+    std::vector<char> m_compressed;
+    std::string m_decompressed;
+
+    // Applications send through the client or server, which queue the data for the listener thread that owns the stream
+    friend class FalconClient;
+    friend class FalconServer;
+    // Drives streams over raw sockets, defined by the tests
+    friend struct StreamTestAccess;
+    void SendData(std::span<const char> data);
 public:
-    Stream(uint32_t stream_id, uint64_t client_uuid, IpPortPair target, Falcon* socket);
+    constexpr static uint32_t RELIABLE_STREAM_BIT = 1u << 31;
+    // Every message of a snapshot stream is a whole state, sent as a delta against the latest one the peer acknowledged
+    constexpr static uint32_t SNAPSHOT_STREAM_BIT = 1u << 29;
+    // Unreliable stream whose messages older than the newest delivered one are dropped, a late update never overwrites a newer one
+    // Set with RELIABLE_STREAM_BIT, messages are delivered in order: one arriving after a gap waits for the messages before it
+    constexpr static uint32_t SEQUENCED_STREAM_BIT = 1u << 28;
+    // Flag of compressed messages, the other flags are the application's
+    constexpr static int COMPRESSED_FLAG = 15;
+    // Smaller messages are sent as they are, compression would barely save anything on them
+    constexpr static size_t MIN_COMPRESSED_SIZE = 64;
+    constexpr static uint16_t WINDOW_SIZE = 64;
+    // Received messages waiting to be polled, later ones are dropped while it is full
+    constexpr static size_t RECEIVE_QUEUE_SIZE = 256;
+
+    using MessageHandler = std::function<void(const Message&)>;
+    // Runs a task on a thread of the application's choosing
+    using Executor = std::function<void(std::function<void()>)>;
+
+    Stream(uint32_t stream_id, uint64_t client_uuid, const Endpoint& target, Falcon* socket);
     ~Stream();
-    Stream(const Stream&) = default;
-    Stream& operator=(const Stream&) = default;
-    Stream(Stream&&) = default;
-    Stream& operator=(Stream&&) = default;
+    Stream(const Stream&) = delete;
+    Stream& operator=(const Stream&) = delete;
+    Stream(Stream&&) = delete;
+    Stream& operator=(Stream&&) = delete;
 
     uint16_t GetNewMessageID();
     void SetFlag(int flag_id, bool value);
@@ -31,16 +160,123 @@ public:
 
     uint32_t GetStreamID() const { return stream_id; }
     uint64_t GetClientUUID() const { return client_uuid; }
-    IpPortPair GetTargetIpPortPair() const { return target; }
+    const Endpoint& GetTarget() const { return target; }
     Falcon* GetSocket() const { return socket; }
+    bool IsReliable() const { return stream_id & RELIABLE_STREAM_BIT; }
+    bool IsSnapshot() const { return stream_id & SNAPSHOT_STREAM_BIT; }
+    bool IsSequenced() const { return (stream_id & (RELIABLE_STREAM_BIT | SEQUENCED_STREAM_BIT)) == SEQUENCED_STREAM_BIT; }
+    bool IsOrdered() const { return (stream_id & (RELIABLE_STREAM_BIT | SEQUENCED_STREAM_BIT)) == (RELIABLE_STREAM_BIT | SEQUENCED_STREAM_BIT); }
 
-    void SendData(std::span<const char> data);
     void OnDataReceived(std::span<const char> data);
+    // Returns the round trip time of the acknowledged part when it was only sent once
+    std::optional<std::chrono::steady_clock::duration> OnAckReceived(std::span<const char> data);
+    void OnSnapshotAckReceived(std::span<const char> data);
+
+    // Sends again the unacknowledged parts of messages in flight for longer than resend_interval, or queues them for Transmit
+    // when the stream has a congestion controller. Returns the number of messages concerned.
+    size_t ResendUnacknowledged(std::chrono::steady_clock::duration resend_interval);
+    size_t GetUnacknowledgedCount() const;
 
+    // Shared by the streams of a connection. Once set, reliable messages are only queued by SendData:
+    // Transmit sends them, and the parts presumed lost, as fast as the controller allows.
+    void SetCongestionController(std::shared_ptr<CongestionController> congestion);
+    // Returns when the pacer lets the next part out, or time_point::max() when nothing can be sent before an acknowledgement
+    std::chrono::steady_clock::time_point Transmit(std::chrono::steady_clock::time_point now);
+    // Used from the listener thread, set it before data arrives
+    void SetReassembler(std::shared_ptr<Reassembler> reassembler) { m_reassembler = std::move(reassembler); }
+    // Set it before sending, messages are cut into parts that fit the datagram size it discovered
+    void SetPathMtu(std::shared_ptr<PathMtuDiscovery> path_mtu) { m_path_mtu = std::move(path_mtu); }
+    void SetKeepalive(std::shared_ptr<Keepalive> keepalive) { m_keepalive = std::move(keepalive); }
+    // Used from the listener thread, messages are sent in the layout of this version from then on
+    void SetWireVersion(uint8_t version);
+    uint8_t GetWireVersion() const { return m_wire_version; }
+    // Compresses the following messages, against the dictionary of that id when not 0. Set it before sending.
+    void SetCompression(bool enabled, uint8_t dictionary = 0);
+    // The dictionaries of the connection, to compress and decompress with. Used from the listener thread, set it before data arrives.
+    void SetCompressionDictionaries(std::vector<std::shared_ptr<const lz::Dictionary>> dictionaries) { m_dictionaries = std::move(dictionaries); }
+    // Messages the server sends on streams of higher priority go first, streams of equal priority share the client's budget
+    // in proportion to their weights. Safe from any thread.
+    void SetPriority(int priority, uint32_t weight = 1) { m_priority = priority; m_weight = std::max<uint32_t>(weight, 1); }
+    int GetPriority() const { return m_priority; }
+    uint32_t GetWeight() const { return m_weight; }
+    // Largest message SendData accepts with the current datagram size
+    size_t GetMaxMessageSize() const;
+
+    // Moves the oldest received messages into messages and returns how many, the elements after them are left untouched.
+    // The buffers of the overwritten elements are recycled. Safe from one application thread at a time.
+    size_t PollMessages(std::span<Message> messages);
+    size_t GetDroppedMessageCount() const { return m_dropped_messages; }
+    // Received messages go to the handler instead of the receive queue, messages already queued stay there.
+    // Without an executor the handler runs on the listener thread and must not keep the message, with one each message is
+    // copied into a task handed to the executor. An empty handler goes back to queueing.
+    void SetMessageHandler(MessageHandler handler, Executor executor = nullptr);
+
+    // Last message received, overwritten by the next one. Only meaningful once traffic settled, PollMessages gets them all.
     const std::string& getLastData() const { return m_last_data; }
 protected:
-    void SendDataPart(uint8_t part_id, uint8_t part_total, std::span<const char> data);
+    void SendDataPart(uint16_t message_id, uint16_t part_id, uint16_t part_total, uint16_t part_size, bool compressed, std::span<const char> data);
+    void SendPart(OutgoingMessage& message, uint16_t part_id, std::chrono::steady_clock::time_point now);
+    void SendMessage(OutgoingMessage& message);
+    void SendPending();
+    bool IsNewPart(uint16_t message_id, uint16_t part_id, uint16_t part_total) const;
+    bool MarkReceived(uint16_t message_id, uint16_t part_id, uint16_t part_total);
+    // Unpacks the complete message in m_last_data and delivers it
+    void OnMessageComplete(uint16_t message_flags);
+    void Deliver(std::span<const char> payload);
+    void SendAck(uint16_t message_id, uint16_t part_id);
+    void SendSnapshotAck(uint16_t sequence);
+    // Return false when compression would not pay off or the message cannot be decompressed
+    bool Compress(std::span<const char> data);
+    bool Decompress(std::span<const char> data);
+    const lz::Dictionary* FindDictionary(uint8_t id) const;
+
+private:
+    struct MessageDelivery
+    {
+        MessageHandler handler;
+        Executor executor;
+    };
+    // Replaced as a whole, the listener thread keeps calling the previous handler until it picks the new one up
+    std::shared_ptr<const MessageDelivery> m_delivery;
+    std::mutex m_delivery_mutex;
+    // Handed to handlers run on the listener thread, its buffer is reused from one message to the next
+    Message m_handler_message;
 };
 
+// Work an application thread hands over to the listener thread that owns the streams of its connections
+struct StreamCommand
+{
+    enum class Type : uint8_t { Open, Close, Send };
+    constexpr static size_t INLINE_SIZE = 256;
+
+    Type type = Type::Send;
+    uint64_t client_id = 0;
+    uint32_t stream_id = 0;
+    // Stream to register, for Open
+    std::shared_ptr<Stream> stream;
+
+    // Payload to send, copied in place when small enough so steady traffic does not allocate
+    void SetData(std::span<const char> data)
+    {
+        size = data.size();
+        if (size <= INLINE_SIZE)
+        {
+            memcpy(inline_data.data(), data.data(), size);
+        }
+        else
+        {
+            heap_data.assign(data.begin(), data.end());
+        }
+    }
+    std::span<const char> GetData() const
+    {
+        return size <= INLINE_SIZE ? std::span<const char>(inline_data).first(size) : std::span<const char>(heap_data);
+    }
+
+private:
+    size_t size = 0;
+    std::array<char, INLINE_SIZE> inline_data;
+    std::vector<char> heap_data;
+};
 
 #endif //STREAM_H
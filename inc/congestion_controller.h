@@ -0,0 +1,71 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <limits>
+
+// Per connection limit on reliable traffic: how many bytes may be in flight and how fast they go out.
+// The base class does the bookkeeping and the pacing, subclasses only decide the size of the window.
+// Not thread safe, it is used from the listener thread of the connection.
+class CongestionController
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    constexpr static size_t MAX_SEGMENT_SIZE = 1472;
+
+    virtual ~CongestionController() = default;
+
+    void OnPacketSent(size_t bytes, Clock::time_point now);
+    // sent_at is the send time of the most recent packet in the group
+    void OnPacketsAcked(size_t bytes, Clock::time_point sent_at);
+    void OnPacketsLost(size_t bytes, Clock::time_point sent_at, Clock::time_point now);
+    void OnRetransmissionTimeout(Clock::time_point now);
+    // Paces sends over this round trip time, sends are not paced until it is known
+    void SetSmoothedRtt(Clock::duration rtt) { m_smoothed_rtt = rtt; }
+
+    // A packet always fits when nothing is in flight, so packets larger than the window still get through
+    bool HasWindowFor(size_t bytes) const { return m_bytes_in_flight == 0 || m_bytes_in_flight + bytes <= GetWindow(); }
+    // Earliest time the pacer lets the next packet out
+    Clock::time_point GetNextSendTime() const { return m_next_send_time; }
+    size_t GetBytesInFlight() const { return m_bytes_in_flight; }
+
+    virtual size_t GetWindow() const = 0;
+
+protected:
+    virtual void OnAcked(size_t bytes, Clock::time_point sent_at) = 0;
+    virtual void OnLost(Clock::time_point sent_at, Clock::time_point now) = 0;
+    virtual void OnTimeout(Clock::time_point now) = 0;
+
+private:
+    // The window is spread over a round trip slightly faster than it drains, bursts of a few segments are let through after idle time
+    constexpr static int PACING_GAIN_PERCENT = 125;
+    constexpr static size_t PACING_BURST = 10 * MAX_SEGMENT_SIZE;
+
+    size_t m_bytes_in_flight = 0;
+    Clock::duration m_smoothed_rtt{};
+    Clock::time_point m_next_send_time{};
+};
+
+// Loss based window from RFC 6582: slow start, additive increase, halved once per round trip with losses.
+class NewRenoController : public CongestionController
+{
+public:
+    constexpr static size_t INITIAL_WINDOW = 10 * MAX_SEGMENT_SIZE;
+    constexpr static size_t MINIMUM_WINDOW = 2 * MAX_SEGMENT_SIZE;
+
+    size_t GetWindow() const override { return m_window; }
+    size_t GetSlowStartThreshold() const { return m_slow_start_threshold; }
+
+protected:
+    void OnAcked(size_t bytes, Clock::time_point sent_at) override;
+    void OnLost(Clock::time_point sent_at, Clock::time_point now) override;
+    void OnTimeout(Clock::time_point now) override;
+
+private:
+    size_t m_window = INITIAL_WINDOW;
+    size_t m_slow_start_threshold = std::numeric_limits<size_t>::max();
+    size_t m_acked_in_avoidance = 0;
+    // Packets sent before this point belong to a loss episode the window already reacted to
+    Clock::time_point m_recovery_start{};
+};
@@ -5,7 +5,24 @@
 #include <span>
 #include <functional>
 #include <thread>
+#include <chrono>
 #include <cstring>
+#include <cstddef>
+#include <array>
+#include <atomic>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <random>
+#include <string_view>
+#include <unordered_map>
+#include "packet_pool.h"
+#include "timer_wheel.h"
+#include "rtt_estimator.h"
+#include "congestion_controller.h"
+#include "path_mtu.h"
+#include "wire_format.h"
+#include "lz_codec.h"
 
 #ifdef WIN32
     using SocketType = unsigned int;
@@ -13,10 +30,96 @@
     using SocketType = int;
 #endif
 
-struct IpPortPair
+// Socket address resolved once and reused for every send, backed by storage the size of a sockaddr_storage.
+class Endpoint
 {
-    std::string ip;
-    uint16_t port;
+public:
+    constexpr static size_t STORAGE_SIZE = 128;
+
+    static Endpoint Resolve(const std::string& ip, uint16_t port);
+
+    std::string ToString() const;
+    bool IsValid() const { return m_size != 0; }
+
+    std::byte* Data() { return m_storage.data(); }
+    const std::byte* Data() const { return m_storage.data(); }
+    uint32_t Size() const { return m_size; }
+    void SetSize(uint32_t size) { m_size = size; }
+
+    bool operator==(const Endpoint& other) const
+    {
+        return m_size == other.m_size && memcmp(m_storage.data(), other.m_storage.data(), m_size) == 0;
+    }
+
+private:
+    alignas(8) std::array<std::byte, STORAGE_SIZE> m_storage{};
+    uint32_t m_size = 0;
+};
+
+template<>
+struct std::hash<Endpoint>
+{
+    size_t operator()(const Endpoint& endpoint) const noexcept
+    {
+        return std::hash<std::string_view>{}(std::string_view(reinterpret_cast<const char*>(endpoint.Data()), endpoint.Size()));
+    }
+};
+
+struct ConnectionSettings
+{
+    // Silence after which the peer is considered gone
+    std::chrono::milliseconds timeout{ 1000 };
+    // Delay before unacknowledged reliable data is sent again, until a round trip time has been measured
+    std::chrono::milliseconds resend_interval{ 500 };
+    // Bounds of the retransmission timeout derived from the measured round trip time
+    std::chrono::milliseconds min_resend_interval{ 10 };
+    std::chrono::milliseconds max_resend_interval{ 1000 };
+    // Memory one connection may spend on incomplete multi-part messages, and how long unreliable ones wait for their missing parts
+    size_t max_reassembly_bytes = 64 * 1024 * 1024;
+    std::chrono::milliseconds reassembly_timeout{ 1000 };
+    // Datagram sizes path MTU discovery searches between, message parts are cut to fit the size it finds. Equal bounds disable probing.
+    uint16_t min_datagram_size = PathMtuDiscovery::BASE_DATAGRAM_SIZE;
+    uint16_t max_datagram_size = 1472;
+    // Delay before probing again for a larger datagram size once the search is over
+    std::chrono::milliseconds mtu_raise_interval{ 600000 };
+    // Creates the congestion controller of each connection. Reliable streams are neither congestion controlled nor paced when empty.
+    std::function<std::shared_ptr<CongestionController>()> congestion_controller = []() -> std::shared_ptr<CongestionController> {
+        return std::make_shared<NewRenoController>();
+    };
+    // Both sides check their connections this often and ping the peer over those that sent nothing since the last check,
+    // traffic keeps the link alive on its own. A ping received puts off the next check, the pong answering it is traffic,
+    // so only one side pings an idle link. The pongs double as round trip time samples. Zero derives it from timeout.
+    std::chrono::milliseconds ping_interval{ 0 };
+    // A third of the timeout unless set, so a lost ping or two do not end the connection
+    std::chrono::milliseconds GetPingInterval() const { return ping_interval.count() > 0 ? ping_interval : timeout / 3; }
+    // Bytes per second the server sends one client, 0 for no limit, and how many may go out at once after idle time.
+    // Streams of higher priority are served first. Past the budget the next message waits for the refill, unreliable messages
+    // of lower priority are dropped and reliable ones wait.
+    uint64_t send_budget = 0;
+    size_t send_burst = 16 * 1024;
+    // Pre-trained dictionaries compressed streams may use, dictionary id n is element n - 1. Both peers need the same ones.
+    std::vector<std::shared_ptr<const lz::Dictionary>> compression_dictionaries;
+};
+
+// Impairments applied to received datagrams, to test on loopback how traffic behaves on a worse link
+struct NetworkConditions
+{
+    // Share of datagrams dropped at random
+    double loss_rate = 0.0;
+    // Delay added to every datagram
+    std::chrono::milliseconds latency{ 0 };
+    // Bottleneck rate in bytes per second and the size in bytes of the queue in front of it, 0 for unlimited
+    uint64_t bandwidth = 0;
+    size_t queue_size = 0;
+    // Datagrams larger than this are dropped as by a link with a smaller MTU, 0 for no limit
+    size_t max_datagram_size = 0;
+};
+
+struct Datagram
+{
+    Endpoint from;
+    std::span<char> buffer;
+    int size = 0;
 };
 
 class Falcon {
@@ -30,26 +133,138 @@ public:
     Falcon(Falcon&&) = default;
     Falcon& operator=(Falcon&&) = default;
     
-    const uint8_t m_version = 1;
+    // Sent at CONNECT, a connection uses the lowest version of both peers
+    const uint8_t m_version = wire::VERSION_COMPACT;
 
     bool IsListening() const { 
         return m_listen;
     }
+
+    // Settings given to new connections
+    void SetConnectionSettings(const ConnectionSettings& settings) { m_connection_settings = settings; }
+    const ConnectionSettings& GetConnectionSettings() const { return m_connection_settings; }
+    // Applies to what the listener receives. Set before listening or connecting.
+    void SimulateNetworkConditions(const NetworkConditions& conditions) { m_network_conditions = conditions; }
+    const NetworkConditions& GetNetworkConditions() const { return m_network_conditions; }
+    // Opt-in: small datagrams to the same peer are held for up to window and packed together in one BATCH datagram no larger
+    // than min_datagram_size, acknowledgements and pings included. Set before listening or connecting, zero sends each one on its own.
+    void SetCoalescingWindow(std::chrono::microseconds window) { m_coalescing_window = window; }
+    std::chrono::microseconds GetCoalescingWindow() const { return m_coalescing_window; }
+    // Sends the datagrams held for coalescing right away, at the end of a tick for instance. Safe to call from any thread.
+    void Flush();
     int SendTo(const std::string& to, uint16_t port, std::span<const char> message);
+    int SendTo(const Endpoint& to, std::span<const char> message);
+    // Sends the parts back to back as a single datagram without joining them in an intermediate buffer.
+    int SendTo(const Endpoint& to, std::span<const std::span<const char>> parts);
     int ReceiveFrom(std::string& from, std::span<char, 65535> message);
+
+    // Fills as many datagrams as are ready (up to MAX_BATCH_SIZE), waiting at most m_timeout_ms for the first one.
+    // Returns the number of filled entries.
+    int ReceiveFromBatch(std::span<Datagram> datagrams);
+    // Sends everything queued by SendTo calls made from the listener thread, in as few syscalls as possible.
+    int FlushSendQueue();
+
+    constexpr static size_t MAX_BATCH_SIZE = 32;
+    constexpr static size_t MAX_DATAGRAM_SIZE = 65535;
+    constexpr static size_t MAX_GATHER_PARTS = 8;
 protected:
 
     virtual void CreateServer(uint16_t port);
     virtual void CreateClient(const std::string& ip);
 
     std::thread m_listener;
-    bool m_listen = false;
+    std::atomic<bool> m_listen = false;
 
     SocketType m_socket{};
+    // Lets several sockets bind the same port so the kernel spreads incoming datagrams between them
+    bool m_reuse_port = false;
 
     int m_timeout_ms = 100;
 
+    ConnectionSettings m_connection_settings;
+    // Timeouts, resends and pings, driven by the listener thread
+    TimerWheel m_timers;
+
+    // Sends issued from the calling thread are queued until the next FlushSendQueue instead of going out immediately.
+    void EnableSendBatching();
+    void DisableSendBatching();
+
+    // Receives into the socket's preallocated ring. The returned datagrams are views that stay valid until the next call.
+    // Blocks until a datagram arrives, timeout_ms elapses (-1 waits forever) or another thread calls Wakeup.
+    std::span<const Datagram> ReceiveBatch(int timeout_ms);
+    // Interrupts a listener blocked in ReceiveBatch. Safe to call from any thread.
+    void Wakeup();
+    // Milliseconds left until deadline, rounded up so the listener never wakes up just before it.
+    static int TimeoutUntil(std::chrono::steady_clock::time_point deadline);
+
+    // A path MTU probe is padded to the size it tests, its acknowledgement echoes that size
+    constexpr static size_t MTU_PROBE_HEADER_SIZE = 13;
+    void SendMtuProbe(const Endpoint& to, uint64_t uuid, uint16_t size);
+    void SendMtuProbeAck(const Endpoint& to, uint64_t uuid, std::span<const char> probe);
+
+    // Sends the coalesced datagrams whose window elapsed. Called by the listener thread, which wakes up again by the next deadline.
+    void FlushCoalesced(std::chrono::steady_clock::time_point now);
+    std::chrono::steady_clock::time_point NextCoalescingDeadline();
+
 private:
+    struct QueuedDatagram
+    {
+        Endpoint to;
+        int buffer;
+        std::span<const char> data;
+    };
+    constexpr static size_t SEND_POOL_SIZE = 2 * MAX_BATCH_SIZE;
+    // Queued sends are small control packets, larger ones bypass the queue and go out immediately.
+    constexpr static size_t SEND_SLOT_SIZE = 2048;
+    // Both pools are allocated on first use, then reused for the lifetime of the socket.
+    PacketPool m_send_pool;
+    std::vector<QueuedDatagram> m_send_queue;
+    PacketPool m_receive_pool;
+    std::array<Datagram, MAX_BATCH_SIZE> m_receive_ring;
+    // Messages unpacked from received BATCH datagrams, viewing the receive ring
+    std::vector<Datagram> m_unbatched;
+    std::span<const Datagram> Unbatch(std::span<const Datagram> datagrams);
+
+    // A BATCH datagram is its type and size, then every message prefixed with its size
+    constexpr static size_t BATCH_HEADER_SIZE = 3;
+    constexpr static size_t BATCH_FRAME_SIZE = 2;
+    struct CoalescedDatagram
+    {
+        std::vector<char> data;
+        uint16_t count = 0;
+        std::chrono::steady_clock::time_point flush_at;
+    };
+    std::chrono::microseconds m_coalescing_window{ 0 };
+    std::mutex m_coalescing_mutex;
+    std::unordered_map<Endpoint, CoalescedDatagram> m_coalescing;
+    std::chrono::steady_clock::time_point m_coalescing_deadline = std::chrono::steady_clock::time_point::max();
+    int Coalesce(const Endpoint& to, std::span<const std::span<const char>> parts, size_t size);
+    void SendCoalesced(const Endpoint& to, CoalescedDatagram& coalesced);
+    int SendNow(const Endpoint& to, std::span<const std::span<const char>> parts, size_t size);
+
+    // Datagrams held back by the simulated link until their release time
+    struct DelayedDatagram
+    {
+        std::chrono::steady_clock::time_point release_at;
+        Endpoint from;
+        std::vector<char> data;
+    };
+    NetworkConditions m_network_conditions;
+    std::deque<DelayedDatagram> m_delayed_datagrams;
+    std::chrono::steady_clock::time_point m_link_free_at{};
+    std::minstd_rand m_loss_random;
+    std::span<const Datagram> ReceiveImpaired(int timeout_ms);
+
+#ifndef WIN32
+    // epoll instance on Linux. The wakeup descriptors are the same eventfd on Linux and the two ends of a pipe elsewhere.
+    int m_reactor_fd = -1;
+    int m_wakeup_read_fd = -1;
+    int m_wakeup_write_fd = -1;
+#endif
+    void CreateReactor();
+    void CloseReactor();
+    bool WaitReadable(int timeout_ms);
+
     virtual void Listen(uint16_t port) {}
     virtual void OnClientConnected(std::function<void(uint64_t)> handler) {}
    
@@ -59,6 +274,9 @@ private:
     virtual void OnClientDisconnected(std::function<void(uint64_t)> handler) {} //Server API 
     virtual void OnDisconnect(std::function<void()> handler) {}  //Client API
     
-    int SendToInternal(const std::string& to, uint16_t port, std::span<const char> message);
+    int SendToInternal(const Endpoint& to, std::span<const char> message);
+    int SendGatherInternal(const Endpoint& to, std::span<const std::span<const char>> parts);
     int ReceiveFromInternal(std::string& from, std::span<char, 65535> message);
+    int SendBatchInternal(std::span<const QueuedDatagram> datagrams);
+    int ReceiveBatchInternal(std::span<Datagram> datagrams, int timeout_ms);
 };
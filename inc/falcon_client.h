@@ -5,6 +5,10 @@
 #include <chrono>
 #include <map>
 #include <list>
+#include <set>
+#include <atomic>
+#include <mutex>
+#include "mpsc_queue.h"
 
 class FalconClient : 
 	public Falcon
@@ -29,28 +33,84 @@ public :
 
     uint64_t GetId() const { return m_id; }
 
-    void SendData(std::span<const char> data, uint32_t stream_id);
+    // Smoothed round trip time to the server, zero until measured, and the current retransmission timeout
+    std::chrono::microseconds GetRtt() const;
+    std::chrono::microseconds GetRto() const;
+    // Largest datagram known to reach the server, message parts are cut to fit it
+    uint16_t GetMaxDatagramSize() const;
 
-    const std::map<uint32_t, Stream*>& GetStreams() const { return m_streams; }
-    const std::map<uint32_t, std::span<const char>>& GetStreamsAck() const { return m_streams_ack; }
+    // Safe from any thread: the data is queued for the listener thread, which owns the streams.
+    // Returns false when the queue is full, the data is not sent then.
+    bool SendData(std::span<const char> data, uint32_t stream_id);
 
-    std::unique_ptr<Stream> CreateStream(bool reliable);
+    // Safe from any thread. Null when the stream is unknown, a stream created by CreateStream is only found once the
+    // listener thread registered it.
+    std::shared_ptr<Stream> GetStream(uint32_t stream_id) const;
+    size_t GetStreamCount() const;
+    // Reliable streams with messages waiting for an acknowledgement
+    size_t GetStreamsAwaitingAck() const;
+
+    // Safe from any thread, the stream is registered by the listener thread. Null when the command queue is full.
+    std::shared_ptr<Stream> CreateStream(bool reliable);
+    // Unreliable stream of whole states, sent as deltas against the latest one the server acknowledged
+    std::shared_ptr<Stream> CreateSnapshotStream();
+    // Unreliable stream delivering only messages newer than the last delivered one, for state updates
+    std::shared_ptr<Stream> CreateSequencedStream();
+    // Reliable stream delivering messages in the order they were sent, a loss only holds back the messages of this stream
+    std::shared_ptr<Stream> CreateOrderedStream();
+    // Safe from any thread, the server is told and the stream forgotten by the listener thread
+    bool CloseStream(const Stream& stream);
 private :    
-    uint32_t m_lastUsedStreamID = 0;
+    std::atomic<uint32_t> m_lastUsedStreamID = 0;
     uint32_t GetNewStreamID(bool reliable);
-    std::unique_ptr<Stream> MakeStream(uint32_t stream_id, bool reliable);
+    std::shared_ptr<Stream> OpenStream(uint32_t stream_id);
+    std::shared_ptr<Stream> MakeStream(uint32_t stream_id);
+    void RegisterStream(std::shared_ptr<Stream> stream);
+    void ForgetStream(uint32_t stream_id);
 
-    std::vector<std::unique_ptr<Stream>> m_local_streams;
+    bool SubmitCommand(StreamCommand&& command);
+    void ProcessCommands();
 
     static void ThreadListen(FalconClient& client);
 
-    IpPortPair server;
-    uint64_t m_id;
-    std::map<uint32_t, Stream*> m_streams;
-    std::map<uint32_t, std::span<const char>> m_streams_ack;
-    bool m_connected = false;
+    void OnTimeout();
+    void SendPing();
+    void OnKeepaliveTimer();
+    void ResendUnacknowledged();
+    void AddRttSample(std::chrono::steady_clock::duration rtt);
+    void TransmitPending();
+    void ProbePathMtu();
+
+    TimerWheel::TimerId m_timeout_timer = TimerWheel::INVALID_TIMER;
+    TimerWheel::TimerId m_ping_timer = TimerWheel::INVALID_TIMER;
+    TimerWheel::TimerId m_resend_timer = TimerWheel::INVALID_TIMER;
+    TimerWheel::TimerId m_transmit_timer = TimerWheel::INVALID_TIMER;
+    TimerWheel::TimerId m_probe_timer = TimerWheel::INVALID_TIMER;
+    uint16_t m_ping_id = 0;
+    // Updated by the listener thread, read by any thread
+    mutable std::mutex m_rtt_mutex;
+    RttEstimator m_rtt;
+    // Shared by the reliable streams, used from the listener thread
+    std::shared_ptr<CongestionController> m_congestion;
+    std::shared_ptr<Reassembler> m_reassembler;
+    std::shared_ptr<PathMtuDiscovery> m_path_mtu;
+    std::shared_ptr<Keepalive> m_keepalive;
+    // Layout of the data messages of the streams, negotiated at CONNECT
+    uint8_t m_wire_version = wire::VERSION_FIXED;
+    // Commands from application threads, drained by the listener thread. The flag saves a wakeup per command.
+    MpscQueue<StreamCommand> m_commands{ COMMAND_QUEUE_SIZE };
+    std::atomic<bool> m_commands_signaled = false;
+
+    Endpoint server;
+    std::atomic<uint64_t> m_id = 0;
+    // Only the listener thread modifies them, under the mutex so other threads can read them
+    std::map<uint32_t, std::shared_ptr<Stream>> m_streams;
+    std::set<uint32_t> m_streams_ack;
+    mutable std::mutex m_streams_mutex;
+    std::atomic<bool> m_connected = false;
 
 
     constexpr static uint32_t CLIENT_STREAM_BIT = ~(1 << 30);
     constexpr static uint32_t RELIABLE_STREAM_BIT = 1 << 31;
+    constexpr static size_t COMMAND_QUEUE_SIZE = 1024;
 };
\ No newline at end of file
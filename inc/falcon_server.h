@@ -6,6 +6,12 @@
 #include "Stream.h"
 #include <map>
 #include <set>
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include "mpsc_queue.h"
+#include "session_table.h"
+#include "send_scheduler.h"
 
 class FalconServer :
 	public Falcon
@@ -19,40 +25,141 @@ public :
     FalconServer& operator=(FalconServer&&) = default;
 
 	void Listen(uint16_t port) override;
+    // Serves the port from shard_count listener threads, each with its own SO_REUSEPORT socket and its own clients.
+    // Only Linux spreads datagrams across such sockets, other platforms always run a single shard.
+    // Connection callbacks may then be invoked concurrently from different listener threads.
+    void Listen(uint16_t port, uint32_t shard_count);
+    uint32_t GetShardCount() const { return static_cast<uint32_t>(m_shards.size()) + 1; }
     virtual void OnClientConnected(std::function<void(uint64_t)> handler) override;
     virtual void OnClientDisconnected(std::function<void(uint64_t)> handler) override;
 
     std::function<void(uint64_t)> m_on_client_connect = nullptr;
     std::function<void(uint64_t)> m_on_client_disconnect = nullptr;
 
-    uint32_t GetActiveClientCount() const { return m_active_client_count; }
+    uint32_t GetActiveClientCount() const;
 
-    std::unique_ptr<Stream> CreateStream(uint64_t client, bool reliable);
-    void CloseStream(const Stream& stream);
+    void SetConnectionSettings(const ConnectionSettings& settings);
+    void SetConnectionSettings(uint64_t client_id, const ConnectionSettings& settings);
 
+    // Smoothed round trip time to a client, zero until measured, and its current retransmission timeout
+    std::chrono::microseconds GetRtt(uint64_t client_id) const;
+    std::chrono::microseconds GetRto(uint64_t client_id) const;
+    // Largest datagram known to reach a client, message parts are cut to fit it
+    uint16_t GetMaxDatagramSize(uint64_t client_id) const;
 
-    void SendData(std::span<const char> data, uint64_t client_id, uint32_t stream_id);
+    // Stream calls are safe from any thread: they are queued for the listener thread owning the client, which owns its streams.
+    // CreateStream returns null for an unknown client or when the command queue is full, the others return false then.
+    std::shared_ptr<Stream> CreateStream(uint64_t client, bool reliable);
+    // Unreliable stream of whole states, sent as deltas against the latest one the client acknowledged
+    std::shared_ptr<Stream> CreateSnapshotStream(uint64_t client);
+    // Unreliable stream delivering only messages newer than the last delivered one, for state updates
+    std::shared_ptr<Stream> CreateSequencedStream(uint64_t client);
+    // Reliable stream delivering messages in the order they were sent, a loss only holds back the messages of this stream
+    std::shared_ptr<Stream> CreateOrderedStream(uint64_t client);
+    bool CloseStream(const Stream& stream);
 
-    const std::unordered_map<uint64_t, std::map<uint32_t, Stream*>>& GetStreams() const { return m_streams; }
-    const std::unordered_map<uint64_t, std::map<uint32_t, std::span<const char>>>& GetStreamsAck() const { return m_streams_ack; }
+
+    bool SendData(std::span<const char> data, uint64_t client_id, uint32_t stream_id);
+
+    // Safe from any thread. Null when the client or the stream is unknown, a stream created by CreateStream is only
+    // found once the listener thread registered it.
+    std::shared_ptr<Stream> GetStream(uint64_t client_id, uint32_t stream_id) const;
+    size_t GetStreamCount(uint64_t client_id) const;
+    // Reliable streams of a client with messages waiting for an acknowledgement
+    size_t GetStreamsAwaitingAck(uint64_t client_id) const;
 
 private:
-    std::unordered_map<uint64_t, uint32_t> m_lastUsedStreamID;
-    uint32_t GetNewStreamID(bool reliable, uint64_t client);
-    std::unique_ptr<Stream> MakeStream(uint32_t stream_id, uint64_t client, bool reliable);
+    FalconServer(FalconServer& owner, uint32_t shard_index);
+    FalconServer& Owner() { return m_owner != nullptr ? *m_owner : *this; }
+    FalconServer& Shard(uint64_t client_id);
+    const FalconServer& Shard(uint64_t client_id) const;
+    std::shared_ptr<Stream> OpenStream(uint64_t client, uint32_t stream_id);
+
+    // Stream ids only need to be unique per client, one counter serves all the clients of a shard
+    std::atomic<uint32_t> m_lastUsedStreamID = 0;
+    uint32_t GetNewStreamID(bool reliable);
+    std::shared_ptr<Stream> MakeStream(uint32_t stream_id, uint64_t client);
+    // Returns the registered stream, the one already registered under the same id, or null when the client is gone
+    Stream* RegisterStream(uint64_t client, std::shared_ptr<Stream> stream);
+    void ForgetStream(uint64_t client, uint32_t stream_id);
+
+    bool SubmitCommand(StreamCommand&& command);
+    void ProcessCommands();
 
 
     static void ThreadListen(FalconServer& server);
-    uint64_t usable_id = 0;
 
-    std::unordered_map<uint64_t, IpPortPair> m_clients;
-    std::unordered_map<uint64_t, std::map<uint32_t, Stream*>> m_streams;
-    std::unordered_map<uint64_t, std::map<uint32_t, std::span<const char>>> m_streams_ack;
+    // Everything the server keeps about a client, in one slot of the session table
+    struct ClientConnection
+    {
+        // Defined out of line: the session table needs it before FalconServer is complete
+        ClientConnection();
+
+        Endpoint endpoint;
+        // A client has few streams: their ids are scanned in a contiguous array, the streams are only touched once found
+        std::vector<uint32_t> stream_ids;
+        std::vector<std::shared_ptr<Stream>> streams;
+        // Reliable streams with messages waiting for an acknowledgement
+        std::vector<uint32_t> streams_ack;
+        ConnectionSettings settings;
+        TimerWheel::TimerId timeout = TimerWheel::INVALID_TIMER;
+        TimerWheel::TimerId resend = TimerWheel::INVALID_TIMER;
+        TimerWheel::TimerId transmit = TimerWheel::INVALID_TIMER;
+        TimerWheel::TimerId probe = TimerWheel::INVALID_TIMER;
+        TimerWheel::TimerId ping = TimerWheel::INVALID_TIMER;
+        TimerWheel::TimerId release = TimerWheel::INVALID_TIMER;
+        uint16_t ping_id = 0;
+        RttEstimator rtt;
+        std::shared_ptr<CongestionController> congestion;
+        std::shared_ptr<Reassembler> reassembler;
+        std::shared_ptr<PathMtuDiscovery> path_mtu;
+        std::shared_ptr<Keepalive> keepalive;
+        // What the application sends waits here, to go out by priority within the budget
+        SendScheduler scheduler;
+        // Layout of the data messages of its streams, negotiated at CONNECT
+        uint8_t wire_version = wire::VERSION_FIXED;
+
+        Stream* FindStream(uint32_t stream_id) const;
+    };
+    void ApplyConnectionSettings(uint64_t client_id, const ConnectionSettings& settings);
+    void OnClientTimeout(uint64_t client_id);
+    void RemoveClient(uint64_t client_id);
+    void ArmResend(uint64_t client_id);
+    void ResendUnacknowledged(uint64_t client_id);
+    void TransmitPending(uint64_t client_id);
+    // Sends what the scheduler of the client lets out, and comes back once the budget refilled for the rest
+    void ReleaseScheduled(uint64_t client_id);
+    void AddRttSample(uint64_t client_id, std::chrono::steady_clock::duration rtt);
+    void ProbePathMtu(uint64_t client_id);
+    void OnKeepaliveTimer(uint64_t client_id);
+
+    // Indexed by client id. Only the listener thread modifies connections, the table and the stream lists
+    // of a connection under the mutex so other threads can read them.
+    SessionTable<ClientConnection> m_connections;
+    mutable std::mutex m_connections_mutex;
+    // Settings changes from other threads for connections owned by the listener thread
+    std::mutex m_requests_mutex;
+    std::vector<std::pair<uint64_t, ConnectionSettings>> m_settings_requests;
+    std::vector<std::pair<uint64_t, ConnectionSettings>> m_settings_requests_drained;
+
     uint64_t m_new_client{};
     uint64_t m_last_disconnected_client{};
-    std::unordered_map<uint64_t, std::vector<std::unique_ptr<Stream>>> m_local_streams;
+    // Stream commands from application threads, drained by the listener thread. The flag saves a wakeup per command.
+    MpscQueue<StreamCommand> m_commands{ COMMAND_QUEUE_SIZE };
+    std::atomic<bool> m_commands_signaled = false;
+    // Clients sent to by the commands being drained, released together once all are queued so priorities apply between them
+    std::vector<uint64_t> m_scheduled_clients;
+    std::vector<char> m_released_message;
+
+    std::atomic<uint32_t> m_active_client_count{};
 
-    uint32_t m_active_client_count{};
+    // Shards other than the first one, which is the server itself. A client id carries the index of the shard serving it in its top bits.
+    std::vector<std::unique_ptr<FalconServer>> m_shards;
+    FalconServer* m_owner = nullptr;
+    uint32_t m_shard_index = 0;
+    constexpr static int SHARD_SHIFT = SessionTable<ClientConnection>::KEY_BITS;
+    constexpr static uint32_t MAX_SHARDS = 64;
+    constexpr static size_t COMMAND_QUEUE_SIZE = 1024;
 
     constexpr static uint32_t SERVER_STREAM_BIT = 1 << 30;
     constexpr static uint32_t RELIABLE_STREAM_BIT = 1 << 31;
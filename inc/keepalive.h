@@ -0,0 +1,26 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+// Counts what a connection sends so keepalives only go out on a link that stayed idle: any datagram, data or
+// acknowledgement, tells the peer the connection is alive as well as a keepalive would.
+// Shared by the streams of a connection, which count from any thread, and checked by the keepalive timer of the listener thread.
+class Keepalive
+{
+public:
+    void OnSent() { m_sent.fetch_add(1, std::memory_order_relaxed); }
+
+    // Returns true when nothing was sent since the previous call
+    bool IsIdle()
+    {
+        const uint64_t sent = m_sent.load(std::memory_order_relaxed);
+        const bool idle = sent == m_checked;
+        m_checked = sent;
+        return idle;
+    }
+
+private:
+    std::atomic<uint64_t> m_sent = 0;
+    uint64_t m_checked = 0;
+};
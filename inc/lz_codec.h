@@ -0,0 +1,44 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <vector>
+
+// Byte oriented LZ77 codec in the style of the LZ4 block format, for message payloads. Each sequence is a token holding a
+// literal length and a match length, the literals, then the 16 bit distance of the match. The last sequence has no match.
+// Matches may reach back into a dictionary of bytes both sides know, so short messages compress against typical content.
+namespace lz
+{
+    constexpr size_t MIN_MATCH = 4;
+    constexpr size_t MAX_DISTANCE = 65535;
+    constexpr int HASH_BITS = 12;
+    constexpr size_t HASH_SIZE = size_t(1) << HASH_BITS;
+
+    // Positions of 4 byte sequences, plus one so zero means none
+    using HashTable = std::array<uint32_t, HASH_SIZE>;
+
+    // Pre-trained content, only its last MAX_DISTANCE bytes can be matched. Indexed once, then shared by every stream using it.
+    class Dictionary
+    {
+    public:
+        explicit Dictionary(std::span<const char> content);
+
+        std::span<const char> Content() const { return m_content; }
+        const HashTable& Table() const { return m_table; }
+
+    private:
+        std::vector<char> m_content;
+        HashTable m_table{};
+    };
+
+    // Worst case of incompressible input
+    constexpr size_t MaxCompressedSize(size_t size) { return size + size / 255 + 16; }
+
+    // Replaces out with the compressed input
+    void Compress(std::span<const char> input, std::vector<char>& out, const Dictionary* dictionary = nullptr);
+    // Returns false unless input is well formed and decompresses to exactly size bytes
+    bool Decompress(std::span<const char> input, size_t size, std::string& out, const Dictionary* dictionary = nullptr);
+}
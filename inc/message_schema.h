@@ -0,0 +1,223 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <span>
+#include <type_traits>
+#include "message_type.h"
+
+// Layouts of the fixed size messages, each described once as a chain of fields. Offsets are resolved at compile time:
+// setting or getting a field is one memcpy at a constant offset, and a field outside its message does not compile.
+namespace schema
+{
+    // A field of type T right after Previous, or first in the message
+    template<typename T, typename Previous = void>
+    struct Field
+    {
+        static_assert(std::is_trivially_copyable_v<T>);
+        using Value = T;
+        constexpr static size_t OFFSET = Previous::END;
+        constexpr static size_t END = OFFSET + sizeof(T);
+    };
+
+    template<typename T>
+    struct Field<T, void>
+    {
+        static_assert(std::is_trivially_copyable_v<T>);
+        using Value = T;
+        constexpr static size_t OFFSET = 0;
+        constexpr static size_t END = sizeof(T);
+    };
+
+    // Type and size of the message, first in every layout
+    struct Header
+    {
+        using Type = Field<MessageType>;
+        using Size = Field<uint16_t, Type>;
+    };
+
+    // Every message but CONNECT and BATCH names its client
+    struct ClientHeader : Header
+    {
+        using ClientId = Field<uint64_t, Size>;
+        constexpr static size_t SIZE = ClientId::END;
+    };
+
+    // Messages about a stream name it right after the client
+    struct StreamHeader : ClientHeader
+    {
+        using StreamId = Field<uint32_t, ClientId>;
+        constexpr static size_t SIZE = StreamId::END;
+    };
+
+    struct Connect : Header
+    {
+        constexpr static MessageType TYPE = CONNECT;
+        using Version = Field<uint8_t, Size>;
+        constexpr static size_t SIZE = Version::END;
+    };
+
+    struct ConnectAck : ClientHeader
+    {
+        constexpr static MessageType TYPE = CONNECT_ACK;
+        using Version = Field<uint8_t, ClientId>;
+        constexpr static size_t SIZE = Version::END;
+    };
+
+    struct Ping : ClientHeader
+    {
+        constexpr static MessageType TYPE = PING;
+        using PingId = Field<uint16_t, ClientId>;
+        using Time = Field<std::chrono::steady_clock::time_point, PingId>;
+        constexpr static size_t SIZE = Time::END;
+    };
+
+    // Echoes the ping
+    struct Pong : Ping
+    {
+        constexpr static MessageType TYPE = PONG;
+    };
+
+    struct CloseStream : StreamHeader
+    {
+        constexpr static MessageType TYPE = CLOSE_STREAM;
+    };
+
+    // Padded to the size it tests
+    struct MtuProbe : ClientHeader
+    {
+        constexpr static MessageType TYPE = MTU_PROBE;
+        using ProbeSize = Field<uint16_t, ClientId>;
+        constexpr static size_t SIZE = ProbeSize::END;
+    };
+
+    struct MtuProbeAck : MtuProbe
+    {
+        constexpr static MessageType TYPE = MTU_PROBE_ACK;
+    };
+
+    // Fixed layout of data messages, followed by the payload
+    struct Data : StreamHeader
+    {
+        constexpr static MessageType TYPE = DATA;
+        using DataSize = Field<uint16_t, StreamId>;
+        using Flags = Field<uint16_t, DataSize>;
+        using PartId = Field<uint16_t, Flags>;
+        using PartTotal = Field<uint16_t, PartId>;
+        using MessageId = Field<uint16_t, PartTotal>;
+        using PartSize = Field<uint16_t, MessageId>;
+        constexpr static size_t SIZE = PartSize::END;
+    };
+
+    struct DataAck : StreamHeader
+    {
+        constexpr static MessageType TYPE = DATA_ACK;
+        using MessageId = Field<uint16_t, StreamId>;
+        using PartId = Field<uint16_t, MessageId>;
+        using ReceiveBase = Field<uint16_t, PartId>;
+        using ReceiveSack = Field<uint64_t, ReceiveBase>;
+        constexpr static size_t SIZE = ReceiveSack::END;
+    };
+
+    // A snapshot the peer decoded, a baseline for the next ones
+    struct SnapshotAck : StreamHeader
+    {
+        constexpr static MessageType TYPE = SNAPSHOT_ACK;
+        using Sequence = Field<uint16_t, StreamId>;
+        constexpr static size_t SIZE = Sequence::END;
+    };
+
+    // Followed by the coalesced messages, each prefixed with its size
+    struct Batch : Header
+    {
+        constexpr static MessageType TYPE = BATCH;
+        constexpr static size_t SIZE = Size::END;
+    };
+
+    // The version 1 wire format, fields never move
+    static_assert(ConnectAck::Version::OFFSET == 11 && Ping::Time::OFFSET == 13 && CloseStream::SIZE == 15);
+    static_assert(Data::Flags::OFFSET == 17 && Data::PartId::OFFSET == 19 && Data::SIZE == 27);
+    static_assert(DataAck::ReceiveSack::OFFSET == 21 && DataAck::SIZE == 29);
+
+    // Fills the fixed fields of a message in place, the payload that follows is left to the caller
+    template<typename Layout>
+    class Writer
+    {
+    public:
+        // Size of the whole message, payload included
+        explicit Writer(std::span<char, Layout::SIZE> message, uint16_t size = Layout::SIZE) : m_message(message.data())
+        {
+            Set<typename Layout::Type>(Layout::TYPE);
+            Set<typename Layout::Size>(size);
+        }
+
+        template<typename F>
+        Writer& Set(const typename F::Value& value)
+        {
+            static_assert(F::END <= Layout::SIZE, "field outside the message");
+            memcpy(m_message + F::OFFSET, &value, sizeof(value));
+            return *this;
+        }
+
+    private:
+        char* m_message;
+    };
+
+    // Message of a fixed size with its own storage
+    template<typename Layout>
+    class Message
+    {
+    public:
+        Message() { Writer<Layout> writer(m_bytes); }
+
+        template<typename F>
+        Message& Set(const typename F::Value& value)
+        {
+            static_assert(F::END <= Layout::SIZE, "field outside the message");
+            memcpy(m_bytes.data() + F::OFFSET, &value, sizeof(value));
+            return *this;
+        }
+
+        std::span<const char> Bytes() const { return m_bytes; }
+
+    private:
+        std::array<char, Layout::SIZE> m_bytes;
+    };
+
+    // Reads the fields of a received message, only built over messages long enough for every fixed field
+    template<typename Layout>
+    class View
+    {
+    public:
+        static std::optional<View> Of(std::span<const char> message)
+        {
+            if (message.size() < Layout::SIZE)
+            {
+                return std::nullopt;
+            }
+            return View(message);
+        }
+
+        template<typename F>
+        typename F::Value Get() const
+        {
+            static_assert(F::END <= Layout::SIZE, "field outside the message");
+            typename F::Value value;
+            memcpy(&value, m_message.data() + F::OFFSET, sizeof(value));
+            return value;
+        }
+
+        // What follows the fixed fields, payload or padding
+        std::span<const char> Payload() const { return m_message.subspan(Layout::SIZE); }
+        std::span<const char> Bytes() const { return m_message; }
+
+    private:
+        explicit View(std::span<const char> message) : m_message(message) {}
+
+        std::span<const char> m_message;
+    };
+}
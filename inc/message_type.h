@@ -2,5 +2,6 @@
 
 enum MessageType : char
 {
-	CONNECT, DISCONNECT, CONNECT_ACK, DATA, DATA_ACK, PING, PONG, CREATE_STREAM, CLOSE_STREAM
+	CONNECT, DISCONNECT, CONNECT_ACK, DATA, DATA_ACK, PING, PONG, CREATE_STREAM, CLOSE_STREAM, MTU_PROBE, MTU_PROBE_ACK, BATCH,
+	DATA_COMPACT, DATA_ACK_COMPACT, SNAPSHOT_ACK
 };
\ No newline at end of file
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+// Bounded lock-free queue for many producers and a single consumer, after Dmitry Vyukov's array queue.
+// Each cell carries a sequence number telling whether it is free for the producer of a given position or
+// ready for the consumer, so producers only contend on one counter and nobody ever waits on a lock.
+template<typename T>
+class MpscQueue
+{
+public:
+    // Rounded up to a power of two
+    explicit MpscQueue(size_t capacity) :
+        m_cells(new Cell[std::bit_ceil(capacity)]), m_mask(std::bit_ceil(capacity) - 1)
+    {
+        for (size_t i = 0; i <= m_mask; i++)
+        {
+            m_cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    // Safe from any thread. Returns false without waiting when the queue is full.
+    bool TryPush(T&& value)
+    {
+        size_t position = m_enqueue_position.load(std::memory_order_relaxed);
+        Cell* cell;
+        for (;;)
+        {
+            cell = &m_cells[position & m_mask];
+            const size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            const intptr_t difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+            if (difference == 0)
+            {
+                if (m_enqueue_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                {
+                    break;
+                }
+            }
+            else if (difference < 0)
+            {
+                return false;
+            }
+            else
+            {
+                position = m_enqueue_position.load(std::memory_order_relaxed);
+            }
+        }
+        cell->value = std::move(value);
+        cell->sequence.store(position + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Only from the consumer thread
+    bool TryPop(T& value)
+    {
+        Cell& cell = m_cells[m_dequeue_position & m_mask];
+        if (cell.sequence.load(std::memory_order_acquire) != m_dequeue_position + 1)
+        {
+            return false;
+        }
+        value = std::move(cell.value);
+        cell.sequence.store(m_dequeue_position + m_mask + 1, std::memory_order_release);
+        m_dequeue_position++;
+        return true;
+    }
+
+    size_t Capacity() const { return m_mask + 1; }
+
+private:
+    struct Cell
+    {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    std::unique_ptr<Cell[]> m_cells;
+    size_t m_mask;
+    // On their own cache lines, producers keep bumping the first one
+    alignas(64) std::atomic<size_t> m_enqueue_position{ 0 };
+    alignas(64) size_t m_dequeue_position = 0;
+};
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+#include <vector>
+
+// Fixed set of equally sized packet buffers carved out of a single allocation.
+// Buffers are handed out by index so they can be referenced without owning them.
+class PacketPool
+{
+public:
+    PacketPool() = default;
+    PacketPool(size_t buffer_count, size_t buffer_size);
+
+    void Reset(size_t buffer_count, size_t buffer_size);
+
+    // Returns INVALID_BUFFER when every buffer is in use.
+    int Acquire();
+    void Release(int buffer);
+
+    std::span<char> Get(int buffer);
+    std::span<const char> Get(int buffer) const;
+
+    size_t Available() const { return m_free.size(); }
+    size_t BufferCount() const { return m_buffer_count; }
+    size_t BufferSize() const { return m_buffer_size; }
+
+    constexpr static int INVALID_BUFFER = -1;
+private:
+    std::vector<char> m_storage;
+    std::vector<int> m_free;
+    size_t m_buffer_count = 0;
+    size_t m_buffer_size = 0;
+};
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// One bit for every part of a message, sized to its part count rather than to the largest message a stream allows.
+// Messages of up to 64 parts, most of them, keep their bits inline, larger ones take a word for every 64 parts.
+class PartBitmap
+{
+public:
+    PartBitmap() = default;
+    explicit PartBitmap(size_t size) { Resize(size); }
+
+    // Clears every bit
+    void Resize(size_t size)
+    {
+        m_size = size;
+        m_inline = 0;
+        if (size > INLINE_BITS)
+        {
+            m_words.assign((size + INLINE_BITS - 1) / INLINE_BITS, 0);
+        }
+        else
+        {
+            m_words.clear();
+        }
+    }
+
+    // Bits past the size read as clear and are never set
+    bool Test(size_t bit) const { return bit < m_size && (Word(bit) >> (bit % INLINE_BITS)) & 1; }
+    void Set(size_t bit)
+    {
+        if (bit < m_size)
+        {
+            Word(bit) |= uint64_t(1) << (bit % INLINE_BITS);
+        }
+    }
+    void Reset(size_t bit)
+    {
+        if (bit < m_size)
+        {
+            Word(bit) &= ~(uint64_t(1) << (bit % INLINE_BITS));
+        }
+    }
+
+    size_t Count() const
+    {
+        if (m_words.empty())
+        {
+            return std::popcount(m_inline);
+        }
+        size_t count = 0;
+        for (uint64_t word : m_words)
+        {
+            count += std::popcount(word);
+        }
+        return count;
+    }
+    size_t Size() const { return m_size; }
+
+private:
+    constexpr static size_t INLINE_BITS = 64;
+
+    uint64_t Word(size_t bit) const { return m_words.empty() ? m_inline : m_words[bit / INLINE_BITS]; }
+    uint64_t& Word(size_t bit) { return m_words.empty() ? m_inline : m_words[bit / INLINE_BITS]; }
+
+    size_t m_size = 0;
+    uint64_t m_inline = 0;
+    std::vector<uint64_t> m_words;
+};
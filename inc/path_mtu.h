@@ -0,0 +1,44 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+// Datagram packetization layer path MTU discovery (RFC 8899). Padded probes binary search the largest datagram
+// the path delivers, between a size assumed to always get through and a configured maximum. Sizes are UDP payloads.
+// Probing is driven from the listener thread, the discovered size may be read from any thread.
+class PathMtuDiscovery
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // Fits the IPv6 minimum MTU of 1280 with room for the IP and UDP headers
+    constexpr static uint16_t BASE_DATAGRAM_SIZE = 1200;
+    // Probes of a size are sent this many times before the size is considered too large for the path
+    constexpr static int MAX_PROBES = 3;
+    // The search stops once the bounds are this close
+    constexpr static uint16_t SEARCH_PRECISION = 8;
+
+    PathMtuDiscovery(uint16_t min_size, uint16_t max_size, Clock::duration raise_interval);
+
+    // Largest datagram known to reach the peer
+    uint16_t GetMaxDatagramSize() const { return m_size.load(std::memory_order_relaxed); }
+    bool IsSearching() const;
+
+    // Called whenever the probe timer fires: an outstanding probe counts as lost. Returns the size of the probe to send now,
+    // or 0 when the search is over, until GetRaiseTime when it starts again in case the path got better.
+    uint16_t OnProbeTimer(Clock::time_point now);
+    // Returns true when the probe raised the datagram size
+    bool OnProbeAcked(uint16_t size, Clock::time_point now);
+    Clock::time_point GetRaiseTime() const { return m_raise_at; }
+
+private:
+    std::atomic<uint16_t> m_size;
+    uint16_t m_max_size;
+    // Largest size that may still get through
+    uint16_t m_upper_bound;
+    uint16_t m_probe_size = 0;
+    int m_probe_count = 0;
+    Clock::duration m_raise_interval;
+    Clock::time_point m_raise_at = Clock::time_point::max();
+};
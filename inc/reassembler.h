@@ -0,0 +1,62 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <vector>
+
+#include "part_bitmap.h"
+
+// Collects the parts of multi-part stream messages until they are complete, for all the streams of a connection.
+// Parts are written straight to their offset in a buffer the size of the whole message, and the buffers are recycled
+// once delivered so steady traffic does not allocate. Not thread safe, it is used from the listener thread.
+class Reassembler
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    enum class Status { Incomplete, Complete, Duplicate, Rejected };
+
+    constexpr static uint16_t MAX_PARTS = 16384;
+
+    // Messages are rejected while max_bytes are already buffered. Incomplete messages that can expire are dropped after timeout.
+    Reassembler(size_t max_bytes, Clock::duration timeout);
+
+    // Every part but the last one of a message is part_size bytes long. On Complete, message is swapped with the
+    // reassembled buffer, and its previous storage is kept for later messages.
+    // Reliable streams pass can_expire = false: their parts were acknowledged and will not be sent again.
+    Status AddPart(uint32_t stream_id, uint16_t message_id, uint16_t part_id, uint16_t part_total, size_t part_size,
+        std::span<const char> part, bool can_expire, std::string& message, Clock::time_point now);
+    // Drops the incomplete messages of a closed stream
+    void Forget(uint32_t stream_id);
+
+    size_t GetBufferedBytes() const { return m_buffered_bytes; }
+    size_t GetIncompleteCount() const { return m_entries.size(); }
+
+private:
+    struct Entry
+    {
+        uint32_t stream_id = 0;
+        uint16_t message_id = 0;
+        uint16_t part_total = 0;
+        bool can_expire = true;
+        size_t part_size = 0;
+        size_t size = 0;
+        uint16_t received = 0;
+        PartBitmap parts;
+        Clock::time_point started_at;
+        std::string buffer;
+    };
+
+    void Expire(Clock::time_point now);
+    void Recycle(std::string&& buffer);
+
+    size_t m_max_bytes;
+    Clock::duration m_timeout;
+    size_t m_buffered_bytes = 0;
+    std::vector<Entry> m_entries;
+    std::vector<std::string> m_free_buffers;
+
+    constexpr static size_t MAX_FREE_BUFFERS = 4;
+};
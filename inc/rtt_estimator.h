@@ -0,0 +1,38 @@
+#pragma once
+
+#include <chrono>
+
+// Smoothed round trip time of a connection and the retransmission timeout derived from it, following RFC 6298.
+// Not thread safe, the owner serializes access.
+class RttEstimator
+{
+public:
+    using Duration = std::chrono::microseconds;
+
+    // initial_rto is used until the first sample arrives. The defaults are the RFC's conservative values.
+    explicit RttEstimator(Duration initial_rto = std::chrono::seconds(1), Duration min_rto = std::chrono::seconds(1), Duration max_rto = std::chrono::seconds(60));
+
+    void AddSample(Duration rtt);
+    // Doubles the timeout after a retransmission, until the next sample
+    void Backoff();
+    void SetBounds(Duration min_rto, Duration max_rto);
+
+    bool HasSample() const { return m_has_sample; }
+    // Zero until the first sample
+    Duration GetRtt() const { return m_smoothed_rtt; }
+    Duration GetRttVariance() const { return m_rtt_variance; }
+    Duration GetRto() const { return m_rto; }
+
+private:
+    Duration Clamp(Duration rto) const;
+
+    Duration m_min_rto;
+    Duration m_max_rto;
+    Duration m_smoothed_rtt{};
+    Duration m_rtt_variance{};
+    Duration m_rto;
+    bool m_has_sample = false;
+
+    // Resolution of the timers that fire retransmissions
+    constexpr static Duration CLOCK_GRANULARITY = std::chrono::milliseconds(1);
+};
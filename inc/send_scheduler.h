@@ -0,0 +1,71 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <span>
+#include <vector>
+
+// Orders the messages the application sends to one client and holds them to a bandwidth budget.
+// Streams of higher priority go first, streams of equal priority share what is left in proportion to their weights
+// (self-clocked weighted fair queueing), and a token bucket refilled at the budget rate bounds the bytes released.
+// When the budget runs out, the next message waits for the bucket to refill, reliable or not. Messages still queued on
+// unreliable streams of lower priority are dropped, a later update replaces them, and those of reliable streams wait.
+// Not thread safe, it is used from the listener thread of the connection.
+class SendScheduler
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // Bytes per second, 0 for no budget. Up to burst bytes go out at once after idle time.
+    void SetBudget(uint64_t bytes_per_second, size_t burst);
+
+    void Enqueue(uint32_t stream_id, int priority, uint32_t weight, bool reliable, std::span<const char> data);
+    // Swaps the next message the budget lets out into data, whose previous buffer is recycled.
+    // Returns false when nothing is queued or the budget ran out.
+    bool Pop(Clock::time_point now, uint32_t& stream_id, std::vector<char>& data);
+    // When the budget lets the next message out, time_point::max() when nothing is queued
+    Clock::time_point GetNextReleaseTime() const;
+    // Drops what a closed stream still had queued
+    void Forget(uint32_t stream_id);
+
+    size_t GetQueuedCount() const { return m_queued; }
+    size_t GetDroppedCount() const { return m_dropped; }
+
+private:
+    struct Queued
+    {
+        std::vector<char> data;
+        // Virtual time at which the message would be done sending under fair queueing
+        double finish = 0;
+    };
+    struct StreamQueue
+    {
+        uint32_t stream_id = 0;
+        int priority = 0;
+        bool reliable = false;
+        double last_finish = 0;
+        std::deque<Queued> messages;
+    };
+
+    // Highest priority stream with something queued, the earliest finish among equals. Null when nothing is queued.
+    StreamQueue* Next();
+    const StreamQueue* Next() const;
+    void Refill(Clock::time_point now);
+    // Unreliable streams of equal or higher priority keep their messages
+    void DropUnreliable(int below_priority);
+    // Tokens the message needs, a message larger than the burst goes out once the bucket is full
+    double Cost(const Queued& message) const;
+
+    // A client has few streams, they are scanned
+    std::vector<StreamQueue> m_streams;
+    std::vector<std::vector<char>> m_free_buffers;
+    double m_virtual_time = 0;
+    uint64_t m_rate = 0;
+    size_t m_burst = 0;
+    double m_tokens = 0;
+    Clock::time_point m_refilled_at{};
+    size_t m_queued = 0;
+    size_t m_dropped = 0;
+};
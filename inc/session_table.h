@@ -0,0 +1,112 @@
+#pragma once
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Dense table of sessions addressed by keys made of a slot index and a generation. A lookup is one bounds check and one
+// generation check on a contiguous array, and the generation keeps a stale key from reaching the session that reused its slot.
+// Keys are slot | generation << 32 | base: the bits above KEY_BITS are a fixed base the table was created with.
+template<typename T>
+class SessionTable
+{
+public:
+    using Key = uint64_t;
+
+    constexpr static int KEY_BITS = 56;
+    constexpr static Key KEY_MASK = (Key(1) << KEY_BITS) - 1;
+    constexpr static uint32_t GENERATION_MASK = (uint32_t(1) << (KEY_BITS - 32)) - 1;
+
+    explicit SessionTable(Key base = 0) : m_base(base & ~KEY_MASK) {}
+
+    // Freed slots are reused before the table grows, so the first key of a table is its base
+    Key Insert(T value)
+    {
+        uint32_t index;
+        if (m_free.empty())
+        {
+            index = static_cast<uint32_t>(m_slots.size());
+            m_slots.emplace_back();
+        }
+        else
+        {
+            index = m_free.back();
+            m_free.pop_back();
+        }
+
+        Slot& slot = m_slots[index];
+        slot.alive = true;
+        slot.value = std::move(value);
+        m_size++;
+        return m_base | (static_cast<Key>(slot.generation) << 32) | index;
+    }
+
+    T* Find(Key key)
+    {
+        const int32_t index = IndexOf(key);
+        return index < 0 ? nullptr : &m_slots[index].value;
+    }
+
+    const T* Find(Key key) const
+    {
+        const int32_t index = IndexOf(key);
+        return index < 0 ? nullptr : &m_slots[index].value;
+    }
+
+    bool Contains(Key key) const { return IndexOf(key) >= 0; }
+
+    // The value is destroyed right away, releasing what it holds
+    bool Erase(Key key)
+    {
+        const int32_t index = IndexOf(key);
+        if (index < 0)
+        {
+            return false;
+        }
+        Slot& slot = m_slots[index];
+        slot.alive = false;
+        slot.generation = (slot.generation + 1) & GENERATION_MASK;
+        slot.value = T{};
+        m_free.push_back(static_cast<uint32_t>(index));
+        m_size--;
+        return true;
+    }
+
+    size_t Size() const { return m_size; }
+
+    template<typename Function>
+    void ForEach(Function&& function)
+    {
+        for (size_t index = 0; index < m_slots.size(); index++)
+        {
+            if (m_slots[index].alive)
+            {
+                function(m_base | (static_cast<Key>(m_slots[index].generation) << 32) | index, m_slots[index].value);
+            }
+        }
+    }
+
+private:
+    struct Slot
+    {
+        uint32_t generation = 0;
+        bool alive = false;
+        T value{};
+    };
+
+    int32_t IndexOf(Key key) const
+    {
+        const uint64_t index = key & 0xFFFFFFFF;
+        if ((key & ~KEY_MASK) != m_base || index >= m_slots.size())
+        {
+            return -1;
+        }
+        const Slot& slot = m_slots[index];
+        return slot.alive && slot.generation == ((key >> 32) & GENERATION_MASK) ? static_cast<int32_t>(index) : -1;
+    }
+
+    std::vector<Slot> m_slots;
+    std::vector<uint32_t> m_free;
+    size_t m_size = 0;
+    Key m_base;
+};
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <vector>
+
+// Delta compression of state snapshots sent over unreliable streams. A snapshot is encoded against the latest one the peer
+// acknowledged, as runs copied from it and runs of new bytes, and sent whole when the peer acknowledged none of the recent ones.
+// Both sides keep the recent snapshots by sequence, the baseline of a delta is always one the peer decoded.
+namespace snapshot
+{
+    // Snapshots older than this many sequences can no longer serve as a baseline
+    constexpr size_t HISTORY_SIZE = 32;
+
+    // Sequence a is more recent than b, across wrap around
+    inline bool IsNewer(uint16_t a, uint16_t b) { return static_cast<int16_t>(a - b) > 0; }
+
+    class Encoder
+    {
+    public:
+        // Encodes state into out and remembers it, so it may serve as a baseline once acknowledged
+        void Encode(std::span<const char> state, std::vector<char>& out);
+        void OnAcknowledged(uint16_t sequence);
+
+        uint16_t GetNextSequence() const { return m_next_sequence; }
+
+    private:
+        struct Entry
+        {
+            bool used = false;
+            uint16_t sequence = 0;
+            std::vector<char> state;
+        };
+        std::array<Entry, HISTORY_SIZE> m_history;
+        uint16_t m_next_sequence = 0;
+        bool m_has_baseline = false;
+        uint16_t m_baseline = 0;
+    };
+
+    class Decoder
+    {
+    public:
+        // Rebuilds the state into state and returns true when message holds a snapshot more recent than the previous one.
+        // Late snapshots, deltas against a forgotten baseline and malformed messages are dropped.
+        bool Decode(std::span<const char> message, std::string& state);
+        uint16_t GetLastSequence() const { return m_last_sequence; }
+
+    private:
+        struct Entry
+        {
+            bool used = false;
+            uint16_t sequence = 0;
+            std::string state;
+        };
+        std::array<Entry, HISTORY_SIZE> m_history;
+        bool m_has_last = false;
+        uint16_t m_last_sequence = 0;
+    };
+}
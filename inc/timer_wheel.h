@@ -0,0 +1,72 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+// Hierarchical timer wheel: schedule, cancel and reschedule are O(1), advancing is O(ticks elapsed + timers fired).
+// Not thread safe, it is owned by a listener thread.
+class TimerWheel
+{
+public:
+    using Clock = std::chrono::steady_clock;
+    using TimerId = uint64_t;
+
+    constexpr static TimerId INVALID_TIMER = 0;
+
+    explicit TimerWheel(std::chrono::milliseconds tick = std::chrono::milliseconds(1), Clock::time_point start = Clock::now());
+
+    TimerId Schedule(Clock::time_point deadline, std::function<void()> callback);
+    // Cancelled timers release their id, which is never handed out again.
+    bool Cancel(TimerId timer);
+    // Moves a pending timer, or re-arms one that already fired from inside its own callback.
+    bool Reschedule(TimerId timer, Clock::time_point deadline);
+    bool IsScheduled(TimerId timer) const;
+
+    // Runs the callback of every timer due at now. Returns the number of timers fired.
+    size_t Advance(Clock::time_point now);
+    // Next time Advance has work to do, Clock::time_point::max() when nothing is scheduled.
+    Clock::time_point NextDeadline() const;
+
+    size_t Size() const { return m_scheduled; }
+
+private:
+    constexpr static int LEVEL_BITS = 6;
+    constexpr static int SLOTS = 1 << LEVEL_BITS;
+    constexpr static int LEVELS = 4;
+    constexpr static uint64_t SLOT_MASK = SLOTS - 1;
+    constexpr static uint64_t MAX_RANGE = uint64_t(1) << (LEVEL_BITS * LEVELS);
+    constexpr static int32_t NONE = -1;
+
+    struct Node
+    {
+        uint64_t deadline_tick = 0;
+        int32_t previous = NONE;
+        int32_t next = NONE;
+        int32_t slot = NONE;
+        uint32_t generation = 1;
+        bool alive = false;
+        std::function<void()> callback;
+    };
+
+    uint64_t NextTick() const;
+    int32_t Find(TimerId timer) const;
+    uint64_t ToTick(Clock::time_point time) const;
+    void Link(int32_t index);
+    void Unlink(int32_t index);
+    void Release(int32_t index);
+    void Cascade(int level);
+    void Fire(int32_t index);
+
+    std::chrono::milliseconds m_tick;
+    Clock::time_point m_start;
+    uint64_t m_current_tick = 0;
+    size_t m_scheduled = 0;
+
+    std::vector<Node> m_nodes;
+    std::vector<int32_t> m_free;
+    std::array<int32_t, LEVELS * SLOTS> m_slots;
+    std::array<uint64_t, LEVELS> m_occupied{};
+};
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+// Layout of the data and acknowledgement messages of streams. Version 1 has fixed size fields. Version 2 has compact headers:
+// a varint connection token instead of the 8 byte client id, a varint stream id, and part and flag fields only present when the
+// message needs them, its payload runs to the end of the datagram. A connection uses the lowest version both peers announced at CONNECT.
+namespace wire
+{
+    constexpr uint8_t VERSION_FIXED = 1;
+    constexpr uint8_t VERSION_COMPACT = 2;
+
+    // type, message size, client id, stream id, data size, flags, part id, part total, message id, part size
+    constexpr size_t FIXED_DATA_HEADER_SIZE = 27;
+    // type, message size, client id, stream id, acked message id, acked part id, receive base, selective ack bits
+    constexpr size_t FIXED_ACK_SIZE = 29;
+    // Varints of 16 and 32 bit values take up to 3 and 5 bytes, tokens up to 10
+    // type, token, stream id, fields, message id, part id, part total, part size, flags
+    constexpr size_t MAX_DATA_HEADER_SIZE = 1 + 10 + 5 + 1 + 2 + 3 + 3 + 3 + 2;
+    // type, token, stream id, acked message id, acked part id, receive base, selective ack bits
+    constexpr size_t MAX_ACK_SIZE = 1 + 10 + 5 + 2 + 3 + 2 + 10;
+
+    struct DataHeader
+    {
+        uint64_t client_id = 0;
+        uint32_t stream_id = 0;
+        uint16_t flags = 0;
+        uint16_t message_id = 0;
+        uint16_t part_id = 0;
+        uint16_t part_total = 1;
+        uint16_t part_size = 0;
+    };
+
+    struct AckHeader
+    {
+        uint64_t client_id = 0;
+        uint32_t stream_id = 0;
+        uint16_t message_id = 0;
+        uint16_t part_id = 0;
+        uint16_t receive_base = 0;
+        uint64_t receive_sack = 0;
+    };
+
+    // Little endian base 128 varints, also used by payload encodings
+    size_t VarintSize(uint64_t value);
+    size_t WriteVarint(uint64_t value, char* out);
+    // Fails past the end of message or when the value does not fit max_bits
+    bool ReadVarint(std::span<const char> message, size_t& pos, uint64_t& value, int max_bits = 64);
+
+    // Bounds the data headers of a stream, so parts are cut to fit the datagram whatever their fields
+    size_t MaxDataHeaderSize(uint8_t version, uint64_t client_id, uint32_t stream_id);
+
+    // Return the size written, the message id of single part messages is left out of compact headers unless needed
+    size_t WriteDataHeader(uint8_t version, const DataHeader& header, bool needs_message_id, size_t payload_size,
+        std::span<char, MAX_DATA_HEADER_SIZE> out);
+    size_t WriteAck(uint8_t version, const AckHeader& ack, std::span<char, MAX_ACK_SIZE> out);
+
+    // Accept either version and return false for malformed messages
+    bool ReadDataHeader(std::span<const char> message, DataHeader& header, std::span<const char>& payload);
+    bool ReadAck(std::span<const char> message, AckHeader& ack);
+    // Client id of any message but CONNECT, and stream id of data and acknowledgement messages, to route them before parsing
+    bool ReadClientId(std::span<const char> message, uint64_t& client_id);
+    bool ReadStreamId(std::span<const char> message, uint32_t& stream_id);
+}
@@ -1,29 +1,51 @@
 ﻿#include "Stream.h"
-#include "message_type.h"
+#include "message_schema.h"
 #include <string>
+#include <array>
 #include <mutex>
 #include <chrono>
+#include <algorithm>
+#include "spdlog/spdlog.h"
 
 using namespace std::chrono_literals;
-constexpr int HEADER_SIZE = 184;
 
-Stream::Stream(uint32_t _stream_id, uint64_t _client_uuid, IpPortPair _target, Falcon* _socket):
-	stream_id(_stream_id), client_uuid(_client_uuid), target(_target), socket(_socket)
-{}
+namespace
+{
+	size_t PartCount(size_t size, uint16_t part_size)
+	{
+		return std::max<size_t>((size + part_size - 1) / part_size, 1);
+	}
+
+	std::span<const char> Part(std::span<const char> data, uint16_t part_id, uint16_t part_size)
+	{
+		const size_t offset = part_id * static_cast<size_t>(part_size);
+		return data.subspan(offset, std::min<size_t>(part_size, data.size() - offset));
+	}
+}
+
+Stream::Stream(uint32_t _stream_id, uint64_t _client_uuid, const Endpoint& _target, Falcon* _socket):
+	stream_id(_stream_id), client_uuid(_client_uuid), target(_target), socket(_socket),
+	m_receive_queue(RECEIVE_QUEUE_SIZE), m_free_buffers(RECEIVE_QUEUE_SIZE)
+{
+	if (IsSnapshot()) {
+		m_snapshot_encoder = std::make_unique<snapshot::Encoder>();
+		m_snapshot_decoder = std::make_unique<snapshot::Decoder>();
+	}
+	if (IsOrdered()) {
+		m_reorder_buffer.resize(WINDOW_SIZE);
+	}
+}
 
 Stream::~Stream() {
 
 }
 
 uint16_t Stream::GetNewMessageID() {
-	uint16_t id = msg_id;
-	msg_id++;
-
-	return id;
+	return msg_id.fetch_add(1);
 }
 
 void Stream::SetFlag(int flag_id, bool value) {
-	if (flag_id < 0 || flag_id >= 16) return;
+	if (flag_id < 0 || flag_id >= COMPRESSED_FLAG) return;
 
 	if (value)
 		flags = flags | (1 << flag_id);
@@ -31,96 +53,530 @@ void Stream::SetFlag(int flag_id, bool value) {
 		flags = flags & ~(1 << flag_id);
 }
 
+void Stream::SetWireVersion(uint8_t version) {
+	m_wire_version = version;
+	m_header_size = wire::MaxDataHeaderSize(version, client_uuid, stream_id);
+}
+
 bool Stream::GetFlag(int flag_id)
 {
-	if (flag_id < 0 || flag_id >= 16) return false;
+	if (flag_id < 0 || flag_id >= COMPRESSED_FLAG) return false;
 	uint16_t mask;
 	mask = 1 << flag_id;
 	return flags & mask;
 }
 
+size_t Stream::GetMaxMessageSize() const {
+	const uint16_t datagram_size = m_path_mtu ? m_path_mtu->GetMaxDatagramSize() : PathMtuDiscovery::BASE_DATAGRAM_SIZE;
+	return static_cast<size_t>(Reassembler::MAX_PARTS) * (datagram_size - m_header_size);
+}
+
 void Stream::SendData(std::span<const char> data) {
-	int max_packet_size = 65536 - HEADER_SIZE;
-	const uint8_t part_total = data.size() / max_packet_size + 1;
+	if (m_snapshot_encoder) {
+		m_snapshot_encoder->Encode(data, m_snapshot_buffer);
+		data = m_snapshot_buffer;
+	}
+	bool compressed = false;
+	if (m_compression && data.size() >= MIN_COMPRESSED_SIZE && Compress(data)) {
+		compressed = true;
+		data = m_compressed;
+	}
+
+	// Parts fit in a datagram the path delivers whole, so a loss costs one datagram instead of every IP fragment of a large one
+	const uint16_t datagram_size = m_path_mtu ? m_path_mtu->GetMaxDatagramSize() : PathMtuDiscovery::BASE_DATAGRAM_SIZE;
+	const uint16_t part_size = static_cast<uint16_t>(datagram_size - m_header_size);
+	if (PartCount(data.size(), part_size) > Reassembler::MAX_PARTS) {
+		spdlog::error("Message of {} bytes dropped, streams send at most {} bytes at once", data.size(), GetMaxMessageSize());
+		return;
+	}
+	const uint16_t part_total = static_cast<uint16_t>(PartCount(data.size(), part_size));
+	const uint16_t message_id = GetNewMessageID();
+
+	if (IsReliable()) {
+		// Reliable messages are copied, the caller's buffer may be gone by the time a part is resent
+		std::lock_guard lock(m_send_window_mutex);
+		OutgoingMessage& message = m_send_window.emplace_back();
+		message.msg_id = message_id;
+		message.part_total = part_total;
+		message.part_size = part_size;
+		message.compressed = compressed;
+		message.data.assign(data.begin(), data.end());
+		message.sent_parts.Resize(part_total);
+		message.acked_parts.Resize(part_total);
+		message.pending_parts.Resize(part_total);
+		for (uint16_t part_id = 0; part_id < part_total; part_id++) {
+			message.pending_parts.Set(part_id);
+		}
+		message.pending_count = part_total;
+		if (!m_congestion) {
+			SendPending();
+		}
+		return;
+	}
 
-	for (uint8_t part_id = 0; part_id < part_total; part_id++) {
-		int packet_size = (part_id == part_total - 1) ? data.size() % max_packet_size : max_packet_size;
-		SendDataPart(part_id, part_total, data.subspan(part_id * max_packet_size, packet_size));
+	for (uint16_t part_id = 0; part_id < part_total; part_id++) {
+		SendDataPart(message_id, part_id, part_total, part_size, compressed, Part(data, part_id, part_size));
 	}
 }
 
-void Stream::SendDataPart(uint8_t part_id, uint8_t part_total, std::span<const char> data) {
-	std::string message;
-	
-	const uint16_t data_size = data.size();
-	const uint16_t message_size = data_size + HEADER_SIZE;
-	message.resize(message_size);
-	uint16_t message_id = GetNewMessageID();
+void Stream::SendPart(OutgoingMessage& message, uint16_t part_id, std::chrono::steady_clock::time_point now) {
+	const std::span<const char> part = Part(message.data, part_id, message.part_size);
+	SendDataPart(message.msg_id, part_id, message.part_total, message.part_size, message.compressed, part);
+
+	message.resent = message.resent || message.sent_parts.Test(part_id);
+	message.sent = true;
+	message.sent_at = now;
+	message.sent_parts.Set(part_id);
+	if (message.pending_parts.Test(part_id)) {
+		message.pending_parts.Reset(part_id);
+		message.pending_count--;
+	}
+	if (m_congestion) {
+		m_congestion->OnPacketSent(part.size() + m_header_size, now);
+	}
+}
 
+void Stream::SendMessage(OutgoingMessage& message) {
+	const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	for (uint16_t part_id = 0; part_id < message.part_total; part_id++) {
+		if (!message.acked_parts.Test(part_id)) {
+			SendPart(message, part_id, now);
+		}
+	}
+}
 
-	int current_pos = 0;
+void Stream::SendPending() {
+	if (m_send_window.empty()) return;
 
-	message[current_pos] = DATA;
-	current_pos += sizeof(DATA);
+	const uint16_t window_start = m_send_window.front().msg_id;
+	for (OutgoingMessage& message : m_send_window) {
+		if (static_cast<uint16_t>(message.msg_id - window_start) >= WINDOW_SIZE) break;
+		if (!message.sent) {
+			SendMessage(message);
+		}
+	}
+}
 
-	memcpy(&message[current_pos], &message_size, sizeof(message_size));
-	current_pos += sizeof(message_size);
+void Stream::SetCongestionController(std::shared_ptr<CongestionController> congestion) {
+	std::lock_guard lock(m_send_window_mutex);
+	m_congestion = std::move(congestion);
+}
 
-	memcpy(&message[current_pos], &client_uuid, sizeof(client_uuid));
-	current_pos += sizeof(client_uuid);
+std::chrono::steady_clock::time_point Stream::Transmit(std::chrono::steady_clock::time_point now) {
+	std::lock_guard lock(m_send_window_mutex);
+	if (!m_congestion || m_send_window.empty()) return std::chrono::steady_clock::time_point::max();
+
+	const uint16_t window_start = m_send_window.front().msg_id;
+	for (OutgoingMessage& message : m_send_window) {
+		if (static_cast<uint16_t>(message.msg_id - window_start) >= WINDOW_SIZE) break;
+
+		for (uint16_t part_id = 0; part_id < message.part_total && message.pending_count > 0; part_id++) {
+			if (!message.pending_parts.Test(part_id)) continue;
+
+			if (!m_congestion->HasWindowFor(Part(message.data, part_id, message.part_size).size() + m_header_size)) {
+				return std::chrono::steady_clock::time_point::max();
+			}
+			if (now < m_congestion->GetNextSendTime()) {
+				return m_congestion->GetNextSendTime();
+			}
+			SendPart(message, part_id, now);
+		}
+	}
+	return std::chrono::steady_clock::time_point::max();
+}
 
-	memcpy(&message[current_pos], &stream_id, sizeof(stream_id));
-	current_pos += sizeof(stream_id);
+size_t Stream::ResendUnacknowledged(std::chrono::steady_clock::duration resend_interval) {
+	std::lock_guard lock(m_send_window_mutex);
+	const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	size_t resent = 0;
+	for (OutgoingMessage& message : m_send_window) {
+		if (!message.sent) break;
+		if (now - message.sent_at < resend_interval) continue;
+
+		if (!m_congestion) {
+			SendMessage(message);
+			resent++;
+			continue;
+		}
+
+		// The parts still in flight are presumed lost and queued again
+		size_t lost_bytes = 0;
+		for (uint16_t part_id = 0; part_id < message.part_total; part_id++) {
+			if (message.sent_parts.Test(part_id) && !message.acked_parts.Test(part_id) && !message.pending_parts.Test(part_id)) {
+				lost_bytes += Part(message.data, part_id, message.part_size).size() + m_header_size;
+				message.pending_parts.Set(part_id);
+				message.pending_count++;
+			}
+		}
+		if (lost_bytes > 0) {
+			m_congestion->OnPacketsLost(lost_bytes, message.sent_at, now);
+			resent++;
+		}
+	}
+	return resent;
+}
 
-	memcpy(&message[current_pos], &data_size, sizeof(data_size));
+size_t Stream::GetUnacknowledgedCount() const {
+	std::lock_guard lock(m_send_window_mutex);
+	return m_send_window.size();
+}
 
-	current_pos += sizeof(data_size);
+void Stream::SendDataPart(uint16_t message_id, uint16_t part_id, uint16_t part_total, uint16_t part_size, bool compressed, std::span<const char> data) {
+	wire::DataHeader fields;
+	fields.client_id = client_uuid;
+	fields.stream_id = stream_id;
+	fields.flags = compressed ? flags | (1 << COMPRESSED_FLAG) : flags;
+	fields.message_id = message_id;
+	fields.part_id = part_id;
+	fields.part_total = part_total;
+	fields.part_size = part_size;
+
+	std::array<char, wire::MAX_DATA_HEADER_SIZE> header;
+	const size_t header_size = wire::WriteDataHeader(m_wire_version, fields, IsReliable() || IsSequenced(), data.size(), header);
+
+	// The payload is gathered straight from the caller's buffer
+	const std::span<const char> parts[] = { std::span<const char>(header).first(header_size), data };
+	socket->SendTo(target, parts);
+	if (m_keepalive) m_keepalive->OnSent();
+}
 
-	memcpy(&message[current_pos], &flags, sizeof(flags));
+void Stream::OnDataReceived(std::span<const char> data) {
+	wire::DataHeader header;
+	std::span<const char> payload;
+	if (!wire::ReadDataHeader(data, header, payload)) return;
+
+	const uint16_t part_id = header.part_id;
+	const uint16_t part_total = header.part_total;
+	const uint16_t message_id = header.message_id;
+	const uint16_t part_size = header.part_size;
+
+	// Duplicates are acknowledged again, their previous acknowledgement may have been lost
+	if (IsReliable() && !IsNewPart(message_id, part_id, part_total)) {
+		SendAck(message_id, part_id);
+		return;
+	}
+	// Parts of messages no newer than the last one delivered, across wrap around
+	if (IsSequenced() && m_has_delivered && static_cast<int16_t>(message_id - m_newest_message_id) <= 0) return;
+
+	if (part_total > 1) {
+		if (!m_reassembler) {
+			const ConnectionSettings defaults;
+			m_reassembler = std::make_shared<Reassembler>(defaults.max_reassembly_bytes, defaults.reassembly_timeout);
+		}
+		// The complete message is swapped into m_last_data without another copy
+		const Reassembler::Status status = m_reassembler->AddPart(stream_id, message_id, part_id, part_total, part_size,
+			payload, !IsReliable(), m_last_data, std::chrono::steady_clock::now());
+		// Rejected parts are not acknowledged, the sender tries again once memory is available
+		if (status == Reassembler::Status::Rejected) return;
+		if (IsReliable()) {
+			MarkReceived(message_id, part_id, part_total);
+			SendAck(message_id, part_id);
+		}
+		if (status != Reassembler::Status::Complete) return;
+	}
+	else {
+		if (IsReliable()) {
+			MarkReceived(message_id, part_id, part_total);
+			SendAck(message_id, part_id);
+		}
+		m_last_data.assign(payload.data(), payload.size());
+	}
+	m_newest_message_id = message_id;
+	m_has_delivered = true;
 
-	memcpy(&message[current_pos], &part_id, sizeof(part_id));
-	current_pos += sizeof(part_id);
+	if (m_reorder_buffer.empty()) {
+		OnMessageComplete(header.flags);
+		return;
+	}
+	if (message_id != m_next_delivery_id) {
+		ReorderedMessage& reordered = m_reorder_buffer[message_id % WINDOW_SIZE];
+		reordered.complete = true;
+		reordered.flags = header.flags;
+		reordered.data.assign(m_last_data);
+	}
+	else {
+		OnMessageComplete(header.flags);
+		m_next_delivery_id++;
+	}
+	// Every message before the receive base is complete, those after the gap that just closed waited in the buffer
+	for (; m_next_delivery_id != m_receive_base; m_next_delivery_id++) {
+		ReorderedMessage& reordered = m_reorder_buffer[m_next_delivery_id % WINDOW_SIZE];
+		// Evicted by the reassembler before it was whole, it is gone
+		if (!reordered.complete) continue;
+		reordered.complete = false;
+		m_last_data.swap(reordered.data);
+		OnMessageComplete(reordered.flags);
+	}
+}
 
-	memcpy(&message[current_pos], &part_total, sizeof(part_total));
-	current_pos += sizeof(part_total);
+void Stream::OnMessageComplete(uint16_t message_flags) {
+	flags = message_flags & ~(1 << COMPRESSED_FLAG);
+	if (message_flags & (1 << COMPRESSED_FLAG)) {
+		if (!Decompress(m_last_data)) {
+			spdlog::error("Compressed message dropped from stream {}, it does not decompress", stream_id);
+			return;
+		}
+		m_last_data.swap(m_decompressed);
+	}
+	if (m_snapshot_decoder) {
+		// Late snapshots and deltas against a forgotten baseline are dropped, the next full or delta snapshot catches up
+		if (!m_snapshot_decoder->Decode(m_last_data, m_snapshot_state)) return;
+		SendSnapshotAck(m_snapshot_decoder->GetLastSequence());
+		m_last_data.swap(m_snapshot_state);
+	}
+	Deliver(m_last_data);
+}
 
-	memcpy(&message[current_pos], &message_id, sizeof(message_id));
-	current_pos += sizeof(message_id);
+void Stream::Deliver(std::span<const char> payload) {
+	std::shared_ptr<const MessageDelivery> delivery;
+	{
+		std::lock_guard lock(m_delivery_mutex);
+		delivery = m_delivery;
+	}
+	if (delivery && !delivery->executor) {
+		m_handler_message.client_id = client_uuid;
+		m_handler_message.stream_id = stream_id;
+		m_handler_message.data.assign(payload.begin(), payload.end());
+		delivery->handler(m_handler_message);
+		return;
+	}
 
-	memcpy(&message[current_pos], data.data(), data.size() * sizeof(char));
-	socket->SendTo(target.ip, target.port, message);
+	Message message;
+	message.client_id = client_uuid;
+	message.stream_id = stream_id;
+	m_free_buffers.TryPop(message.data);
+	message.data.assign(payload.begin(), payload.end());
+	if (delivery) {
+		delivery->executor([delivery, message = std::move(message)]() { delivery->handler(message); });
+		return;
+	}
+	if (!m_receive_queue.TryPush(std::move(message))) {
+		// Left in place by the failed push
+		m_dropped_messages++;
+		m_free_buffers.TryPush(std::move(message.data));
+	}
 }
 
+size_t Stream::PollMessages(std::span<Message> messages) {
+	size_t count = 0;
+	for (Message& message : messages) {
+		std::vector<char> consumed = std::move(message.data);
+		if (!m_receive_queue.TryPop(message)) {
+			message.data = std::move(consumed);
+			break;
+		}
+		if (consumed.capacity() > 0) {
+			consumed.clear();
+			m_free_buffers.TryPush(std::move(consumed));
+		}
+		count++;
+	}
+	return count;
+}
 
+void Stream::SetMessageHandler(MessageHandler handler, Executor executor) {
+	std::shared_ptr<const MessageDelivery> delivery;
+	if (handler) {
+		delivery = std::make_shared<const MessageDelivery>(MessageDelivery{ std::move(handler), std::move(executor) });
+	}
+	std::lock_guard lock(m_delivery_mutex);
+	m_delivery = std::move(delivery);
+}
 
-void Stream::OnDataReceived(std::span<const char> data) {
-	
-	uint16_t data_size;
-	memcpy(&data_size, &data[15], sizeof(uint16_t));
-	memcpy(&flags, &data[17], sizeof(uint16_t));
-	
-	std::string message;
+bool Stream::IsNewPart(uint16_t message_id, uint16_t part_id, uint16_t part_total) const {
+	// Also rejects messages before the base, their offset wraps around
+	const uint16_t offset = message_id - m_receive_base;
+	if (offset >= WINDOW_SIZE || part_total == 0 || part_total > Reassembler::MAX_PARTS || part_id >= part_total) return false;
+	if (offset > 0 && (m_receive_sack >> (offset - 1)) & 1) return false;
 
-	const uint16_t message_size = data_size + 15;
-	message.resize(message_size);
-	int current_pos = 0;
+	// A message keeps the part count of its first part
+	const auto partial = m_partial_messages.find(message_id);
+	return partial == m_partial_messages.end() || (partial->second.Size() == part_total && !partial->second.Test(part_id));
+}
 
-	message[current_pos] = DATA_ACK;
-	current_pos += sizeof(DATA);
+bool Stream::MarkReceived(uint16_t message_id, uint16_t part_id, uint16_t part_total) {
+	if (!IsNewPart(message_id, part_id, part_total)) return false;
+
+	const uint16_t offset = message_id - m_receive_base;
+	if (part_total > 1) {
+		auto [partial, created] = m_partial_messages.try_emplace(message_id);
+		PartBitmap& parts = partial->second;
+		if (created) {
+			parts.Resize(part_total);
+		}
+		parts.Set(part_id);
+		if (parts.Count() < part_total) return true;
+		m_partial_messages.erase(message_id);
+	}
 
-	memcpy(&message[current_pos], &message_size, sizeof(message_size));
-	current_pos += sizeof(message_size);
+	if (offset > 0) {
+		m_receive_sack |= uint64_t(1) << (offset - 1);
+		return true;
+	}
 
-	memcpy(&message[current_pos], &client_uuid, sizeof(client_uuid));
-	current_pos += sizeof(client_uuid);
+	// The base is complete, slide past it and every complete message that follows
+	bool next_complete;
+	do {
+		m_receive_base++;
+		next_complete = m_receive_sack & 1;
+		m_receive_sack >>= 1;
+	} while (next_complete);
+	return true;
+}
 
-	memcpy(&message[current_pos], &stream_id, sizeof(stream_id));
-	current_pos += sizeof(stream_id);
+void Stream::SendAck(uint16_t message_id, uint16_t part_id) {
+	wire::AckHeader ack;
+	ack.client_id = client_uuid;
+	ack.stream_id = stream_id;
+	ack.message_id = message_id;
+	ack.part_id = part_id;
+	ack.receive_base = m_receive_base;
+	ack.receive_sack = m_receive_sack;
 
-	memcpy(&message[current_pos], &data, sizeof(data));
+	std::array<char, wire::MAX_ACK_SIZE> message;
+	const size_t message_size = wire::WriteAck(m_wire_version, ack, message);
 
-	socket->SendTo(target.ip, target.port, message);
+	socket->SendTo(target, std::span<const char>(message).first(message_size));
+	if (m_keepalive) m_keepalive->OnSent();
+}
 
-	m_last_data.resize(data_size);
-	memcpy(m_last_data.data(), &data[21], data_size);
-}
\ No newline at end of file
+void Stream::SetCompression(bool enabled, uint8_t dictionary) {
+	m_compression = enabled;
+	m_compression_dictionary = dictionary;
+}
+
+const lz::Dictionary* Stream::FindDictionary(uint8_t id) const {
+	if (id == 0 || id > m_dictionaries.size()) return nullptr;
+	return m_dictionaries[id - 1].get();
+}
+
+// Compressed messages are the dictionary id, the original size and the compressed bytes
+bool Stream::Compress(std::span<const char> data) {
+	const lz::Dictionary* dictionary = FindDictionary(m_compression_dictionary);
+	const uint8_t dictionary_id = dictionary ? m_compression_dictionary : 0;
+
+	std::array<char, 1 + 10> header;
+	header[0] = static_cast<char>(dictionary_id);
+	const size_t header_size = 1 + wire::WriteVarint(data.size(), &header[1]);
+	lz::Compress(data, m_compressed, dictionary);
+	if (header_size + m_compressed.size() >= data.size()) return false;
+	m_compressed.insert(m_compressed.begin(), header.begin(), header.begin() + header_size);
+	return true;
+}
+
+bool Stream::Decompress(std::span<const char> data) {
+	if (data.empty()) return false;
+	const uint8_t dictionary_id = static_cast<uint8_t>(data[0]);
+	const lz::Dictionary* dictionary = FindDictionary(dictionary_id);
+	if (dictionary_id != 0 && !dictionary) return false;
+
+	size_t pos = 1;
+	uint64_t size;
+	// No byte of compressed data expands to more than 255, a forged size does not make it allocate more
+	if (!wire::ReadVarint(data, pos, size) || size > data.size() * 255) return false;
+	return lz::Decompress(data.subspan(pos), size, m_decompressed, dictionary);
+}
+
+void Stream::SendSnapshotAck(uint16_t sequence) {
+	schema::Message<schema::SnapshotAck> ack;
+	ack.Set<schema::SnapshotAck::ClientId>(client_uuid)
+		.Set<schema::SnapshotAck::StreamId>(stream_id)
+		.Set<schema::SnapshotAck::Sequence>(sequence);
+	socket->SendTo(target, ack.Bytes());
+	if (m_keepalive) m_keepalive->OnSent();
+}
+
+void Stream::OnSnapshotAckReceived(std::span<const char> data) {
+	const auto ack = schema::View<schema::SnapshotAck>::Of(data);
+	if (!ack || !m_snapshot_encoder) return;
+	m_snapshot_encoder->OnAcknowledged(ack->Get<schema::SnapshotAck::Sequence>());
+}
+
+std::optional<std::chrono::steady_clock::duration> Stream::OnAckReceived(std::span<const char> data) {
+	wire::AckHeader ack;
+	if (!wire::ReadAck(data, ack)) return std::nullopt;
+
+	const uint16_t message_id = ack.message_id;
+	const uint16_t part_id = ack.part_id;
+	const uint16_t receive_base = ack.receive_base;
+	const uint64_t receive_sack = ack.receive_sack;
+
+	std::lock_guard lock(m_send_window_mutex);
+	if (m_send_window.empty()) return std::nullopt;
+	const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	std::optional<std::chrono::steady_clock::duration> rtt;
+	size_t acked_bytes = 0;
+	std::chrono::steady_clock::time_point acked_sent_at{};
+	const OutgoingMessage* last_acked = nullptr;
+	// Only the messages in flight can be acknowledged or lost, those queued behind them are never looked at
+	const uint16_t window_start = m_send_window.front().msg_id;
+	size_t in_flight = 0;
+	for (OutgoingMessage& message : m_send_window) {
+		if (static_cast<uint16_t>(message.msg_id - window_start) >= WINDOW_SIZE) break;
+		in_flight++;
+		// Offsets past half the id range are messages before the receiver's base
+		const uint16_t offset = message.msg_id - receive_base;
+		const bool complete = offset >= 0x8000 || (offset > 0 && offset <= 64 && (receive_sack >> (offset - 1)) & 1);
+		if (!complete && message.msg_id != message_id) continue;
+
+		bool newly_acked = false;
+		for (uint16_t part = 0; part < message.part_total; part++) {
+			if (message.acked_parts.Test(part) || (!complete && part != part_id)) continue;
+
+			if (message.sent_parts.Test(part) && !message.pending_parts.Test(part)) {
+				acked_bytes += Part(message.data, part, message.part_size).size() + m_header_size;
+			}
+			if (message.msg_id == message_id && part == part_id && !message.resent) {
+				rtt = now - message.sent_at;
+			}
+			message.acked_parts.Set(part);
+			message.acked_count++;
+			if (message.pending_parts.Test(part)) {
+				message.pending_parts.Reset(part);
+				message.pending_count--;
+			}
+			newly_acked = true;
+		}
+		message.acked = message.acked_count == message.part_total;
+		if (newly_acked) {
+			acked_sent_at = std::max(acked_sent_at, message.sent_at);
+			last_acked = &message;
+		}
+	}
+
+	if (m_congestion && last_acked != nullptr) {
+		m_congestion->OnPacketsAcked(acked_bytes, acked_sent_at);
+
+		// A message is presumed lost once one sent after it, three ids further, is acknowledged
+		size_t lost_bytes = 0;
+		std::chrono::steady_clock::time_point lost_sent_at{};
+		for (OutgoingMessage& message : m_send_window) {
+			if (static_cast<uint16_t>(message.msg_id - window_start) >= WINDOW_SIZE) break;
+			const uint16_t distance = last_acked->msg_id - message.msg_id;
+			if (message.acked || distance < 3 || distance >= 0x8000 || message.sent_at >= last_acked->sent_at) continue;
+
+			for (uint16_t part = 0; part < message.part_total; part++) {
+				if (message.sent_parts.Test(part) && !message.acked_parts.Test(part) && !message.pending_parts.Test(part)) {
+					lost_bytes += Part(message.data, part, message.part_size).size() + m_header_size;
+					message.pending_parts.Set(part);
+					message.pending_count++;
+					lost_sent_at = std::max(lost_sent_at, message.sent_at);
+				}
+			}
+		}
+		if (lost_bytes > 0) {
+			m_congestion->OnPacketsLost(lost_bytes, lost_sent_at, now);
+		}
+	}
+
+	const auto window_end = m_send_window.begin() + in_flight;
+	m_send_window.erase(std::remove_if(m_send_window.begin(), window_end, [](const OutgoingMessage& message) {
+		return message.acked;
+	}), window_end);
+
+	// Acknowledgements slide the window, send what was waiting for room. Controlled streams wait for Transmit.
+	if (!m_congestion) {
+		SendPending();
+	}
+	return rtt;
+}
@@ -0,0 +1,79 @@
+#include "congestion_controller.h"
+
+#include <algorithm>
+#include <cstdint>
+
+void CongestionController::OnPacketSent(size_t bytes, Clock::time_point now)
+{
+    m_bytes_in_flight += bytes;
+
+    if (m_smoothed_rtt == Clock::duration::zero())
+    {
+        return;
+    }
+    // Time the packet takes at the pacing rate, and the credit a sender regains after being idle
+    const size_t rate_window = std::max<size_t>(GetWindow(), 1) * PACING_GAIN_PERCENT / 100;
+    const Clock::duration interval = m_smoothed_rtt * static_cast<int64_t>(bytes) / static_cast<int64_t>(rate_window);
+    const Clock::duration burst = m_smoothed_rtt * static_cast<int64_t>(PACING_BURST) / static_cast<int64_t>(rate_window);
+    m_next_send_time = std::max(m_next_send_time, now - burst) + interval;
+}
+
+void CongestionController::OnPacketsAcked(size_t bytes, Clock::time_point sent_at)
+{
+    m_bytes_in_flight -= std::min(bytes, m_bytes_in_flight);
+    if (bytes > 0)
+    {
+        OnAcked(bytes, sent_at);
+    }
+}
+
+void CongestionController::OnPacketsLost(size_t bytes, Clock::time_point sent_at, Clock::time_point now)
+{
+    m_bytes_in_flight -= std::min(bytes, m_bytes_in_flight);
+    OnLost(sent_at, now);
+}
+
+void CongestionController::OnRetransmissionTimeout(Clock::time_point now)
+{
+    OnTimeout(now);
+}
+
+void NewRenoController::OnAcked(size_t bytes, Clock::time_point sent_at)
+{
+    if (sent_at <= m_recovery_start)
+    {
+        return;
+    }
+    if (m_window < m_slow_start_threshold)
+    {
+        m_window += bytes;
+        return;
+    }
+    // One segment per window of acknowledged bytes
+    m_acked_in_avoidance += bytes;
+    if (m_acked_in_avoidance >= m_window)
+    {
+        m_acked_in_avoidance -= m_window;
+        m_window += MAX_SEGMENT_SIZE;
+    }
+}
+
+void NewRenoController::OnLost(Clock::time_point sent_at, Clock::time_point now)
+{
+    if (sent_at <= m_recovery_start)
+    {
+        return;
+    }
+    m_recovery_start = now;
+    m_slow_start_threshold = std::max(m_window / 2, MINIMUM_WINDOW);
+    m_window = m_slow_start_threshold;
+    m_acked_in_avoidance = 0;
+}
+
+void NewRenoController::OnTimeout(Clock::time_point now)
+{
+    m_recovery_start = now;
+    m_slow_start_threshold = std::max(m_window / 2, MINIMUM_WINDOW);
+    m_window = MINIMUM_WINDOW;
+    m_acked_in_avoidance = 0;
+}
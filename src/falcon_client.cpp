@@ -1,16 +1,15 @@
 #include "falcon_client.h"
-#include "message_type.h"
+#include "message_schema.h"
 #include <array>
+#include <algorithm>
 #include "spdlog/spdlog.h"
 
 using namespace std::chrono_literals;
 
-constexpr std::chrono::microseconds TIMEOUT = 1000ms;
-constexpr std::chrono::microseconds ACK_CHECK = 500ms;
-
 FalconClient::~FalconClient()
 {
 	m_listen = false;
+	Wakeup();
 	if(m_listener.joinable())
 	{
 		m_listener.join();
@@ -20,20 +19,25 @@ FalconClient::~FalconClient()
 void FalconClient::ConnectTo(const std::string& ip, uint16_t port)
 {
 	Falcon::CreateClient(ip);
+	server = Endpoint::Resolve(ip, port);
+	{
+		std::lock_guard lock(m_rtt_mutex);
+		m_rtt = RttEstimator(m_connection_settings.resend_interval, m_connection_settings.min_resend_interval, m_connection_settings.max_resend_interval);
+	}
+	if (m_connection_settings.congestion_controller)
+	{
+		m_congestion = m_connection_settings.congestion_controller();
+	}
+	m_reassembler = std::make_shared<Reassembler>(m_connection_settings.max_reassembly_bytes, m_connection_settings.reassembly_timeout);
+	m_keepalive = std::make_shared<Keepalive>();
+	m_path_mtu = std::make_shared<PathMtuDiscovery>(m_connection_settings.min_datagram_size, m_connection_settings.max_datagram_size,
+		m_connection_settings.mtu_raise_interval);
 	m_listen = true;
 	m_listener = std::thread(ThreadListen, std::ref(*this));
-	server.ip = ip;
-	server.port = port;
-
-	std::string connection_message;
-	const uint16_t msg_size = 4;
-	connection_message.resize(msg_size);
 
-	connection_message[0] = CONNECT;
-	memcpy(&connection_message[1], &msg_size, sizeof(msg_size));
-	memcpy(&connection_message[3], &m_version, sizeof(m_version));
-
-	SendTo(server.ip, server.port, connection_message);
+	schema::Message<schema::Connect> connection_message;
+	connection_message.Set<schema::Connect::Version>(m_version);
+	SendTo(server, connection_message.Bytes());
 }
 
 void FalconClient::OnConnectionEvent(std::function<void(bool, uint64_t)> handler)
@@ -55,60 +59,265 @@ void FalconClient::OnDisconnect(std::function<void()> handler)
 
 
 
-void FalconClient::SendData(std::span<const char> data, uint32_t stream_id)
+bool FalconClient::SendData(std::span<const char> data, uint32_t stream_id)
 { 
-	if(m_streams.contains(stream_id))
+	StreamCommand command;
+	command.type = StreamCommand::Type::Send;
+	command.stream_id = stream_id;
+	command.SetData(data);
+	return SubmitCommand(std::move(command));
+}
+
+bool FalconClient::SubmitCommand(StreamCommand&& command)
+{
+	if (!m_commands.TryPush(std::move(command)))
+	{
+		return false;
+	}
+	// One wakeup until the listener drains the queue
+	if (!m_commands_signaled.exchange(true))
 	{
-		m_streams.at(stream_id)->SendData(data);
-		if (stream_id & 1 << 31)
+		Wakeup();
+	}
+	return true;
+}
+
+void FalconClient::ProcessCommands()
+{
+	// Cleared first, a command pushed while draining wakes the listener up again
+	m_commands_signaled = false;
+	bool reliable_data = false;
+	StreamCommand command;
+	while (m_commands.TryPop(command))
+	{
+		switch (command.type)
+		{
+		case StreamCommand::Type::Open:
+			RegisterStream(std::move(command.stream));
+			break;
+		case StreamCommand::Type::Send:
+			if (m_streams.contains(command.stream_id))
+			{
+				Stream& stream = *m_streams.at(command.stream_id);
+				stream.SendData(command.GetData());
+				if (stream.IsReliable())
+				{
+					std::lock_guard lock(m_streams_mutex);
+					m_streams_ack.insert(command.stream_id);
+					reliable_data = true;
+				}
+			}
+			break;
+		case StreamCommand::Type::Close:
 		{
-			m_streams_ack.insert({ stream_id, data });
+			schema::Message<schema::CloseStream> message;
+			message.Set<schema::CloseStream::ClientId>(m_id)
+				.Set<schema::CloseStream::StreamId>(command.stream_id);
+			SendTo(server, message.Bytes());
+			ForgetStream(command.stream_id);
 		}
+			break;
+		}
+	}
+
+	if (reliable_data)
+	{
+		if (!m_timers.IsScheduled(m_resend_timer))
+		{
+			m_resend_timer = m_timers.Schedule(std::chrono::steady_clock::now() + GetRto(), [this]() { ResendUnacknowledged(); });
+		}
+		TransmitPending();
 	}
 }
 
-void FalconClient::ThreadListen(FalconClient& client)
+std::chrono::microseconds FalconClient::GetRtt() const
 {
-	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
-	std::chrono::steady_clock::time_point timeout_timer = start;
-	std::chrono::steady_clock::time_point ack_check = std::chrono::steady_clock::now();
+	std::lock_guard lock(m_rtt_mutex);
+	return m_rtt.GetRtt();
+}
 
-	uint16_t ping_id = 0;
+std::chrono::microseconds FalconClient::GetRto() const
+{
+	std::lock_guard lock(m_rtt_mutex);
+	return m_rtt.GetRto();
+}
 
-	while(client.m_listen)
+uint16_t FalconClient::GetMaxDatagramSize() const
+{
+	return m_path_mtu ? m_path_mtu->GetMaxDatagramSize() : m_connection_settings.min_datagram_size;
+}
+
+void FalconClient::AddRttSample(std::chrono::steady_clock::duration rtt)
+{
+	std::lock_guard lock(m_rtt_mutex);
+	m_rtt.AddSample(std::chrono::duration_cast<std::chrono::microseconds>(rtt));
+	if (m_congestion)
 	{
-		std::array<char, 65535> buffer;
-		std::string other_ip;
-		int recv_size = client.ReceiveFrom(other_ip, buffer);
+		m_congestion->SetSmoothedRtt(m_rtt.GetRtt());
+	}
+}
 
+void FalconClient::TransmitPending()
+{
+	if (!m_congestion)
+	{
+		return;
+	}
+	const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	std::chrono::steady_clock::time_point next_send = std::chrono::steady_clock::time_point::max();
+	for (uint32_t stream_id : m_streams_ack)
+	{
+		if (m_streams.contains(stream_id))
+		{
+			next_send = std::min(next_send, m_streams.at(stream_id)->Transmit(now));
+		}
+	}
+
+	// Come back when the pacer lets the next part out, acknowledgements take care of a full window
+	if (next_send != std::chrono::steady_clock::time_point::max() && !m_timers.Reschedule(m_transmit_timer, next_send))
+	{
+		m_transmit_timer = m_timers.Schedule(next_send, [this]() { TransmitPending(); });
+	}
+}
+
+void FalconClient::ProbePathMtu()
+{
+	const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	if (const uint16_t probe_size = m_path_mtu->OnProbeTimer(now); probe_size > 0)
+	{
+		SendMtuProbe(server, m_id, probe_size);
+		// Still unacknowledged after a retransmission timeout, the probe counts as lost
+		m_timers.Reschedule(m_probe_timer, now + GetRto());
+	}
+	else if (m_path_mtu->GetRaiseTime() != std::chrono::steady_clock::time_point::max())
+	{
+		m_timers.Reschedule(m_probe_timer, m_path_mtu->GetRaiseTime());
+	}
+}
+
+void FalconClient::OnTimeout()
+{
+	m_listen = false;
+	if (!m_connected)
+	{
+		OnConnectionEvent(m_on_connect);
+		spdlog::debug("Connection failed");
+	}
+	else
+	{
+		OnDisconnect(m_on_disconnect);
+		spdlog::debug("Disconnection due to inactivity");
+	}
+}
+
+void FalconClient::SendPing()
+{
+	// Echoed back in the PONG to measure the round trip time
+	schema::Message<schema::Ping> ping_msg;
+	ping_msg.Set<schema::Ping::ClientId>(m_id)
+		.Set<schema::Ping::PingId>(m_ping_id)
+		.Set<schema::Ping::Time>(std::chrono::steady_clock::now());
+	SendTo(server, ping_msg.Bytes());
 
-		if(client.m_connected)
+	spdlog::debug("Ping sent");
+	m_ping_id++;
+}
+
+void FalconClient::OnKeepaliveTimer()
+{
+	// Pings do not count as traffic, only what the server may be waiting for does
+	if (m_keepalive->IsIdle())
+	{
+		SendPing();
+	}
+	m_timers.Reschedule(m_ping_timer, std::chrono::steady_clock::now() + m_connection_settings.GetPingInterval());
+}
+
+void FalconClient::ResendUnacknowledged()
+{
+	const std::chrono::microseconds rto = GetRto();
+	size_t resent = 0;
+	{
+		std::lock_guard lock(m_streams_mutex);
+		std::erase_if(m_streams_ack, [this, rto, &resent](uint32_t stream_id) {
+			if (!m_streams.contains(stream_id))
+			{
+				return true;
+			}
+			resent += m_streams.at(stream_id)->ResendUnacknowledged(rto);
+			return m_streams.at(stream_id)->GetUnacknowledgedCount() == 0;
+		});
+	}
+	if (resent > 0)
+	{
+		{
+			std::lock_guard lock(m_rtt_mutex);
+			m_rtt.Backoff();
+		}
+		if (m_congestion)
 		{
-			std::string ping_msg;
-			std::chrono::system_clock::time_point time = std::chrono::system_clock::now();;
-			const uint16_t msg_size = 13 + sizeof(time);
-			ping_msg.resize(msg_size);
-
-			ping_msg[0] = PING;
-			memcpy(&ping_msg[1], &msg_size, sizeof(msg_size));
-			memcpy(&ping_msg[3], &client.m_id, sizeof(client.m_id));
-			memcpy(&ping_msg[11], &ping_id, sizeof(ping_id));
-			memcpy(&ping_msg[13], &time, sizeof(time));
-			client.SendTo(client.server.ip, client.server.port, ping_msg);
-
-			spdlog::debug("Ping sent");
+			m_congestion->OnRetransmissionTimeout(std::chrono::steady_clock::now());
+			TransmitPending();
 		}
+	}
+	if (m_streams_ack.empty())
+	{
+		return;
+	}
+	m_timers.Reschedule(m_resend_timer, std::chrono::steady_clock::now() + GetRto());
+}
 
-		ping_id++;
-		if (recv_size > 0)
+void FalconClient::ThreadListen(FalconClient& client)
+{
+	client.m_timeout_timer = client.m_timers.Schedule(std::chrono::steady_clock::now() + client.m_connection_settings.timeout,
+		[&client]() { client.OnTimeout(); });
+
+	client.EnableSendBatching();
+	while(client.m_listen)
+	{
+		// Sleep until the next timer is due
+		const std::chrono::steady_clock::time_point next_deadline = std::min(client.m_timers.NextDeadline(), client.NextCoalescingDeadline());
+		const int wait_ms = next_deadline == std::chrono::steady_clock::time_point::max() ? -1 : Falcon::TimeoutUntil(next_deadline);
+
+		for (const Datagram& datagram : client.ReceiveBatch(wait_ms))
 		{
-			timeout_timer = std::chrono::steady_clock::now();
+			const std::span<const char> buffer = datagram.buffer.first(datagram.size);
+			if (buffer.empty())
+			{
+				continue;
+			}
+
+			if (client.m_connected)
+			{
+				client.m_timers.Reschedule(client.m_timeout_timer, std::chrono::steady_clock::now() + client.m_connection_settings.timeout);
+			}
 			switch (MessageType(buffer[0]))
 			{
 			case CONNECT_ACK:
 			{
+				const auto ack = schema::View<schema::ClientHeader>::Of(buffer);
+				if (!ack)
+				{
+					break;
+				}
+				client.m_id = ack->Get<schema::ClientHeader::ClientId>();
+				// Servers before the version byte was sent use the fixed layout, the others the newest both sides know
+				client.m_wire_version = wire::VERSION_FIXED;
+				if (const auto versioned = schema::View<schema::ConnectAck>::Of(buffer))
+				{
+					client.m_wire_version = std::clamp(versioned->Get<schema::ConnectAck::Version>(), wire::VERSION_FIXED, client.m_version);
+				}
+				for (const auto& [stream_id, stream] : client.m_streams)
+				{
+					stream->SetWireVersion(client.m_wire_version);
+				}
 				client.m_connected = true;
-				memcpy(&client.m_id, &buffer[3], sizeof(client.m_id));
+				client.m_timers.Reschedule(client.m_timeout_timer, std::chrono::steady_clock::now() + client.m_connection_settings.timeout);
+				client.m_ping_timer = client.m_timers.Schedule(std::chrono::steady_clock::now(), [&client]() { client.OnKeepaliveTimer(); });
+				if (!client.m_timers.IsScheduled(client.m_probe_timer))
+				{
+					client.m_probe_timer = client.m_timers.Schedule(std::chrono::steady_clock::now(), [&client]() { client.ProbePathMtu(); });
+				}
 				client.OnConnectionEvent(client.m_on_connect);
 				spdlog::debug("Connection ACK received");
 			}
@@ -118,106 +327,225 @@ void FalconClient::ThreadListen(FalconClient& client)
 				client.OnDisconnect(client.m_on_disconnect);
 				spdlog::debug("Disconnect received");
 				break;
+			case PING:
+			{
+				// Keepalive of the server, the pong gives it a round trip time sample
+				const auto ping = schema::View<schema::Ping>::Of(buffer);
+				if (!ping)
+				{
+					break;
+				}
+				schema::Message<schema::Pong> pong;
+				pong.Set<schema::Pong::ClientId>(ping->Get<schema::Ping::ClientId>())
+					.Set<schema::Pong::PingId>(ping->Get<schema::Ping::PingId>())
+					.Set<schema::Pong::Time>(ping->Get<schema::Ping::Time>());
+				client.SendTo(client.server, pong.Bytes());
+				client.m_keepalive->OnSent();
+				client.m_timers.Reschedule(client.m_ping_timer, std::chrono::steady_clock::now() + client.m_connection_settings.GetPingInterval());
+			}
+			break;
 			case PONG:
 			{
+				if (const auto pong = schema::View<schema::Pong>::Of(buffer))
+				{
+					client.AddRttSample(std::chrono::steady_clock::now() - pong->Get<schema::Pong::Time>());
+				}
 				spdlog::debug("Pong received");
 			}
 			break;
-			case CLOSE_STREAM:
-			{
-				uint32_t stream_id;
-				memcpy(&stream_id, &buffer[11], sizeof(stream_id));
-				for (size_t i = 0; i < client.m_local_streams.size(); i++)
+			case MTU_PROBE:
+				client.SendMtuProbeAck(client.server, client.m_id, buffer);
+				break;
+			case MTU_PROBE_ACK:
+				if (const auto probe_ack = schema::View<schema::MtuProbeAck>::Of(buffer))
 				{
-					if (client.m_local_streams[i]->GetStreamID() == stream_id)
+					const uint16_t probe_size = probe_ack->Get<schema::MtuProbeAck::ProbeSize>();
+					const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+					// The probe got through, go on with the next size right away
+					if (client.m_path_mtu->OnProbeAcked(probe_size, now))
 					{
-						client.m_local_streams.erase(client.m_local_streams.begin() + i);
-						break;
+						client.m_timers.Reschedule(client.m_probe_timer, now);
 					}
 				}
-
-				client.m_streams.erase(stream_id);
-
+				break;
+			case CLOSE_STREAM:
+			{
+				const auto close = schema::View<schema::CloseStream>::Of(buffer);
+				if (!close)
+				{
+					break;
+				}
+				client.ForgetStream(close->Get<schema::CloseStream::StreamId>());
 			}
 			break;
 			case DATA:
+			case DATA_COMPACT:
 			{
 				uint32_t stream_id;
-				memcpy(&stream_id, &buffer[11], sizeof(stream_id));
+				if (!wire::ReadStreamId(buffer, stream_id))
+				{
+					break;
+				}
 
 				if (!client.m_streams.contains(stream_id))
 				{
-					client.m_local_streams.push_back(client.MakeStream(stream_id, stream_id & RELIABLE_STREAM_BIT));
+					client.RegisterStream(client.MakeStream(stream_id));
 				}
 				client.m_streams.at(stream_id)->OnDataReceived(buffer);
 			}
 				break;
 			case DATA_ACK:
+			case DATA_ACK_COMPACT:
 				{
 					uint32_t stream_id;
-					memcpy(&stream_id, &buffer[11], sizeof(stream_id));
-					if (client.m_streams_ack.contains(stream_id))
+					if (!wire::ReadStreamId(buffer, stream_id))
+					{
+						break;
+					}
+					if (client.m_streams.contains(stream_id))
 					{
-						client.m_streams_ack.erase(stream_id);
+						Stream* stream = client.m_streams.at(stream_id).get();
+						if (const auto rtt = stream->OnAckReceived(buffer))
+						{
+							client.AddRttSample(*rtt);
+						}
+						// The acknowledgement opened the window
+						client.TransmitPending();
+						if (stream->GetUnacknowledgedCount() == 0)
+						{
+							std::lock_guard lock(client.m_streams_mutex);
+							client.m_streams_ack.erase(stream_id);
+						}
 					}
 				}
 				break;
-			}
-		}
-		else
-		{
-			if (!client.m_connected)
-			{
-				if (duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start) > TIMEOUT)
-				{
-					client.m_listen = false;
-					client.OnConnectionEvent(client.m_on_connect);
-					spdlog::debug("Connection failed");
-				}
-			}
-			else
+			case SNAPSHOT_ACK:
 			{
-				auto a = duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - timeout_timer);
-				if (duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - timeout_timer) > TIMEOUT)
+				uint32_t stream_id;
+				if (wire::ReadStreamId(buffer, stream_id) && client.m_streams.contains(stream_id))
 				{
-					client.m_listen = false;
-					client.OnDisconnect(client.m_on_disconnect);
-					spdlog::debug("Disconnection due to inactivity");
+					client.m_streams.at(stream_id)->OnSnapshotAckReceived(buffer);
 				}
-
 			}
-		}
-		if (duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - ack_check) > ACK_CHECK)
-		{
-			for (auto& pair : client.m_streams_ack)
-			{			
-				client.m_streams.at(pair.first)->SendData(pair.second);
+				break;
+			// CONNECT is for the server, streams open with their first DATA, and BATCH datagrams are unpacked before they get here
+			case CONNECT:
+			case CREATE_STREAM:
+			case BATCH:
+				break;
 			}
-			ack_check = std::chrono::steady_clock::now();
 		}
+
+		client.ProcessCommands();
+
+		client.m_timers.Advance(std::chrono::steady_clock::now());
+		client.FlushCoalesced(std::chrono::steady_clock::now());
+		client.FlushSendQueue();
 	}
 }
-std::unique_ptr<Stream> FalconClient::MakeStream(uint32_t stream_id, bool reliable)
+std::shared_ptr<Stream> FalconClient::MakeStream(uint32_t stream_id)
 {
-	std::unique_ptr<Stream> stream = std::make_unique<Stream>(
+	return std::make_shared<Stream>(
 		stream_id,
 		m_id,
 		server,
 		this
 	);
+}
+
+void FalconClient::RegisterStream(std::shared_ptr<Stream> stream)
+{
+	if (m_reassembler)
+	{
+		stream->SetReassembler(m_reassembler);
+	}
+	if (m_path_mtu)
+	{
+		stream->SetPathMtu(m_path_mtu);
+	}
+	if (m_keepalive)
+	{
+		stream->SetKeepalive(m_keepalive);
+	}
+	if (m_congestion && stream->IsReliable())
+	{
+		stream->SetCongestionController(m_congestion);
+	}
+	stream->SetWireVersion(m_wire_version);
+	stream->SetCompressionDictionaries(m_connection_settings.compression_dictionaries);
+
+	const uint32_t stream_id = stream->GetStreamID();
+	std::lock_guard lock(m_streams_mutex);
+	m_streams.insert({ stream_id, std::move(stream) });
+}
+
+void FalconClient::ForgetStream(uint32_t stream_id)
+{
+	{
+		std::lock_guard lock(m_streams_mutex);
+		m_streams.erase(stream_id);
+		m_streams_ack.erase(stream_id);
+	}
+	if (m_reassembler)
+	{
+		m_reassembler->Forget(stream_id);
+	}
+}
+
+std::shared_ptr<Stream> FalconClient::GetStream(uint32_t stream_id) const
+{
+	std::lock_guard lock(m_streams_mutex);
+	const auto it = m_streams.find(stream_id);
+	return it != m_streams.end() ? it->second : nullptr;
+}
+
+size_t FalconClient::GetStreamCount() const
+{
+	std::lock_guard lock(m_streams_mutex);
+	return m_streams.size();
+}
 
-	m_streams.insert({ stream_id, stream.get()});
-	return stream;
+size_t FalconClient::GetStreamsAwaitingAck() const
+{
+	std::lock_guard lock(m_streams_mutex);
+	return m_streams_ack.size();
 }
 
-std::unique_ptr<Stream> FalconClient::CreateStream(bool reliable) {
-	return MakeStream(GetNewStreamID(reliable), reliable);
+std::shared_ptr<Stream> FalconClient::CreateStream(bool reliable) {
+	return OpenStream(GetNewStreamID(reliable));
+}
+
+std::shared_ptr<Stream> FalconClient::CreateSnapshotStream() {
+	return OpenStream(GetNewStreamID(false) | Stream::SNAPSHOT_STREAM_BIT);
+}
+
+std::shared_ptr<Stream> FalconClient::CreateSequencedStream() {
+	return OpenStream(GetNewStreamID(false) | Stream::SEQUENCED_STREAM_BIT);
+}
+
+std::shared_ptr<Stream> FalconClient::CreateOrderedStream() {
+	return OpenStream(GetNewStreamID(true) | Stream::SEQUENCED_STREAM_BIT);
+}
+
+bool FalconClient::CloseStream(const Stream& stream) {
+	StreamCommand command;
+	command.type = StreamCommand::Type::Close;
+	command.stream_id = stream.GetStreamID();
+	return SubmitCommand(std::move(command));
+}
+
+std::shared_ptr<Stream> FalconClient::OpenStream(uint32_t stream_id) {
+	std::shared_ptr<Stream> stream = MakeStream(stream_id);
+
+	StreamCommand command;
+	command.type = StreamCommand::Type::Open;
+	command.stream = stream;
+	return SubmitCommand(std::move(command)) ? stream : nullptr;
 }
 
 uint32_t FalconClient::GetNewStreamID(bool reliable)
 {
-	uint32_t id = m_lastUsedStreamID;
-	m_lastUsedStreamID++;
+	uint32_t id = m_lastUsedStreamID++;
 
 	if (reliable)
 		id = id | RELIABLE_STREAM_BIT;
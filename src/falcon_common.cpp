@@ -1,11 +1,418 @@
 #include "falcon.h"
+#include "message_schema.h"
+#include <algorithm>
+
+namespace
+{
+    thread_local const Falcon* batching_socket = nullptr;
+    const std::array<char, Falcon::MAX_DATAGRAM_SIZE> probe_padding{};
+}
 
 int Falcon::SendTo(const std::string &to, uint16_t port, const std::span<const char> message)
 {
-    return SendToInternal(to, port, message);
+    return SendTo(Endpoint::Resolve(to, port), message);
+}
+
+int Falcon::SendTo(const Endpoint& to, const std::span<const char> message)
+{
+    const std::span<const char> parts[] = { message };
+    return SendTo(to, parts);
+}
+
+int Falcon::SendTo(const Endpoint& to, std::span<const std::span<const char>> parts)
+{
+    size_t size = 0;
+    for (const std::span<const char>& part : parts)
+    {
+        size += part.size();
+    }
+
+    if (m_coalescing_window.count() > 0)
+    {
+        return Coalesce(to, parts, size);
+    }
+    return SendNow(to, parts, size);
+}
+
+int Falcon::SendNow(const Endpoint& to, std::span<const std::span<const char>> parts, size_t size)
+{
+    if (batching_socket == this && size <= SEND_SLOT_SIZE)
+    {
+        if (m_send_pool.BufferCount() == 0)
+        {
+            m_send_pool.Reset(SEND_POOL_SIZE, SEND_SLOT_SIZE);
+            m_send_queue.reserve(SEND_POOL_SIZE);
+        }
+        if (m_send_pool.Available() == 0)
+        {
+            FlushSendQueue();
+        }
+
+        const int buffer = m_send_pool.Acquire();
+        std::span<char> data = m_send_pool.Get(buffer).first(size);
+        size_t offset = 0;
+        for (const std::span<const char>& part : parts)
+        {
+            memcpy(data.data() + offset, part.data(), part.size());
+            offset += part.size();
+        }
+        m_send_queue.push_back({ to, buffer, data });
+        return static_cast<int>(size);
+    }
+
+    if (parts.size() == 1)
+    {
+        return SendToInternal(to, parts[0]);
+    }
+    if (parts.size() > MAX_GATHER_PARTS)
+    {
+        return -1;
+    }
+    return SendGatherInternal(to, parts);
+}
+
+int Falcon::Coalesce(const Endpoint& to, std::span<const std::span<const char>> parts, size_t size)
+{
+    const size_t limit = m_connection_settings.min_datagram_size;
+    std::unique_lock lock(m_coalescing_mutex);
+    CoalescedDatagram& coalesced = m_coalescing[to];
+    if (coalesced.count > 0 && coalesced.data.size() + BATCH_FRAME_SIZE + size > limit)
+    {
+        SendCoalesced(to, coalesced);
+    }
+    // Too large to share a datagram, it goes out on its own right after what was held to keep the order
+    if (BATCH_HEADER_SIZE + BATCH_FRAME_SIZE + size > limit)
+    {
+        return SendNow(to, parts, size);
+    }
+
+    bool wakeup = false;
+    if (coalesced.count == 0)
+    {
+        coalesced.data.reserve(limit);
+        // Room for the header, written once the datagram is complete
+        coalesced.data.resize(BATCH_HEADER_SIZE);
+        coalesced.flush_at = std::chrono::steady_clock::now() + m_coalescing_window;
+        if (coalesced.flush_at < m_coalescing_deadline)
+        {
+            m_coalescing_deadline = coalesced.flush_at;
+            // The listener may be asleep past the new deadline
+            wakeup = batching_socket != this;
+        }
+    }
+
+    const uint16_t frame_size = static_cast<uint16_t>(size);
+    size_t offset = coalesced.data.size();
+    coalesced.data.resize(offset + BATCH_FRAME_SIZE + size);
+    memcpy(coalesced.data.data() + offset, &frame_size, sizeof(frame_size));
+    offset += BATCH_FRAME_SIZE;
+    for (const std::span<const char>& part : parts)
+    {
+        memcpy(coalesced.data.data() + offset, part.data(), part.size());
+        offset += part.size();
+    }
+    coalesced.count++;
+
+    lock.unlock();
+    if (wakeup)
+    {
+        Wakeup();
+    }
+    return static_cast<int>(size);
+}
+
+void Falcon::SendCoalesced(const Endpoint& to, CoalescedDatagram& coalesced)
+{
+    static_assert(BATCH_HEADER_SIZE == schema::Batch::SIZE);
+    std::span<const char> datagram(coalesced.data);
+    if (coalesced.count == 1)
+    {
+        // A lone message needs no framing
+        datagram = datagram.subspan(BATCH_HEADER_SIZE + BATCH_FRAME_SIZE);
+    }
+    else
+    {
+        schema::Writer<schema::Batch>(std::span<char, schema::Batch::SIZE>(coalesced.data.data(), schema::Batch::SIZE),
+            static_cast<uint16_t>(datagram.size()));
+    }
+
+    const std::span<const char> parts[] = { datagram };
+    SendNow(to, parts, datagram.size());
+    coalesced.data.clear();
+    coalesced.count = 0;
+}
+
+void Falcon::Flush()
+{
+    std::lock_guard lock(m_coalescing_mutex);
+    for (auto& [to, coalesced] : m_coalescing)
+    {
+        if (coalesced.count > 0)
+        {
+            SendCoalesced(to, coalesced);
+        }
+    }
+    m_coalescing_deadline = std::chrono::steady_clock::time_point::max();
+}
+
+void Falcon::FlushCoalesced(std::chrono::steady_clock::time_point now)
+{
+    if (m_coalescing_window.count() == 0)
+    {
+        return;
+    }
+
+    std::lock_guard lock(m_coalescing_mutex);
+    if (now < m_coalescing_deadline)
+    {
+        return;
+    }
+    m_coalescing_deadline = std::chrono::steady_clock::time_point::max();
+    for (auto entry = m_coalescing.begin(); entry != m_coalescing.end();)
+    {
+        CoalescedDatagram& coalesced = entry->second;
+        // Peers gone quiet for a while give their buffer back
+        if (coalesced.count == 0 && now - coalesced.flush_at > std::chrono::seconds(1))
+        {
+            entry = m_coalescing.erase(entry);
+            continue;
+        }
+        if (coalesced.count > 0 && coalesced.flush_at <= now)
+        {
+            SendCoalesced(entry->first, coalesced);
+        }
+        else if (coalesced.count > 0)
+        {
+            m_coalescing_deadline = std::min(m_coalescing_deadline, coalesced.flush_at);
+        }
+        ++entry;
+    }
+}
+
+std::chrono::steady_clock::time_point Falcon::NextCoalescingDeadline()
+{
+    if (m_coalescing_window.count() == 0)
+    {
+        return std::chrono::steady_clock::time_point::max();
+    }
+    std::lock_guard lock(m_coalescing_mutex);
+    return m_coalescing_deadline;
 }
 
 int Falcon::ReceiveFrom(std::string& from, const std::span<char, 65535> message)
 {
     return ReceiveFromInternal(from, message);
-}
\ No newline at end of file
+}
+
+int Falcon::ReceiveFromBatch(std::span<Datagram> datagrams)
+{
+    if (datagrams.size() > MAX_BATCH_SIZE)
+    {
+        datagrams = datagrams.first(MAX_BATCH_SIZE);
+    }
+    return ReceiveBatchInternal(datagrams, m_timeout_ms);
+}
+
+std::span<const Datagram> Falcon::ReceiveBatch(int timeout_ms)
+{
+    if (m_receive_pool.BufferCount() == 0)
+    {
+        m_receive_pool.Reset(MAX_BATCH_SIZE, MAX_DATAGRAM_SIZE);
+        for (Datagram& datagram : m_receive_ring)
+        {
+            datagram.buffer = m_receive_pool.Get(m_receive_pool.Acquire());
+        }
+        m_unbatched.reserve(4 * MAX_BATCH_SIZE);
+    }
+
+    const NetworkConditions& conditions = m_network_conditions;
+    if (conditions.loss_rate > 0.0 || conditions.latency.count() > 0 || conditions.bandwidth > 0 || conditions.max_datagram_size > 0
+        || !m_delayed_datagrams.empty())
+    {
+        return Unbatch(ReceiveImpaired(timeout_ms));
+    }
+
+    const int received = ReceiveBatchInternal(m_receive_ring, timeout_ms);
+    return Unbatch(std::span<const Datagram>(m_receive_ring).first(received));
+}
+
+std::span<const Datagram> Falcon::Unbatch(std::span<const Datagram> datagrams)
+{
+    const bool batched = std::any_of(datagrams.begin(), datagrams.end(), [](const Datagram& datagram) {
+        return datagram.size > 0 && datagram.buffer[0] == BATCH;
+    });
+    if (!batched)
+    {
+        return datagrams;
+    }
+
+    m_unbatched.clear();
+    for (const Datagram& datagram : datagrams)
+    {
+        if (datagram.size == 0 || datagram.buffer[0] != BATCH)
+        {
+            m_unbatched.push_back(datagram);
+            continue;
+        }
+
+        const size_t size = static_cast<size_t>(datagram.size);
+        size_t offset = BATCH_HEADER_SIZE;
+        while (offset + BATCH_FRAME_SIZE <= size)
+        {
+            uint16_t frame_size;
+            memcpy(&frame_size, &datagram.buffer[offset], sizeof(frame_size));
+            offset += BATCH_FRAME_SIZE;
+            if (frame_size == 0 || offset + frame_size > size)
+            {
+                break;  // Truncated, the rest of the datagram cannot be trusted
+            }
+            Datagram& message = m_unbatched.emplace_back();
+            message.from = datagram.from;
+            message.buffer = datagram.buffer.subspan(offset, frame_size);
+            message.size = frame_size;
+            offset += frame_size;
+        }
+    }
+    return m_unbatched;
+}
+
+std::span<const Datagram> Falcon::ReceiveImpaired(int timeout_ms)
+{
+    // Wake up in time to release the oldest held datagram
+    if (!m_delayed_datagrams.empty())
+    {
+        const int release_ms = TimeoutUntil(m_delayed_datagrams.front().release_at);
+        timeout_ms = timeout_ms < 0 ? release_ms : std::min(timeout_ms, release_ms);
+    }
+
+    const int received = ReceiveBatchInternal(m_receive_ring, timeout_ms);
+    const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    std::uniform_real_distribution<double> loss(0.0, 1.0);
+    for (int i = 0; i < received; i++)
+    {
+        const Datagram& datagram = m_receive_ring[i];
+        if (m_network_conditions.loss_rate > 0.0 && loss(m_loss_random) < m_network_conditions.loss_rate)
+        {
+            continue;
+        }
+        if (m_network_conditions.max_datagram_size > 0 && static_cast<size_t>(datagram.size) > m_network_conditions.max_datagram_size)
+        {
+            continue;
+        }
+
+        std::chrono::steady_clock::time_point departure = now;
+        if (m_network_conditions.bandwidth > 0)
+        {
+            // Datagrams wait for the bottleneck to drain the ones ahead of them, and are dropped when its queue is full
+            const auto backlog = std::chrono::duration_cast<std::chrono::nanoseconds>(std::max(m_link_free_at, now) - now);
+            const uint64_t queued_bytes = backlog.count() * m_network_conditions.bandwidth / 1000000000;
+            if (m_network_conditions.queue_size > 0 && queued_bytes + static_cast<uint64_t>(datagram.size) > m_network_conditions.queue_size)
+            {
+                continue;
+            }
+            const std::chrono::nanoseconds transmission(datagram.size * 1000000000ull / m_network_conditions.bandwidth);
+            m_link_free_at = std::max(m_link_free_at, now) + transmission;
+            departure = m_link_free_at;
+        }
+        m_delayed_datagrams.push_back({ departure + m_network_conditions.latency, datagram.from,
+            std::vector<char>(datagram.buffer.begin(), datagram.buffer.begin() + datagram.size) });
+    }
+
+    // Release times only grow, so the due datagrams are at the front
+    size_t released = 0;
+    while (released < m_receive_ring.size() && !m_delayed_datagrams.empty() && m_delayed_datagrams.front().release_at <= now)
+    {
+        DelayedDatagram& delayed = m_delayed_datagrams.front();
+        Datagram& datagram = m_receive_ring[released++];
+        datagram.from = delayed.from;
+        datagram.size = static_cast<int>(delayed.data.size());
+        memcpy(datagram.buffer.data(), delayed.data.data(), delayed.data.size());
+        m_delayed_datagrams.pop_front();
+    }
+    return std::span<const Datagram>(m_receive_ring).first(released);
+}
+
+int Falcon::FlushSendQueue()
+{
+    if (m_send_queue.empty())
+    {
+        return 0;
+    }
+
+    int sent = 0;
+    std::span<const QueuedDatagram> queue(m_send_queue);
+    while (!queue.empty())
+    {
+        const size_t count = std::min(queue.size(), MAX_BATCH_SIZE);
+        sent += SendBatchInternal(queue.first(count));
+        queue = queue.subspan(count);
+    }
+
+    for (const QueuedDatagram& queued : m_send_queue)
+    {
+        m_send_pool.Release(queued.buffer);
+    }
+    m_send_queue.clear();
+    return sent;
+}
+
+void Falcon::SendMtuProbe(const Endpoint& to, uint64_t uuid, uint16_t size)
+{
+    static_assert(MTU_PROBE_HEADER_SIZE == schema::MtuProbe::SIZE);
+    if (size < MTU_PROBE_HEADER_SIZE)
+    {
+        return;
+    }
+
+    schema::Message<schema::MtuProbe> header;
+    header.Set<schema::MtuProbe::Size>(size)
+        .Set<schema::MtuProbe::ClientId>(uuid)
+        .Set<schema::MtuProbe::ProbeSize>(size);
+
+    // Never coalesced, the probe has to arrive at the exact size it tests
+    const std::span<const char> parts[] = { header.Bytes(), std::span<const char>(probe_padding).first(size - MTU_PROBE_HEADER_SIZE) };
+    SendNow(to, parts, size);
+}
+
+void Falcon::SendMtuProbeAck(const Endpoint& to, uint64_t uuid, std::span<const char> probe)
+{
+    const auto view = schema::View<schema::MtuProbe>::Of(probe);
+    if (!view)
+    {
+        return;
+    }
+    const uint16_t size = view->Get<schema::MtuProbe::ProbeSize>();
+    // Only a probe that arrived whole proves its size gets through
+    if (probe.size() != size)
+    {
+        return;
+    }
+
+    schema::Message<schema::MtuProbeAck> message;
+    message.Set<schema::MtuProbeAck::ClientId>(uuid)
+        .Set<schema::MtuProbeAck::ProbeSize>(size);
+    SendTo(to, message.Bytes());
+}
+
+int Falcon::TimeoutUntil(std::chrono::steady_clock::time_point deadline)
+{
+    const auto remaining = deadline - std::chrono::steady_clock::now();
+    if (remaining <= std::chrono::steady_clock::duration::zero())
+    {
+        return 0;
+    }
+    return static_cast<int>(std::chrono::ceil<std::chrono::milliseconds>(remaining).count());
+}
+
+void Falcon::EnableSendBatching()
+{
+    batching_socket = this;
+}
+
+void Falcon::DisableSendBatching()
+{
+    if (batching_socket == this)
+    {
+        batching_socket = nullptr;
+    }
+}
@@ -1,9 +1,17 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <poll.h>
+#include <fcntl.h>
+#include <cerrno>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
 
+#include <array>
 #include <memory>
 #include <fmt/core.h>
 #include "falcon.h"
@@ -33,58 +41,208 @@ std::string IpToString(const sockaddr* sa)
     return "";
 }
 
-sockaddr StringToIp(const std::string& ip, uint16_t port)
+static_assert(sizeof(sockaddr_storage) <= Endpoint::STORAGE_SIZE);
+
+// Path MTU probes have to be dropped when too large rather than fragmented, and sends are not capped to the kernel's own estimate
+static void SetDontFragment(int socket, int family)
+{
+    [[maybe_unused]] const int enable = 1;
+    if (family == AF_INET)
+    {
+#if defined(IP_MTU_DISCOVER) && defined(IP_PMTUDISC_PROBE)
+        const int mode = IP_PMTUDISC_PROBE;
+        setsockopt(socket, IPPROTO_IP, IP_MTU_DISCOVER, &mode, sizeof(mode));
+#elif defined(IP_DONTFRAG)
+        setsockopt(socket, IPPROTO_IP, IP_DONTFRAG, &enable, sizeof(enable));
+#endif
+    }
+    else if (family == AF_INET6)
+    {
+#if defined(IPV6_MTU_DISCOVER) && defined(IPV6_PMTUDISC_PROBE)
+        const int mode = IPV6_PMTUDISC_PROBE;
+        setsockopt(socket, IPPROTO_IPV6, IPV6_MTU_DISCOVER, &mode, sizeof(mode));
+#elif defined(IPV6_DONTFRAG)
+        setsockopt(socket, IPPROTO_IPV6, IPV6_DONTFRAG, &enable, sizeof(enable));
+#endif
+    }
+}
+
+Endpoint Endpoint::Resolve(const std::string& ip, uint16_t port)
 {
-    sockaddr result {};
-    int error = inet_pton(AF_INET, ip.c_str(), &result);
-    if (error == 1) {
-        result.sa_family = AF_INET;
+    Endpoint result;
+    auto* ipv4 = reinterpret_cast<sockaddr_in*>(result.Data());
+    if (inet_pton(AF_INET, ip.c_str(), &ipv4->sin_addr) == 1) {
+        ipv4->sin_family = AF_INET;
 #ifndef __linux__
-        result.sa_len = sizeof(sockaddr_in);
+        ipv4->sin_len = sizeof(sockaddr_in);
 #endif
-        reinterpret_cast<sockaddr_in*>(&result)->sin_port = htons(port);
+        ipv4->sin_port = htons(port);
+        result.SetSize(sizeof(sockaddr_in));
         return result;
     }
 
-    memset(&result, 0, sizeof(result));
-    error = inet_pton(AF_INET6, ip.c_str(), &result);
-    if (error == 1) {
-        result.sa_family = AF_INET6;
+    auto* ipv6 = reinterpret_cast<sockaddr_in6*>(result.Data());
+    memset(ipv6, 0, sizeof(sockaddr_in6));
+    if (inet_pton(AF_INET6, ip.c_str(), &ipv6->sin6_addr) == 1) {
+        ipv6->sin6_family = AF_INET6;
 #ifndef __linux__
-        result.sa_len = sizeof(sockaddr_in6);
+        ipv6->sin6_len = sizeof(sockaddr_in6);
 #endif
-        reinterpret_cast<sockaddr_in6*>(&result)->sin6_port = htons(port);
+        ipv6->sin6_port = htons(port);
+        result.SetSize(sizeof(sockaddr_in6));
         return result;
     }
-    memset(&result, 0, sizeof(result));
+    memset(ipv6, 0, sizeof(sockaddr_in6));
     return result;
 }
 
+std::string Endpoint::ToString() const
+{
+    if (!IsValid())
+    {
+        return "";
+    }
+    return IpToString(reinterpret_cast<const sockaddr*>(Data()));
+}
+
 Falcon::Falcon() {
 
 }
 
 Falcon::~Falcon() {
+    DisableSendBatching();
+    CloseReactor();
     if(m_socket > 0)
     {
         close(m_socket);
     }
 }
 
+void Falcon::CreateReactor()
+{
+    CloseReactor();
+#ifdef __linux__
+    m_reactor_fd = epoll_create1(EPOLL_CLOEXEC);
+    m_wakeup_read_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    m_wakeup_write_fd = m_wakeup_read_fd;
+
+    epoll_event socket_event{};
+    socket_event.events = EPOLLIN;
+    socket_event.data.fd = m_socket;
+    epoll_ctl(m_reactor_fd, EPOLL_CTL_ADD, m_socket, &socket_event);
+
+    epoll_event wakeup_event{};
+    wakeup_event.events = EPOLLIN;
+    wakeup_event.data.fd = m_wakeup_read_fd;
+    epoll_ctl(m_reactor_fd, EPOLL_CTL_ADD, m_wakeup_read_fd, &wakeup_event);
+#else
+    int fds[2];
+    if (pipe(fds) == 0)
+    {
+        fcntl(fds[0], F_SETFL, O_NONBLOCK);
+        fcntl(fds[1], F_SETFL, O_NONBLOCK);
+        m_wakeup_read_fd = fds[0];
+        m_wakeup_write_fd = fds[1];
+    }
+#endif
+}
+
+void Falcon::CloseReactor()
+{
+    if (m_wakeup_write_fd >= 0 && m_wakeup_write_fd != m_wakeup_read_fd)
+    {
+        close(m_wakeup_write_fd);
+    }
+    if (m_wakeup_read_fd >= 0)
+    {
+        close(m_wakeup_read_fd);
+    }
+    if (m_reactor_fd >= 0)
+    {
+        close(m_reactor_fd);
+    }
+    m_reactor_fd = -1;
+    m_wakeup_read_fd = -1;
+    m_wakeup_write_fd = -1;
+}
+
+void Falcon::Wakeup()
+{
+    if (m_wakeup_write_fd < 0)
+    {
+        return;
+    }
+#ifdef __linux__
+    const uint64_t signal = 1;
+#else
+    const char signal = 1;
+#endif
+    [[maybe_unused]] ssize_t written = write(m_wakeup_write_fd, &signal, sizeof(signal));
+}
+
+bool Falcon::WaitReadable(int timeout_ms)
+{
+    bool readable = false;
+    bool woken_up = false;
+#ifdef __linux__
+    if (m_reactor_fd >= 0)
+    {
+        std::array<epoll_event, 2> events;
+        const int count = epoll_wait(m_reactor_fd, events.data(), events.size(), timeout_ms);
+        for (int i = 0; i < count; i++)
+        {
+            readable |= events[i].data.fd == m_socket;
+            woken_up |= events[i].data.fd == m_wakeup_read_fd;
+        }
+    }
+    else
+#endif
+    {
+        std::array<pollfd, 2> fds{};
+        fds[0].fd = m_socket;
+        fds[0].events = POLLIN;
+        fds[1].fd = m_wakeup_read_fd;
+        fds[1].events = POLLIN;
+        const nfds_t count = m_wakeup_read_fd >= 0 ? 2 : 1;
+        if (poll(fds.data(), count, timeout_ms) > 0)
+        {
+            readable = fds[0].revents & POLLIN;
+            woken_up = fds[1].revents & POLLIN;
+        }
+    }
+
+    if (woken_up)
+    {
+        // Drain the signal so the next wait blocks again
+        std::array<char, 64> drain;
+        while (read(m_wakeup_read_fd, drain.data(), drain.size()) > 0);
+    }
+    return readable;
+}
+
 void Falcon::CreateServer(uint16_t port)
 {
 	if(m_socket > 0)
     {
         close(m_socket);
     }
-    sockaddr local_endpoint = StringToIp("0.0.0.0", port);
-    m_socket = socket(local_endpoint.sa_family,
+    const Endpoint local_endpoint = Endpoint::Resolve("0.0.0.0", port);
+    m_socket = socket(reinterpret_cast<const sockaddr*>(local_endpoint.Data())->sa_family,
         SOCK_DGRAM,
         IPPROTO_UDP);
-    if (int error = bind(m_socket, &local_endpoint, sizeof(local_endpoint)); error != 0)
+    SetDontFragment(m_socket, reinterpret_cast<const sockaddr*>(local_endpoint.Data())->sa_family);
+#ifdef SO_REUSEPORT
+    if (m_reuse_port)
+    {
+        const int enable = 1;
+        setsockopt(m_socket, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable));
+    }
+#endif
+    if (int error = bind(m_socket, reinterpret_cast<const sockaddr*>(local_endpoint.Data()), local_endpoint.Size()); error != 0)
     {
         close(m_socket);
     }
+    CreateReactor();
 }
 
 void Falcon::CreateClient(const std::string& serverIp)
@@ -93,28 +251,48 @@ void Falcon::CreateClient(const std::string& serverIp)
     {
         close(m_socket);
     }
-    sockaddr local_endpoint = StringToIp(serverIp, 0);
-    m_socket = socket(local_endpoint.sa_family,
+    // Bind to the wildcard address of the same family as the server, on an ephemeral port
+    const int family = reinterpret_cast<const sockaddr*>(Endpoint::Resolve(serverIp, 0).Data())->sa_family;
+    const Endpoint local_endpoint = Endpoint::Resolve(family == AF_INET6 ? "::" : "0.0.0.0", 0);
+    m_socket = socket(reinterpret_cast<const sockaddr*>(local_endpoint.Data())->sa_family,
         SOCK_DGRAM,
         IPPROTO_UDP);
-    if (int error = bind(m_socket, &local_endpoint, sizeof(local_endpoint)); error != 0)
+    SetDontFragment(m_socket, family);
+    if (int error = bind(m_socket, reinterpret_cast<const sockaddr*>(local_endpoint.Data()), local_endpoint.Size()); error != 0)
     {
         close(m_socket);
     }
+    CreateReactor();
 }
 
-int Falcon::SendToInternal(const std::string &to, uint16_t port, std::span<const char> message)
+int Falcon::SendToInternal(const Endpoint& to, std::span<const char> message)
 {
-    const sockaddr destination = StringToIp(to, port);
     int error = sendto(m_socket,
         message.data(),
         message.size(),
         0,
-        &destination,
-        sizeof(destination));
+        reinterpret_cast<const sockaddr*>(to.Data()),
+        to.Size());
     return error;
 }
 
+int Falcon::SendGatherInternal(const Endpoint& to, std::span<const std::span<const char>> parts)
+{
+    std::array<iovec, MAX_GATHER_PARTS> iovecs;
+    for (size_t i = 0; i < parts.size(); i++)
+    {
+        iovecs[i].iov_base = const_cast<char*>(parts[i].data());
+        iovecs[i].iov_len = parts[i].size();
+    }
+
+    msghdr header{};
+    header.msg_name = const_cast<std::byte*>(to.Data());
+    header.msg_namelen = to.Size();
+    header.msg_iov = iovecs.data();
+    header.msg_iovlen = parts.size();
+    return sendmsg(m_socket, &header, 0);
+}
+
 int Falcon::ReceiveFromInternal(std::string &from, std::span<char, 65535> message)
 {
     struct pollfd fds;
@@ -139,4 +317,115 @@ int Falcon::ReceiveFromInternal(std::string &from, std::span<char, 65535> messag
     from = IpToString(reinterpret_cast<const sockaddr*>(&peer_addr));
 
     return read_bytes;
-}
\ No newline at end of file
+}
+
+int Falcon::SendBatchInternal(std::span<const QueuedDatagram> datagrams)
+{
+    size_t sent = 0;
+#ifdef __linux__
+    std::array<mmsghdr, MAX_BATCH_SIZE> headers{};
+    std::array<iovec, MAX_BATCH_SIZE> iovecs;
+    for (size_t i = 0; i < datagrams.size(); i++)
+    {
+        iovecs[i].iov_base = const_cast<char*>(datagrams[i].data.data());
+        iovecs[i].iov_len = datagrams[i].data.size();
+        headers[i].msg_hdr.msg_iov = &iovecs[i];
+        headers[i].msg_hdr.msg_iovlen = 1;
+        headers[i].msg_hdr.msg_name = const_cast<std::byte*>(datagrams[i].to.Data());
+        headers[i].msg_hdr.msg_namelen = datagrams[i].to.Size();
+    }
+
+    while (sent < datagrams.size())
+    {
+        const int count = sendmmsg(m_socket, &headers[sent], datagrams.size() - sent, 0);
+        if (count <= 0)
+        {
+            if (count < 0 && errno == ENOSYS)
+            {
+                break;  // No sendmmsg on this kernel, fall back to one sendto per datagram
+            }
+            if (count < 0 && errno == EMSGSIZE)
+            {
+                sent++;  // A path MTU probe larger than the interface allows, the rest of the batch still goes out
+                continue;
+            }
+            return static_cast<int>(sent);
+        }
+        sent += count;
+    }
+#endif
+
+    for (; sent < datagrams.size(); sent++)
+    {
+        if (sendto(m_socket,
+            datagrams[sent].data.data(),
+            datagrams[sent].data.size(),
+            0,
+            reinterpret_cast<const sockaddr*>(datagrams[sent].to.Data()),
+            datagrams[sent].to.Size()) < 0 && errno != EMSGSIZE)
+        {
+            break;
+        }
+    }
+    return static_cast<int>(sent);
+}
+
+int Falcon::ReceiveBatchInternal(std::span<Datagram> datagrams, int timeout_ms)
+{
+    if (datagrams.empty())
+    {
+        return 0;
+    }
+
+    if (!WaitReadable(timeout_ms))
+    {
+        return 0;  // Timeout or wakeup
+    }
+
+#ifdef __linux__
+    std::array<mmsghdr, MAX_BATCH_SIZE> headers{};
+    std::array<iovec, MAX_BATCH_SIZE> iovecs;
+    for (size_t i = 0; i < datagrams.size(); i++)
+    {
+        iovecs[i].iov_base = datagrams[i].buffer.data();
+        iovecs[i].iov_len = datagrams[i].buffer.size_bytes();
+        headers[i].msg_hdr.msg_iov = &iovecs[i];
+        headers[i].msg_hdr.msg_iovlen = 1;
+        headers[i].msg_hdr.msg_name = datagrams[i].from.Data();
+        headers[i].msg_hdr.msg_namelen = Endpoint::STORAGE_SIZE;
+    }
+
+    const int received = recvmmsg(m_socket, headers.data(), datagrams.size(), MSG_DONTWAIT, nullptr);
+    if (received >= 0 || errno != ENOSYS)
+    {
+        for (int i = 0; i < received; i++)
+        {
+            datagrams[i].from.SetSize(headers[i].msg_hdr.msg_namelen);
+            datagrams[i].size = static_cast<int>(headers[i].msg_len);
+        }
+        return received < 0 ? 0 : received;
+    }
+#endif
+
+    // Single-datagram path: drain the socket one recvfrom at a time
+    int count = 0;
+    while (count < static_cast<int>(datagrams.size()))
+    {
+        socklen_t peer_addr_len = Endpoint::STORAGE_SIZE;
+        const int read_bytes = recvfrom(m_socket,
+            datagrams[count].buffer.data(),
+            datagrams[count].buffer.size_bytes(),
+            MSG_DONTWAIT,
+            reinterpret_cast<sockaddr*>(datagrams[count].from.Data()),
+            &peer_addr_len);
+        if (read_bytes < 0)
+        {
+            break;
+        }
+
+        datagrams[count].from.SetSize(peer_addr_len);
+        datagrams[count].size = read_bytes;
+        count++;
+    }
+    return count;
+}
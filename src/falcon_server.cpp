@@ -1,16 +1,26 @@
 #include "falcon_server.h"
 #include "falcon_client.h"
-#include "message_type.h"
+#include "message_schema.h"
 #include <array>
+#include <algorithm>
+#include <utility>
 #include "spdlog/spdlog.h"
 using namespace std::chrono_literals;
 
-constexpr std::chrono::microseconds TIMEOUT = 1000ms;
-constexpr std::chrono::microseconds ACK_CHECK = 500ms;
+FalconServer::FalconServer(FalconServer& owner, uint32_t shard_index) :
+	m_connections(static_cast<uint64_t>(shard_index) << SHARD_SHIFT),
+	m_owner(&owner),
+	m_shard_index(shard_index)
+{
+}
 
 FalconServer::~FalconServer()
 {
+	// Shards call back into their owner, so they stop first
+	m_shards.clear();
+
 	m_listen = false;
+	Wakeup();
 	if(m_listener.joinable())
 	{
 		m_listener.join();
@@ -19,9 +29,123 @@ FalconServer::~FalconServer()
 
 void FalconServer::Listen(uint16_t port)
 {
+	Listen(port, 1);
+}
+
+void FalconServer::Listen(uint16_t port, uint32_t shard_count)
+{
+#ifndef __linux__
+	shard_count = 1;
+#endif
+	shard_count = std::clamp(shard_count, 1u, MAX_SHARDS);
+
+	// Every socket of the group is bound before any listener starts, so the kernel does not rebalance clients afterwards
+	m_reuse_port = shard_count > 1;
 	Falcon::CreateServer(port);
+	for (uint32_t shard_index = 1; shard_index < shard_count; shard_index++)
+	{
+		std::unique_ptr<FalconServer> shard(new FalconServer(*this, shard_index));
+		shard->m_reuse_port = true;
+		shard->m_connection_settings = m_connection_settings;
+		shard->SimulateNetworkConditions(GetNetworkConditions());
+		shard->SetCoalescingWindow(GetCoalescingWindow());
+		shard->CreateServer(port);
+		m_shards.push_back(std::move(shard));
+	}
+
 	m_listen = true;
 	m_listener = std::thread(ThreadListen, std::ref(*this));
+	for (std::unique_ptr<FalconServer>& shard : m_shards)
+	{
+		shard->m_listen = true;
+		shard->m_listener = std::thread(ThreadListen, std::ref(*shard));
+	}
+}
+
+FalconServer& FalconServer::Shard(uint64_t client_id)
+{
+	return const_cast<FalconServer&>(std::as_const(*this).Shard(client_id));
+}
+
+const FalconServer& FalconServer::Shard(uint64_t client_id) const
+{
+	const uint64_t shard_index = client_id >> SHARD_SHIFT;
+	if (shard_index == 0 || shard_index > m_shards.size())
+	{
+		return *this;
+	}
+	return *m_shards[shard_index - 1];
+}
+
+std::chrono::microseconds FalconServer::GetRtt(uint64_t client_id) const
+{
+	const FalconServer& shard = Shard(client_id);
+	std::lock_guard lock(shard.m_connections_mutex);
+	const ClientConnection* connection = shard.m_connections.Find(client_id);
+	return connection ? connection->rtt.GetRtt() : std::chrono::microseconds::zero();
+}
+
+std::chrono::microseconds FalconServer::GetRto(uint64_t client_id) const
+{
+	const FalconServer& shard = Shard(client_id);
+	std::lock_guard lock(shard.m_connections_mutex);
+	const ClientConnection* connection = shard.m_connections.Find(client_id);
+	return connection ? connection->rtt.GetRto() : std::chrono::microseconds::zero();
+}
+
+uint16_t FalconServer::GetMaxDatagramSize(uint64_t client_id) const
+{
+	const FalconServer& shard = Shard(client_id);
+	std::lock_guard lock(shard.m_connections_mutex);
+	const ClientConnection* connection = shard.m_connections.Find(client_id);
+	return connection ? connection->path_mtu->GetMaxDatagramSize() : 0;
+}
+
+std::shared_ptr<Stream> FalconServer::GetStream(uint64_t client_id, uint32_t stream_id) const
+{
+	const FalconServer& shard = Shard(client_id);
+	std::lock_guard lock(shard.m_connections_mutex);
+	const ClientConnection* connection = shard.m_connections.Find(client_id);
+	if (!connection)
+	{
+		return nullptr;
+	}
+	const auto it = std::find(connection->stream_ids.begin(), connection->stream_ids.end(), stream_id);
+	return it != connection->stream_ids.end() ? connection->streams[it - connection->stream_ids.begin()] : nullptr;
+}
+
+size_t FalconServer::GetStreamCount(uint64_t client_id) const
+{
+	const FalconServer& shard = Shard(client_id);
+	std::lock_guard lock(shard.m_connections_mutex);
+	const ClientConnection* connection = shard.m_connections.Find(client_id);
+	return connection ? connection->streams.size() : 0;
+}
+
+size_t FalconServer::GetStreamsAwaitingAck(uint64_t client_id) const
+{
+	const FalconServer& shard = Shard(client_id);
+	std::lock_guard lock(shard.m_connections_mutex);
+	const ClientConnection* connection = shard.m_connections.Find(client_id);
+	return connection ? connection->streams_ack.size() : 0;
+}
+
+FalconServer::ClientConnection::ClientConnection() = default;
+
+Stream* FalconServer::ClientConnection::FindStream(uint32_t stream_id) const
+{
+	const auto it = std::find(stream_ids.begin(), stream_ids.end(), stream_id);
+	return it != stream_ids.end() ? streams[it - stream_ids.begin()].get() : nullptr;
+}
+
+uint32_t FalconServer::GetActiveClientCount() const
+{
+	uint32_t count = m_active_client_count;
+	for (const std::unique_ptr<FalconServer>& shard : m_shards)
+	{
+		count += shard->m_active_client_count;
+	}
+	return count;
 }
 
 void FalconServer::OnClientConnected(std::function<void(uint64_t)> handler)
@@ -42,9 +166,9 @@ void FalconServer::OnClientDisconnected(std::function<void(uint64_t)> handler)
 	}
 }
 
-uint32_t FalconServer::GetNewStreamID(bool reliable, uint64_t client)
+uint32_t FalconServer::GetNewStreamID(bool reliable)
 {
-	uint32_t id = m_lastUsedStreamID[client]++;
+	uint32_t id = m_lastUsedStreamID++;
 
 	if (reliable)
 		id = id | RELIABLE_STREAM_BIT;
@@ -54,216 +178,630 @@ uint32_t FalconServer::GetNewStreamID(bool reliable, uint64_t client)
 	return id;
 }
 
+void FalconServer::SetConnectionSettings(const ConnectionSettings& settings)
+{
+	Falcon::SetConnectionSettings(settings);
+	for (std::unique_ptr<FalconServer>& shard : m_shards)
+	{
+		shard->SetConnectionSettings(settings);
+	}
+}
+
+void FalconServer::SetConnectionSettings(uint64_t client_id, const ConnectionSettings& settings)
+{
+	FalconServer& shard = Shard(client_id);
+	{
+		std::lock_guard lock(shard.m_requests_mutex);
+		shard.m_settings_requests.push_back({ client_id, settings });
+	}
+	// The connection belongs to the listener thread, which applies the change
+	shard.Wakeup();
+}
+
+void FalconServer::ApplyConnectionSettings(uint64_t client_id, const ConnectionSettings& settings)
+{
+	if (ClientConnection* connection = m_connections.Find(client_id))
+	{
+		std::lock_guard lock(m_connections_mutex);
+		connection->settings = settings;
+		connection->rtt.SetBounds(settings.min_resend_interval, settings.max_resend_interval);
+		connection->scheduler.SetBudget(settings.send_budget, settings.send_burst);
+		m_timers.Reschedule(connection->timeout, std::chrono::steady_clock::now() + settings.timeout);
+	}
+}
+
+void FalconServer::OnClientTimeout(uint64_t client_id)
+{
+	spdlog::debug("Client {} removed because of inactivity", client_id);
+	RemoveClient(client_id);
+}
+
+void FalconServer::RemoveClient(uint64_t client_id)
+{
+	ClientConnection* connection = m_connections.Find(client_id);
+	if (!connection)
+	{
+		return;
+	}
+	m_timers.Cancel(connection->timeout);
+	m_timers.Cancel(connection->resend);
+	m_timers.Cancel(connection->transmit);
+	m_timers.Cancel(connection->probe);
+	m_timers.Cancel(connection->ping);
+	m_timers.Cancel(connection->release);
+	{
+		// Its streams go with it
+		std::lock_guard lock(m_connections_mutex);
+		m_connections.Erase(client_id);
+	}
+
+	m_last_disconnected_client = client_id;
+	OnClientDisconnected(Owner().m_on_client_disconnect);
+}
+
+void FalconServer::ArmResend(uint64_t client_id)
+{
+	ClientConnection* connection = m_connections.Find(client_id);
+	if (connection && !m_timers.IsScheduled(connection->resend))
+	{
+		connection->resend = m_timers.Schedule(std::chrono::steady_clock::now() + connection->rtt.GetRto(),
+			[this, client_id]() { ResendUnacknowledged(client_id); });
+	}
+}
+
+void FalconServer::ResendUnacknowledged(uint64_t client_id)
+{
+	ClientConnection* connection = m_connections.Find(client_id);
+	if (!connection || connection->streams_ack.empty())
+	{
+		return;
+	}
+	const std::chrono::microseconds rto = connection->rtt.GetRto();
+	size_t resent = 0;
+	{
+		std::lock_guard lock(m_connections_mutex);
+		std::erase_if(connection->streams_ack, [&](uint32_t stream_id) {
+			Stream* stream = connection->FindStream(stream_id);
+			if (!stream)
+			{
+				return true;
+			}
+			resent += stream->ResendUnacknowledged(rto);
+			return stream->GetUnacknowledgedCount() == 0;
+		});
+		if (resent > 0)
+		{
+			connection->rtt.Backoff();
+		}
+	}
+	if (resent > 0 && connection->congestion)
+	{
+		connection->congestion->OnRetransmissionTimeout(std::chrono::steady_clock::now());
+		TransmitPending(client_id);
+	}
+	if (!connection->streams_ack.empty())
+	{
+		m_timers.Reschedule(connection->resend, std::chrono::steady_clock::now() + connection->rtt.GetRto());
+	}
+}
+
+void FalconServer::TransmitPending(uint64_t client_id)
+{
+	ClientConnection* connection = m_connections.Find(client_id);
+	if (!connection || !connection->congestion)
+	{
+		return;
+	}
+
+	const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	std::chrono::steady_clock::time_point next_send = std::chrono::steady_clock::time_point::max();
+	for (uint32_t stream_id : connection->streams_ack)
+	{
+		if (Stream* stream = connection->FindStream(stream_id))
+		{
+			next_send = std::min(next_send, stream->Transmit(now));
+		}
+	}
+
+	// Come back when the pacer lets the next part out, acknowledgements take care of a full window
+	if (next_send != std::chrono::steady_clock::time_point::max() && !m_timers.Reschedule(connection->transmit, next_send))
+	{
+		connection->transmit = m_timers.Schedule(next_send, [this, client_id]() { TransmitPending(client_id); });
+	}
+}
+
+void FalconServer::AddRttSample(uint64_t client_id, std::chrono::steady_clock::duration rtt)
+{
+	ClientConnection* connection = m_connections.Find(client_id);
+	if (!connection)
+	{
+		return;
+	}
+	{
+		std::lock_guard lock(m_connections_mutex);
+		connection->rtt.AddSample(std::chrono::duration_cast<std::chrono::microseconds>(rtt));
+	}
+	if (connection->congestion)
+	{
+		connection->congestion->SetSmoothedRtt(connection->rtt.GetRtt());
+	}
+}
+
+void FalconServer::ProbePathMtu(uint64_t client_id)
+{
+	ClientConnection* connection = m_connections.Find(client_id);
+	if (!connection)
+	{
+		return;
+	}
+	const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	if (const uint16_t probe_size = connection->path_mtu->OnProbeTimer(now); probe_size > 0)
+	{
+		SendMtuProbe(connection->endpoint, client_id, probe_size);
+		// Still unacknowledged after a retransmission timeout, the probe counts as lost
+		m_timers.Reschedule(connection->probe, now + connection->rtt.GetRto());
+	}
+	else if (connection->path_mtu->GetRaiseTime() != std::chrono::steady_clock::time_point::max())
+	{
+		m_timers.Reschedule(connection->probe, connection->path_mtu->GetRaiseTime());
+	}
+}
+
+void FalconServer::OnKeepaliveTimer(uint64_t client_id)
+{
+	ClientConnection* connection = m_connections.Find(client_id);
+	if (!connection)
+	{
+		return;
+	}
+	// Pings do not count as traffic, only what the client may be waiting for does
+	if (connection->keepalive->IsIdle())
+	{
+		schema::Message<schema::Ping> ping_msg;
+		ping_msg.Set<schema::Ping::ClientId>(client_id)
+			.Set<schema::Ping::PingId>(connection->ping_id)
+			.Set<schema::Ping::Time>(std::chrono::steady_clock::now());
+		SendTo(connection->endpoint, ping_msg.Bytes());
+		connection->ping_id++;
+	}
+	m_timers.Reschedule(connection->ping, std::chrono::steady_clock::now() + connection->settings.GetPingInterval());
+}
+
 void FalconServer::ThreadListen(FalconServer& server)
 {
-	std::unordered_map<uint64_t, std::chrono::steady_clock::time_point> client_timeout;
-	std::chrono::steady_clock::time_point ack_check = std::chrono::steady_clock::now();
+	int wait_ms = -1;
+
+	server.EnableSendBatching();
 	while (server.m_listen)
 	{
-		std::array<char, 65535> buffer;
-		std::string other_ip;
-		int recv_size = server.ReceiveFrom(other_ip, buffer);
-		if (recv_size > 0)
+		for (const Datagram& datagram : server.ReceiveBatch(wait_ms))
 		{
+			const Endpoint& other_endpoint = datagram.from;
+			const std::span<const char> buffer = datagram.buffer.first(datagram.size);
+			if (buffer.empty())
+			{
+				continue;
+			}
+
 			uint64_t client_id = 0;
+			// Every message but CONNECT names its client, found with one indexed access to the session table
+			ClientConnection* connection = nullptr;
 			if (MessageType(buffer[0]) != CONNECT)
 			{
-				memcpy(&client_id, &buffer[3], sizeof(client_id));
-				if(client_timeout.contains(client_id))
+				if (!wire::ReadClientId(buffer, client_id))
 				{
-					client_timeout.at(client_id) = std::chrono::steady_clock::now();
+					continue;
 				}
+				connection = server.m_connections.Find(client_id);
+				if (!connection)
+				{
+					continue;
+				}
+				server.m_timers.Reschedule(connection->timeout, std::chrono::steady_clock::now() + connection->settings.timeout);
 			}
 
 			switch (MessageType(buffer[0]))
 			{
 			case CONNECT:
 			{
-				std::string ip = other_ip;
-				uint16_t port = 0;
-				auto pos = other_ip.find_last_of(':');
-				if (pos != std::string::npos)
+				ClientConnection added;
+				added.endpoint = other_endpoint;
+				added.settings = server.m_connection_settings;
+				added.rtt = RttEstimator(added.settings.resend_interval, added.settings.min_resend_interval,
+					added.settings.max_resend_interval);
+				if (added.settings.congestion_controller)
 				{
-					ip = other_ip.substr(0, pos);
-					std::string port_str = other_ip.substr(++pos);
-					port = atoi(port_str.c_str());
-				}				
-
-				server.m_new_client = server.usable_id++;
-
-				spdlog::debug("New client " + std::to_string(server.m_new_client));
-
-				client_timeout.insert({ server.m_new_client, std::chrono::steady_clock::now() });
-
-				server.m_clients.insert({ server.m_new_client , {ip, port} });
-
-				std::string ack_message;
-				const uint16_t msg_size = 12;
-				ack_message.resize(msg_size);
+					added.congestion = added.settings.congestion_controller();
+				}
+				added.reassembler = std::make_shared<Reassembler>(added.settings.max_reassembly_bytes,
+					added.settings.reassembly_timeout);
+				added.path_mtu = std::make_shared<PathMtuDiscovery>(added.settings.min_datagram_size,
+					added.settings.max_datagram_size, added.settings.mtu_raise_interval);
+				added.keepalive = std::make_shared<Keepalive>();
+				added.scheduler.SetBudget(added.settings.send_budget, added.settings.send_burst);
+				// Clients before the version byte was sent use the fixed layout, the others the newest both sides know
+				added.wire_version = wire::VERSION_FIXED;
+				if (const auto connect = schema::View<schema::Connect>::Of(buffer))
+				{
+					added.wire_version = std::clamp(connect->Get<schema::Connect::Version>(), wire::VERSION_FIXED, server.m_version);
+				}
+				{
+					std::lock_guard lock(server.m_connections_mutex);
+					server.m_new_client = server.m_connections.Insert(std::move(added));
+				}
 
-				ack_message[0] = CONNECT_ACK;
-				memcpy(&ack_message[1], &msg_size, sizeof(msg_size));
-				memcpy(&ack_message[3], &server.m_new_client, sizeof(server.m_new_client));
-				memcpy(&ack_message[11], &server.m_version, sizeof(server.m_version));
+				if (spdlog::should_log(spdlog::level::debug))
+				{
+					spdlog::debug("New client {} from {}", server.m_new_client, other_endpoint.ToString());
+				}
 
-				server.SendTo(server.m_clients.at(server.m_new_client).ip, server.m_clients.at(server.m_new_client).port, ack_message);
-				server.OnClientConnected(server.m_on_client_connect);
+				connection = server.m_connections.Find(server.m_new_client);
+				connection->timeout = server.m_timers.Schedule(std::chrono::steady_clock::now() + connection->settings.timeout,
+					[&server, client_id = server.m_new_client]() { server.OnClientTimeout(client_id); });
+				connection->probe = server.m_timers.Schedule(std::chrono::steady_clock::now(),
+					[&server, client_id = server.m_new_client]() { server.ProbePathMtu(client_id); });
+				connection->ping = server.m_timers.Schedule(std::chrono::steady_clock::now() + connection->settings.GetPingInterval(),
+					[&server, client_id = server.m_new_client]() { server.OnKeepaliveTimer(client_id); });
+
+				schema::Message<schema::ConnectAck> ack_message;
+				ack_message.Set<schema::ConnectAck::ClientId>(server.m_new_client)
+					.Set<schema::ConnectAck::Version>(server.m_version);
+				server.SendTo(other_endpoint, ack_message.Bytes());
+				server.OnClientConnected(server.Owner().m_on_client_connect);
 				
 			}
 				break;
 			case DISCONNECT:
-				server.m_last_disconnected_client = client_id;
-				spdlog::debug("Disconnection from " + std::to_string(server.m_last_disconnected_client));
-				server.OnClientDisconnected(server.m_on_client_disconnect);
+				spdlog::debug("Disconnection from {}", client_id);
+				server.RemoveClient(client_id);
 				break;
 			case PING:
 			{
-				spdlog::debug("Ping received from " + std::to_string(client_id));
+				spdlog::debug("Ping received from {}", client_id);
 
-				std::string pong_msg;
-				const uint16_t msg_size = 13 + sizeof(std::chrono::system_clock::time_point);
-				pong_msg.resize(msg_size);
-
-				pong_msg[0] = PONG;
-				memcpy(&pong_msg[1], &msg_size, sizeof(msg_size));
-				memcpy(&pong_msg[3], &client_id, sizeof(client_id));
-				memcpy(&pong_msg[11], &buffer[11], sizeof(uint16_t));
-				
-				memcpy(&pong_msg[13], &buffer[13], sizeof(std::chrono::system_clock::time_point));
-				server.SendTo(server.m_clients.at(client_id).ip, server.m_clients.at(client_id).port, pong_msg);
+				const auto ping = schema::View<schema::Ping>::Of(buffer);
+				if (!ping)
+				{
+					break;
+				}
+				schema::Message<schema::Pong> pong;
+				pong.Set<schema::Pong::ClientId>(client_id)
+					.Set<schema::Pong::PingId>(ping->Get<schema::Ping::PingId>())
+					.Set<schema::Pong::Time>(ping->Get<schema::Ping::Time>());
+				server.SendTo(connection->endpoint, pong.Bytes());
+				connection->keepalive->OnSent();
+				server.m_timers.Reschedule(connection->ping, std::chrono::steady_clock::now() + connection->settings.GetPingInterval());
 			}
 				break;
-			case CLOSE_STREAM:
+			case PONG:
 			{
-				uint32_t stream_id;
-				memcpy(&stream_id, &buffer[11], sizeof(stream_id));
-
-				for (size_t i = 0; i < server.m_local_streams.at(client_id).size(); i++)
+				if (const auto pong = schema::View<schema::Pong>::Of(buffer))
+				{
+					server.AddRttSample(client_id, std::chrono::steady_clock::now() - pong->Get<schema::Pong::Time>());
+				}
+			}
+				break;
+			case MTU_PROBE:
+				server.SendMtuProbeAck(connection->endpoint, client_id, buffer);
+				break;
+			case MTU_PROBE_ACK:
+				if (const auto probe_ack = schema::View<schema::MtuProbeAck>::Of(buffer))
 				{
-					if (server.m_local_streams.at(client_id)[i]->GetStreamID() == stream_id)
+					const uint16_t probe_size = probe_ack->Get<schema::MtuProbeAck::ProbeSize>();
+					const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+					// The probe got through, go on with the next size right away
+					if (connection->path_mtu->OnProbeAcked(probe_size, now))
 					{
-						server.m_local_streams.at(client_id).erase(server.m_local_streams.at(client_id).begin() + i);
-						break;
+						server.m_timers.Reschedule(connection->probe, now);
 					}
 				}
-
-				server.m_streams.at(client_id).erase(stream_id);
-				if (server.m_streams.at(client_id).size() == 0)
+				break;
+			case CLOSE_STREAM:
+			{
+				if (const auto close = schema::View<schema::CloseStream>::Of(buffer))
 				{
-					server.m_streams.erase(client_id);
+					server.ForgetStream(client_id, close->Get<schema::CloseStream::StreamId>());
 				}
 			}
 				break;
 			case DATA:
+			case DATA_COMPACT:
 			{
 				uint32_t stream_id;
-				memcpy(&stream_id, &buffer[11], sizeof(stream_id));
-				if (!server.m_streams[client_id].contains(stream_id))
+				if (!wire::ReadStreamId(buffer, stream_id))
 				{
-					server.m_local_streams[client_id].push_back(server.MakeStream(stream_id, client_id, stream_id));
+					break;
 				}
-				server.m_streams.at(client_id).at(stream_id)->OnDataReceived(buffer);
+				Stream* stream = connection->FindStream(stream_id);
+				if (!stream)
+				{
+					stream = server.RegisterStream(client_id, server.MakeStream(stream_id, client_id));
+				}
+				stream->OnDataReceived(buffer);
 			}
+				break;
 			case DATA_ACK:
-				if (server.m_streams_ack.contains(client_id))
+			case DATA_ACK_COMPACT:
+				if (!connection->streams_ack.empty())
 				{
 					uint32_t stream_id;
-					memcpy(&stream_id, &buffer[11], sizeof(stream_id));
-					if (server.m_streams_ack.at(client_id).contains(stream_id))
+					if (!wire::ReadStreamId(buffer, stream_id))
 					{
-						server.m_streams_ack.at(client_id).erase(stream_id);
+						break;
 					}
-					if (server.m_streams_ack.at(client_id).size() == 0)
+					if (Stream* stream = connection->FindStream(stream_id))
 					{
-						server.m_streams_ack.erase(client_id);
+						if (const auto rtt = stream->OnAckReceived(buffer))
+						{
+							server.AddRttSample(client_id, *rtt);
+						}
+						// The acknowledgement opened the window
+						server.TransmitPending(client_id);
+						if (stream->GetUnacknowledgedCount() == 0)
+						{
+							std::lock_guard lock(server.m_connections_mutex);
+							std::erase(connection->streams_ack, stream_id);
+						}
 					}
 				}
 				break;
-			}
-		}
-		if (duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - ack_check) > ACK_CHECK)
-		{
-			for (auto& pair : server.m_streams_ack)
+			case SNAPSHOT_ACK:
 			{
-				for (auto& stream_pair : pair.second)
+				uint32_t stream_id;
+				if (!wire::ReadStreamId(buffer, stream_id))
 				{
-					server.m_streams.at(pair.first).at(stream_pair.first)->SendData(stream_pair.second);
+					break;
+				}
+				if (Stream* stream = connection->FindStream(stream_id))
+				{
+					stream->OnSnapshotAckReceived(buffer);
 				}
-				
 			}
-			ack_check = std::chrono::steady_clock::now();
+				break;
+			// CONNECT_ACK is for clients, streams open with their first DATA, and BATCH datagrams are unpacked before they get here
+			case CONNECT_ACK:
+			case CREATE_STREAM:
+			case BATCH:
+				break;
+			}
 		}
 
-		std::vector<uint64_t> disconnected_client;
-		disconnected_client.reserve(client_timeout.size());
-		for (const auto& pair : client_timeout)
 		{
-			if (duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - pair.second) > TIMEOUT)
-			{
-				server.m_last_disconnected_client = pair.first;
-				disconnected_client.push_back(pair.first);
+			std::lock_guard lock(server.m_requests_mutex);
+			std::swap(server.m_settings_requests, server.m_settings_requests_drained);
+		}
+		for (const auto& [client_id, settings] : server.m_settings_requests_drained)
+		{
+			server.ApplyConnectionSettings(client_id, settings);
+		}
+		server.m_settings_requests_drained.clear();
+		server.ProcessCommands();
 
-				spdlog::debug("Client " + std::to_string(pair.first)+  " removed because of inactivity");
+		server.m_timers.Advance(std::chrono::steady_clock::now());
+		server.FlushCoalesced(std::chrono::steady_clock::now());
 
-				server.OnClientDisconnected(server.m_on_client_disconnect);
-			}
+		server.FlushSendQueue();
+
+		// Sleep until the next timer is due
+		const std::chrono::steady_clock::time_point next_deadline = std::min(server.m_timers.NextDeadline(), server.NextCoalescingDeadline());
+		wait_ms = next_deadline == std::chrono::steady_clock::time_point::max() ? -1 : Falcon::TimeoutUntil(next_deadline);
+	}
+}
+
+bool FalconServer::SendData(std::span<const char> data, uint64_t client_id, uint32_t stream_id)
+{
+	StreamCommand command;
+	command.type = StreamCommand::Type::Send;
+	command.client_id = client_id;
+	command.stream_id = stream_id;
+	command.SetData(data);
+	return Shard(client_id).SubmitCommand(std::move(command));
+}
+
+bool FalconServer::SubmitCommand(StreamCommand&& command)
+{
+	if (!m_commands.TryPush(std::move(command)))
+	{
+		return false;
+	}
+	// One wakeup until the listener drains the queue
+	if (!m_commands_signaled.exchange(true))
+	{
+		Wakeup();
+	}
+	return true;
+}
+
+void FalconServer::ProcessCommands()
+{
+	// Cleared first, a command pushed while draining wakes the listener up again
+	m_commands_signaled = false;
+	StreamCommand command;
+	while (m_commands.TryPop(command))
+	{
+		const uint64_t client_id = command.client_id;
+		ClientConnection* connection = m_connections.Find(client_id);
+		if (!connection)
+		{
+			continue;
 		}
-		for (auto& id : disconnected_client)
+		switch (command.type)
+		{
+		case StreamCommand::Type::Open:
+			RegisterStream(client_id, std::move(command.stream));
+			break;
+		case StreamCommand::Type::Send:
+			if (const Stream* stream = connection->FindStream(command.stream_id))
+			{
+				connection->scheduler.Enqueue(command.stream_id, stream->GetPriority(), stream->GetWeight(), stream->IsReliable(), command.GetData());
+				if (std::find(m_scheduled_clients.begin(), m_scheduled_clients.end(), client_id) == m_scheduled_clients.end())
+				{
+					m_scheduled_clients.push_back(client_id);
+				}
+			}
+			break;
+		case StreamCommand::Type::Close:
 		{
-			client_timeout.erase(id);
+			schema::Message<schema::CloseStream> message;
+			message.Set<schema::CloseStream::ClientId>(client_id)
+				.Set<schema::CloseStream::StreamId>(command.stream_id);
+			SendTo(connection->endpoint, message.Bytes());
+			ForgetStream(client_id, command.stream_id);
+		}
+			break;
 		}
 	}
+
+	for (uint64_t client_id : m_scheduled_clients)
+	{
+		ReleaseScheduled(client_id);
+	}
+	m_scheduled_clients.clear();
 }
 
-void FalconServer::SendData(std::span<const char> data, uint64_t client_id, uint32_t stream_id)
+void FalconServer::ReleaseScheduled(uint64_t client_id)
 {
-	if (m_streams.at(client_id).at(stream_id))
+	ClientConnection* connection = m_connections.Find(client_id);
+	if (!connection)
 	{
-		m_streams.at(client_id).at(stream_id)->SendData(data);
-		if (stream_id & 1 << 31)
+		return;
+	}
+
+	const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	bool reliable_sent = false;
+	uint32_t stream_id;
+	while (connection->scheduler.Pop(now, stream_id, m_released_message))
+	{
+		Stream* stream = connection->FindStream(stream_id);
+		if (!stream)
+		{
+			continue;
+		}
+		stream->SendData(m_released_message);
+		if (stream->IsReliable())
 		{
-			m_streams_ack[client_id].insert({ stream_id, data });
+			if (std::find(connection->streams_ack.begin(), connection->streams_ack.end(), stream_id) == connection->streams_ack.end())
+			{
+				std::lock_guard lock(m_connections_mutex);
+				connection->streams_ack.push_back(stream_id);
+			}
+			reliable_sent = true;
 		}
 	}
+	if (reliable_sent)
+	{
+		ArmResend(client_id);
+		TransmitPending(client_id);
+	}
+
+	const std::chrono::steady_clock::time_point next_release = connection->scheduler.GetNextReleaseTime();
+	if (next_release != std::chrono::steady_clock::time_point::max() && !m_timers.Reschedule(connection->release, next_release))
+	{
+		connection->release = m_timers.Schedule(next_release, [this, client_id]() { ReleaseScheduled(client_id); });
+	}
 }
 
-std::unique_ptr<Stream> FalconServer::MakeStream(uint32_t stream_id, uint64_t client, bool reliable)
+std::shared_ptr<Stream> FalconServer::MakeStream(uint32_t stream_id, uint64_t client)
 {
-	std::unique_ptr<Stream> stream = std::make_unique<Stream>(
+	std::lock_guard lock(m_connections_mutex);
+	const ClientConnection* connection = m_connections.Find(client);
+	if (!connection)
+	{
+		return nullptr;
+	}
+	return std::make_shared<Stream>(
 		stream_id,
 		client,
-		m_clients.at(client),
+		connection->endpoint,
 		this
 	);
-	m_streams[client].insert({ stream_id, stream.get() });
-	return stream;
 }
 
-std::unique_ptr<Stream> FalconServer::CreateStream(uint64_t client, bool reliable) {
-	if(m_clients.contains(client))
+Stream* FalconServer::RegisterStream(uint64_t client, std::shared_ptr<Stream> stream)
+{
+	// The client may have left since the stream was created
+	ClientConnection* connection = m_connections.Find(client);
+	if (!connection)
+	{
+		return nullptr;
+	}
+	if (Stream* registered = connection->FindStream(stream->GetStreamID()))
 	{
-		return MakeStream(GetNewStreamID(reliable, client), client, reliable);
+		return registered;
 	}
-	return nullptr;
+	stream->SetReassembler(connection->reassembler);
+	stream->SetPathMtu(connection->path_mtu);
+	stream->SetKeepalive(connection->keepalive);
+	stream->SetWireVersion(connection->wire_version);
+	stream->SetCompressionDictionaries(connection->settings.compression_dictionaries);
+	if (stream->IsReliable())
+	{
+		stream->SetCongestionController(connection->congestion);
+	}
+
+	std::lock_guard lock(m_connections_mutex);
+	connection->stream_ids.push_back(stream->GetStreamID());
+	connection->streams.push_back(std::move(stream));
+	return connection->streams.back().get();
 }
 
-void FalconServer::CloseStream(const Stream& stream) {
-	uint64_t client_id = stream.GetClientUUID();;
-	uint32_t stream_id = stream.GetStreamID();
-	uint16_t msg_size = 11;
-	std::string message;
-	message.resize(msg_size);
+void FalconServer::ForgetStream(uint64_t client, uint32_t stream_id)
+{
+	ClientConnection* connection = m_connections.Find(client);
+	if (!connection)
+	{
+		return;
+	}
+	const auto it = std::find(connection->stream_ids.begin(), connection->stream_ids.end(), stream_id);
+	if (it != connection->stream_ids.end())
+	{
+		// Order does not matter, the last stream takes the place of the removed one
+		const size_t index = it - connection->stream_ids.begin();
+		std::lock_guard lock(m_connections_mutex);
+		connection->stream_ids[index] = connection->stream_ids.back();
+		connection->stream_ids.pop_back();
+		connection->streams[index] = std::move(connection->streams.back());
+		connection->streams.pop_back();
+		std::erase(connection->streams_ack, stream_id);
+	}
+	connection->reassembler->Forget(stream_id);
+	connection->scheduler.Forget(stream_id);
+}
 
-	message[0] = CLOSE_STREAM;
-	memcpy(&message[1], &msg_size, sizeof(msg_size));
-	memcpy(&message[3], &client_id, sizeof(client_id));
-	memcpy(&message[11], &stream_id, sizeof(stream_id));
+std::shared_ptr<Stream> FalconServer::CreateStream(uint64_t client, bool reliable) {
+	return Shard(client).OpenStream(client, Shard(client).GetNewStreamID(reliable));
+}
 
-	SendTo(m_clients.at(client_id).ip, m_clients.at(client_id).port, message);
+std::shared_ptr<Stream> FalconServer::CreateSnapshotStream(uint64_t client) {
+	return Shard(client).OpenStream(client, Shard(client).GetNewStreamID(false) | Stream::SNAPSHOT_STREAM_BIT);
+}
 
-	m_streams.at(client_id).erase(stream_id);
-	if (m_streams.at(client_id).size() == 0)
+std::shared_ptr<Stream> FalconServer::CreateSequencedStream(uint64_t client) {
+	return Shard(client).OpenStream(client, Shard(client).GetNewStreamID(false) | Stream::SEQUENCED_STREAM_BIT);
+}
+
+std::shared_ptr<Stream> FalconServer::CreateOrderedStream(uint64_t client) {
+	return Shard(client).OpenStream(client, Shard(client).GetNewStreamID(true) | Stream::SEQUENCED_STREAM_BIT);
+}
+
+std::shared_ptr<Stream> FalconServer::OpenStream(uint64_t client, uint32_t stream_id) {
+	std::shared_ptr<Stream> stream = MakeStream(stream_id, client);
+	if (!stream)
 	{
-		m_streams.erase(client_id);
+		return nullptr;
 	}
-}
\ No newline at end of file
+
+	StreamCommand command;
+	command.type = StreamCommand::Type::Open;
+	command.client_id = client;
+	command.stream = stream;
+	return SubmitCommand(std::move(command)) ? stream : nullptr;
+}
+
+bool FalconServer::CloseStream(const Stream& stream) {
+	StreamCommand command;
+	command.type = StreamCommand::Type::Close;
+	command.client_id = stream.GetClientUUID();
+	command.stream_id = stream.GetStreamID();
+	return Shard(command.client_id).SubmitCommand(std::move(command));
+}
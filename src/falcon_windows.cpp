@@ -8,6 +8,7 @@
 #include <winsock2.h>
 #include <ws2tcpip.h>
 
+#include <array>
 #include <fmt/core.h>
 
 #pragma comment(lib, "Ws2_32.lib")
@@ -56,50 +57,132 @@ std::string IpToString(const sockaddr* sa)
     return "";
 }
 
-sockaddr StringToIp(const std::string& ip, uint16_t port)
+static_assert(sizeof(sockaddr_storage) <= Endpoint::STORAGE_SIZE);
+
+// Path MTU probes have to be dropped when too large rather than fragmented
+static void SetDontFragment(SocketType socket, int family)
 {
-    sockaddr result {};
-    int error = inet_pton(AF_INET, ip.c_str(), &reinterpret_cast<sockaddr_in*>(&result)->sin_addr);
-    if (error == 1) {
-        result.sa_family = AF_INET;
-        reinterpret_cast<sockaddr_in*>(&result)->sin_port = htons(port);
+    const DWORD enable = TRUE;
+    if (family == AF_INET)
+    {
+        setsockopt(socket, IPPROTO_IP, IP_DONTFRAGMENT, reinterpret_cast<const char*>(&enable), sizeof(enable));
+    }
+    else if (family == AF_INET6)
+    {
+        setsockopt(socket, IPPROTO_IPV6, IPV6_DONTFRAG, reinterpret_cast<const char*>(&enable), sizeof(enable));
+    }
+}
+
+Endpoint Endpoint::Resolve(const std::string& ip, uint16_t port)
+{
+    Endpoint result;
+    auto* ipv4 = reinterpret_cast<sockaddr_in*>(result.Data());
+    if (inet_pton(AF_INET, ip.c_str(), &ipv4->sin_addr) == 1) {
+        ipv4->sin_family = AF_INET;
+        ipv4->sin_port = htons(port);
+        result.SetSize(sizeof(sockaddr_in));
         return result;
     }
 
-    memset(&result, 0, sizeof(result));
-    error = inet_pton(AF_INET6, ip.c_str(), &reinterpret_cast<sockaddr_in6*>(&result)->sin6_addr);
-    if (error == 1) {
-        result.sa_family = AF_INET6;
-        reinterpret_cast<sockaddr_in6*>(&result)->sin6_port = htons(port);
+    auto* ipv6 = reinterpret_cast<sockaddr_in6*>(result.Data());
+    memset(ipv6, 0, sizeof(sockaddr_in6));
+    if (inet_pton(AF_INET6, ip.c_str(), &ipv6->sin6_addr) == 1) {
+        ipv6->sin6_family = AF_INET6;
+        ipv6->sin6_port = htons(port);
+        result.SetSize(sizeof(sockaddr_in6));
         return result;
     }
-    memset(&result, 0, sizeof(result));
+    memset(ipv6, 0, sizeof(sockaddr_in6));
     return result;
 }
 
+std::string Endpoint::ToString() const
+{
+    if (!IsValid())
+    {
+        return "";
+    }
+    return IpToString(reinterpret_cast<const sockaddr*>(Data()));
+}
+
 Falcon::Falcon()
 {
     static WinSockInitializer winsockInitializer{};
 }
 
 Falcon::~Falcon() {
+    DisableSendBatching();
     if(m_socket != INVALID_SOCKET)
     {
         closesocket(m_socket);
     }
 }
 
+void Falcon::CreateReactor()
+{
+    // Winsock cannot poll an event alongside a socket, Wakeup pokes the socket itself instead
+}
+
+void Falcon::CloseReactor()
+{
+}
+
+void Falcon::Wakeup()
+{
+    if (m_socket == INVALID_SOCKET)
+    {
+        return;
+    }
+
+    // An empty datagram sent to ourselves unblocks WSAPoll, the listener skips empty datagrams
+    Endpoint self;
+    int self_size = Endpoint::STORAGE_SIZE;
+    if (getsockname(m_socket, reinterpret_cast<sockaddr*>(self.Data()), &self_size) == SOCKET_ERROR)
+    {
+        return;
+    }
+    self.SetSize(self_size);
+
+    auto* address = reinterpret_cast<sockaddr*>(self.Data());
+    if (address->sa_family == AF_INET)
+    {
+        auto* ipv4 = reinterpret_cast<sockaddr_in*>(address);
+        if (ipv4->sin_addr.s_addr == htonl(INADDR_ANY))
+        {
+            ipv4->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        }
+    }
+    else if (address->sa_family == AF_INET6)
+    {
+        auto* ipv6 = reinterpret_cast<sockaddr_in6*>(address);
+        if (IN6_IS_ADDR_UNSPECIFIED(&ipv6->sin6_addr))
+        {
+            ipv6->sin6_addr = in6addr_loopback;
+        }
+    }
+    SendToInternal(self, {});
+}
+
+bool Falcon::WaitReadable(int timeout_ms)
+{
+    WSAPOLLFD fds;
+    fds.fd = m_socket;
+    fds.events = POLLIN;
+    return WSAPoll(&fds, 1, timeout_ms) > 0;
+}
+
 void Falcon::CreateServer(uint16_t port)
 {
     if (m_socket != INVALID_SOCKET)
     {
         closesocket(m_socket);
     }
-    sockaddr local_endpoint = StringToIp("0.0.0.0", port);
-    m_socket = socket(local_endpoint.sa_family,
+    const Endpoint local_endpoint = Endpoint::Resolve("0.0.0.0", port);
+    m_socket = socket(reinterpret_cast<const sockaddr*>(local_endpoint.Data())->sa_family,
         SOCK_DGRAM,
         IPPROTO_UDP);
-    if (int error = bind(m_socket, &local_endpoint, sizeof(local_endpoint)); error != 0)
+    SetDontFragment(m_socket, reinterpret_cast<const sockaddr*>(local_endpoint.Data())->sa_family);
+    if (int error = bind(m_socket, reinterpret_cast<const sockaddr*>(local_endpoint.Data()), local_endpoint.Size()); error != 0)
     {
         closesocket(m_socket);
     }
@@ -111,28 +194,55 @@ void Falcon::CreateClient(const std::string& ip)
     {
         closesocket(m_socket);
     }
-    sockaddr local_endpoint = StringToIp(ip, 0);
-    m_socket = socket(local_endpoint.sa_family,
+    // Bind to the wildcard address of the same family as the server, on an ephemeral port
+    const int family = reinterpret_cast<const sockaddr*>(Endpoint::Resolve(ip, 0).Data())->sa_family;
+    const Endpoint local_endpoint = Endpoint::Resolve(family == AF_INET6 ? "::" : "0.0.0.0", 0);
+    m_socket = socket(reinterpret_cast<const sockaddr*>(local_endpoint.Data())->sa_family,
         SOCK_DGRAM,
         IPPROTO_UDP);
-    if (int error = bind(m_socket, &local_endpoint, sizeof(local_endpoint)); error != 0)
+    SetDontFragment(m_socket, family);
+    if (int error = bind(m_socket, reinterpret_cast<const sockaddr*>(local_endpoint.Data()), local_endpoint.Size()); error != 0)
     {
         closesocket(m_socket);
     }
 }
 
-int Falcon::SendToInternal(const std::string &to, uint16_t port, std::span<const char> message)
+int Falcon::SendToInternal(const Endpoint& to, std::span<const char> message)
 {
-    const sockaddr destination = StringToIp(to, port);
     int error = sendto(m_socket,
         message.data(),
-        message.size(),
+        static_cast<int>(message.size()),
         0,
-        &destination,
-        sizeof(destination));
+        reinterpret_cast<const sockaddr*>(to.Data()),
+        static_cast<int>(to.Size()));
     return error;
 }
 
+int Falcon::SendGatherInternal(const Endpoint& to, std::span<const std::span<const char>> parts)
+{
+    std::array<WSABUF, MAX_GATHER_PARTS> buffers;
+    for (size_t i = 0; i < parts.size(); i++)
+    {
+        buffers[i].buf = const_cast<char*>(parts[i].data());
+        buffers[i].len = static_cast<ULONG>(parts[i].size());
+    }
+
+    DWORD sent = 0;
+    if (WSASendTo(m_socket,
+        buffers.data(),
+        static_cast<DWORD>(parts.size()),
+        &sent,
+        0,
+        reinterpret_cast<const sockaddr*>(to.Data()),
+        static_cast<int>(to.Size()),
+        nullptr,
+        nullptr) == SOCKET_ERROR)
+    {
+        return SOCKET_ERROR;
+    }
+    return static_cast<int>(sent);
+}
+
 int Falcon::ReceiveFromInternal(std::string &from, std::span<char, 65535> message)
 {
     WSAPOLLFD fds;
@@ -157,4 +267,50 @@ int Falcon::ReceiveFromInternal(std::string &from, std::span<char, 65535> messag
     from = IpToString(reinterpret_cast<const sockaddr*>(&peer_addr));
 
     return read_bytes;
-}
\ No newline at end of file
+}
+
+int Falcon::SendBatchInternal(std::span<const QueuedDatagram> datagrams)
+{
+    // Winsock has no sendmmsg, send one datagram at a time
+    int sent = 0;
+    for (const QueuedDatagram& datagram : datagrams)
+    {
+        if (SendToInternal(datagram.to, datagram.data) == SOCKET_ERROR && WSAGetLastError() != WSAEMSGSIZE)
+        {
+            break;
+        }
+        sent++;
+    }
+    return sent;
+}
+
+int Falcon::ReceiveBatchInternal(std::span<Datagram> datagrams, int timeout_ms)
+{
+    if (datagrams.empty())
+    {
+        return 0;
+    }
+
+    int timeout = timeout_ms;
+    int count = 0;
+    while (count < static_cast<int>(datagrams.size()) && WaitReadable(timeout))
+    {
+        socklen_t peer_addr_len = Endpoint::STORAGE_SIZE;
+        const int read_bytes = recvfrom(m_socket,
+            datagrams[count].buffer.data(),
+            static_cast<int>(datagrams[count].buffer.size_bytes()),
+            0,
+            reinterpret_cast<sockaddr*>(datagrams[count].from.Data()),
+            &peer_addr_len);
+        if (read_bytes == SOCKET_ERROR)
+        {
+            break;
+        }
+
+        datagrams[count].from.SetSize(peer_addr_len);
+        datagrams[count].size = read_bytes;
+        count++;
+        timeout = 0;  // Only wait for the first datagram, then drain what is already there
+    }
+    return count;
+}
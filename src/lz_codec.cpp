@@ -0,0 +1,233 @@
+#include "lz_codec.h"
+#include <algorithm>
+#include <cstring>
+
+namespace lz
+{
+    namespace
+    {
+        constexpr uint8_t LENGTH_MASK = 15;
+
+        uint32_t Hash(uint32_t sequence) { return (sequence * 2654435761u) >> (32 - HASH_BITS); }
+
+        // Input seen after the dictionary: positions below the dictionary size are in the dictionary
+        class Window
+        {
+        public:
+            Window(std::span<const char> dictionary, std::span<const char> input) : m_dictionary(dictionary), m_input(input) {}
+
+            char At(size_t position) const
+            {
+                return position < m_dictionary.size() ? m_dictionary[position] : m_input[position - m_dictionary.size()];
+            }
+
+            uint32_t Read32(size_t position) const
+            {
+                uint32_t value;
+                if (position >= m_dictionary.size())
+                {
+                    memcpy(&value, m_input.data() + position - m_dictionary.size(), sizeof(value));
+                }
+                else if (position + sizeof(value) <= m_dictionary.size())
+                {
+                    memcpy(&value, m_dictionary.data() + position, sizeof(value));
+                }
+                else
+                {
+                    char bytes[sizeof(value)];
+                    for (size_t i = 0; i < sizeof(value); i++)
+                    {
+                        bytes[i] = At(position + i);
+                    }
+                    memcpy(&value, bytes, sizeof(value));
+                }
+                return value;
+            }
+
+        private:
+            std::span<const char> m_dictionary;
+            std::span<const char> m_input;
+        };
+
+        // Lengths past what the token holds go on in bytes of up to 255
+        void WriteLength(std::vector<char>& out, size_t& op, size_t length)
+        {
+            for (; length >= 255; length -= 255)
+            {
+                out[op++] = static_cast<char>(255);
+            }
+            out[op++] = static_cast<char>(length);
+        }
+
+        bool ReadLength(std::span<const char> input, size_t& ip, size_t& length)
+        {
+            uint8_t byte;
+            do
+            {
+                if (ip >= input.size())
+                {
+                    return false;
+                }
+                byte = static_cast<uint8_t>(input[ip++]);
+                length += byte;
+            } while (byte == 255);
+            return true;
+        }
+
+        void WriteSequence(std::vector<char>& out, size_t& op, std::span<const char> literals, size_t distance, size_t match)
+        {
+            const size_t literal_code = std::min<size_t>(literals.size(), LENGTH_MASK);
+            const size_t match_code = match ? std::min<size_t>(match - MIN_MATCH, LENGTH_MASK) : 0;
+            out[op++] = static_cast<char>(literal_code << 4 | match_code);
+            if (literal_code == LENGTH_MASK)
+            {
+                WriteLength(out, op, literals.size() - LENGTH_MASK);
+            }
+            memcpy(out.data() + op, literals.data(), literals.size());
+            op += literals.size();
+            if (match == 0)
+            {
+                return;
+            }
+            const uint16_t encoded_distance = static_cast<uint16_t>(distance);
+            memcpy(out.data() + op, &encoded_distance, sizeof(encoded_distance));
+            op += sizeof(encoded_distance);
+            if (match_code == LENGTH_MASK)
+            {
+                WriteLength(out, op, match - MIN_MATCH - LENGTH_MASK);
+            }
+        }
+    }
+
+    Dictionary::Dictionary(std::span<const char> content)
+    {
+        if (content.size() > MAX_DISTANCE)
+        {
+            content = content.last(MAX_DISTANCE);
+        }
+        m_content.assign(content.begin(), content.end());
+        const Window window(m_content, {});
+        for (size_t position = 0; position + MIN_MATCH <= m_content.size(); position++)
+        {
+            m_table[Hash(window.Read32(position))] = static_cast<uint32_t>(position + 1);
+        }
+    }
+
+    void Compress(std::span<const char> input, std::vector<char>& out, const Dictionary* dictionary)
+    {
+        const std::span<const char> content = dictionary ? dictionary->Content() : std::span<const char>();
+        const Window window(content, input);
+        HashTable table;
+        if (dictionary)
+        {
+            table = dictionary->Table();
+        }
+        else
+        {
+            table.fill(0);
+        }
+
+        out.resize(MaxCompressedSize(input.size()));
+        size_t op = 0;
+        size_t anchor = 0;
+        size_t position = 0;
+        // Incompressible stretches are skipped faster the longer they get
+        size_t misses = 0;
+        while (position + MIN_MATCH <= input.size())
+        {
+            const size_t current = content.size() + position;
+            const uint32_t sequence = window.Read32(current);
+            uint32_t& slot = table[Hash(sequence)];
+            const size_t candidate = slot;
+            slot = static_cast<uint32_t>(current + 1);
+            if (candidate == 0 || current - (candidate - 1) > MAX_DISTANCE || window.Read32(candidate - 1) != sequence)
+            {
+                position += 1 + (misses++ >> 6);
+                continue;
+            }
+
+            const size_t match_start = candidate - 1;
+            size_t length = MIN_MATCH;
+            while (position + length < input.size() && window.At(match_start + length) == input[position + length])
+            {
+                length++;
+            }
+            WriteSequence(out, op, input.subspan(anchor, position - anchor), current - match_start, length);
+            position += length;
+            anchor = position;
+            misses = 0;
+        }
+        WriteSequence(out, op, input.subspan(anchor), 0, 0);
+        out.resize(op);
+    }
+
+    bool Decompress(std::span<const char> input, size_t size, std::string& out, const Dictionary* dictionary)
+    {
+        const std::span<const char> content = dictionary ? dictionary->Content() : std::span<const char>();
+        out.resize(size);
+        size_t op = 0;
+        size_t ip = 0;
+        // Only a sequence without a match ends the block, a block cut after a match is incomplete
+        bool ended = false;
+        while (ip < input.size())
+        {
+            const uint8_t token = static_cast<uint8_t>(input[ip++]);
+            size_t literals = token >> 4;
+            if (literals == LENGTH_MASK && !ReadLength(input, ip, literals))
+            {
+                return false;
+            }
+            if (literals > input.size() - ip || literals > size - op)
+            {
+                return false;
+            }
+            memcpy(out.data() + op, input.data() + ip, literals);
+            ip += literals;
+            op += literals;
+            if (ip == input.size())
+            {
+                ended = true;
+                break;
+            }
+
+            uint16_t distance;
+            if (input.size() - ip < sizeof(distance))
+            {
+                return false;
+            }
+            memcpy(&distance, input.data() + ip, sizeof(distance));
+            ip += sizeof(distance);
+            size_t length = (token & LENGTH_MASK) + MIN_MATCH;
+            if ((token & LENGTH_MASK) == LENGTH_MASK && !ReadLength(input, ip, length))
+            {
+                return false;
+            }
+            if (distance == 0 || distance > op + content.size() || length > size - op)
+            {
+                return false;
+            }
+
+            // The part of the match still in the dictionary, then the output so far, overlapping what is being written
+            if (distance > op)
+            {
+                const size_t from_dictionary = std::min(length, distance - op);
+                memcpy(out.data() + op, content.data() + content.size() - (distance - op), from_dictionary);
+                op += from_dictionary;
+                length -= from_dictionary;
+            }
+            if (distance >= length)
+            {
+                memcpy(out.data() + op, out.data() + op - distance, length);
+                op += length;
+            }
+            else
+            {
+                for (; length > 0; length--, op++)
+                {
+                    out[op] = out[op - distance];
+                }
+            }
+        }
+        return ended && op == size;
+    }
+}
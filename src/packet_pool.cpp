@@ -0,0 +1,50 @@
+#include "packet_pool.h"
+
+PacketPool::PacketPool(size_t buffer_count, size_t buffer_size)
+{
+    Reset(buffer_count, buffer_size);
+}
+
+void PacketPool::Reset(size_t buffer_count, size_t buffer_size)
+{
+    m_buffer_count = buffer_count;
+    m_buffer_size = buffer_size;
+    m_storage.assign(buffer_count * buffer_size, 0);
+
+    m_free.clear();
+    m_free.reserve(buffer_count);
+    for (size_t i = buffer_count; i > 0; i--)
+    {
+        m_free.push_back(static_cast<int>(i - 1));
+    }
+}
+
+int PacketPool::Acquire()
+{
+    if (m_free.empty())
+    {
+        return INVALID_BUFFER;
+    }
+    const int buffer = m_free.back();
+    m_free.pop_back();
+    return buffer;
+}
+
+void PacketPool::Release(int buffer)
+{
+    if (buffer < 0 || static_cast<size_t>(buffer) >= m_buffer_count)
+    {
+        return;
+    }
+    m_free.push_back(buffer);
+}
+
+std::span<char> PacketPool::Get(int buffer)
+{
+    return { m_storage.data() + static_cast<size_t>(buffer) * m_buffer_size, m_buffer_size };
+}
+
+std::span<const char> PacketPool::Get(int buffer) const
+{
+    return { m_storage.data() + static_cast<size_t>(buffer) * m_buffer_size, m_buffer_size };
+}
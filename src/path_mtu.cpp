@@ -0,0 +1,72 @@
+#include "path_mtu.h"
+
+#include <algorithm>
+
+PathMtuDiscovery::PathMtuDiscovery(uint16_t min_size, uint16_t max_size, Clock::duration raise_interval) :
+    m_size(min_size), m_max_size(std::max(min_size, max_size)), m_upper_bound(m_max_size), m_raise_interval(raise_interval)
+{
+}
+
+bool PathMtuDiscovery::IsSearching() const
+{
+    // Close to the configured maximum, the maximum itself is worth a try: most paths deliver it
+    const uint16_t size = GetMaxDatagramSize();
+    return size < m_upper_bound && (m_upper_bound - size >= SEARCH_PRECISION || m_upper_bound == m_max_size);
+}
+
+uint16_t PathMtuDiscovery::OnProbeTimer(Clock::time_point now)
+{
+    if (m_probe_size != 0 && ++m_probe_count >= MAX_PROBES)
+    {
+        m_upper_bound = m_probe_size - 1;
+        m_probe_size = 0;
+        m_probe_count = 0;
+    }
+
+    if (!IsSearching())
+    {
+        if (m_raise_at == Clock::time_point::max())
+        {
+            m_raise_at = now + m_raise_interval;
+        }
+        if (now < m_raise_at)
+        {
+            return 0;
+        }
+        m_upper_bound = m_max_size;
+        m_raise_at = Clock::time_point::max();
+        if (!IsSearching())
+        {
+            return 0;
+        }
+    }
+
+    // Repeats the outstanding probe until it is acknowledged or given up
+    if (m_probe_size == 0)
+    {
+        const uint16_t size = GetMaxDatagramSize();
+        m_probe_size = m_upper_bound - size < SEARCH_PRECISION ? m_upper_bound : size + (m_upper_bound - size + 1) / 2;
+    }
+    return m_probe_size;
+}
+
+bool PathMtuDiscovery::OnProbeAcked(uint16_t size, Clock::time_point now)
+{
+    if (size <= GetMaxDatagramSize() || size > m_max_size)
+    {
+        return false;
+    }
+
+    m_size.store(size, std::memory_order_relaxed);
+    m_upper_bound = std::max(m_upper_bound, size);
+    if (size >= m_probe_size)
+    {
+        m_probe_size = 0;
+        m_probe_count = 0;
+    }
+    if (!IsSearching())
+    {
+        m_raise_at = now + m_raise_interval;
+    }
+    return true;
+}
@@ -0,0 +1,114 @@
+#include "reassembler.h"
+
+#include <algorithm>
+#include <cstring>
+
+Reassembler::Reassembler(size_t max_bytes, Clock::duration timeout) :
+    m_max_bytes(max_bytes), m_timeout(timeout)
+{
+}
+
+Reassembler::Status Reassembler::AddPart(uint32_t stream_id, uint16_t message_id, uint16_t part_id, uint16_t part_total, size_t part_size,
+    std::span<const char> part, bool can_expire, std::string& message, Clock::time_point now)
+{
+    const bool last = part_id == part_total - 1;
+    if (part_id >= part_total || part_total > MAX_PARTS || part.size() > part_size || (!last && part.size() != part_size))
+    {
+        return Status::Rejected;
+    }
+
+    Expire(now);
+
+    auto entry = std::find_if(m_entries.begin(), m_entries.end(), [&](const Entry& entry) {
+        return entry.stream_id == stream_id && entry.message_id == message_id;
+    });
+    if (entry == m_entries.end())
+    {
+        // The whole message is reserved up front, so later parts never move the earlier ones
+        const size_t capacity = part_total * part_size;
+        if (m_buffered_bytes + capacity > m_max_bytes)
+        {
+            return Status::Rejected;
+        }
+
+        Entry& created = m_entries.emplace_back();
+        created.stream_id = stream_id;
+        created.message_id = message_id;
+        created.part_total = part_total;
+        created.can_expire = can_expire;
+        created.part_size = part_size;
+        created.size = capacity;
+        created.started_at = now;
+        created.parts.Resize(part_total);
+        if (!m_free_buffers.empty())
+        {
+            created.buffer = std::move(m_free_buffers.back());
+            m_free_buffers.pop_back();
+        }
+        created.buffer.resize(capacity);
+        m_buffered_bytes += capacity;
+        entry = m_entries.end() - 1;
+    }
+    else if (entry->part_total != part_total || entry->part_size != part_size)
+    {
+        return Status::Rejected;
+    }
+
+    if (entry->parts.Test(part_id))
+    {
+        return Status::Duplicate;
+    }
+    entry->parts.Set(part_id);
+    entry->received++;
+    memcpy(entry->buffer.data() + part_id * part_size, part.data(), part.size());
+    if (last)
+    {
+        entry->size = part_id * part_size + part.size();
+    }
+    if (entry->received < part_total)
+    {
+        return Status::Incomplete;
+    }
+
+    m_buffered_bytes -= part_total * part_size;
+    entry->buffer.resize(entry->size);
+    std::swap(message, entry->buffer);
+    Recycle(std::move(entry->buffer));
+    m_entries.erase(entry);
+    return Status::Complete;
+}
+
+void Reassembler::Forget(uint32_t stream_id)
+{
+    std::erase_if(m_entries, [this, stream_id](Entry& entry) {
+        if (entry.stream_id != stream_id)
+        {
+            return false;
+        }
+        m_buffered_bytes -= entry.part_total * entry.part_size;
+        Recycle(std::move(entry.buffer));
+        return true;
+    });
+}
+
+void Reassembler::Expire(Clock::time_point now)
+{
+    std::erase_if(m_entries, [this, now](Entry& entry) {
+        if (!entry.can_expire || now - entry.started_at < m_timeout)
+        {
+            return false;
+        }
+        m_buffered_bytes -= entry.part_total * entry.part_size;
+        Recycle(std::move(entry.buffer));
+        return true;
+    });
+}
+
+void Reassembler::Recycle(std::string&& buffer)
+{
+    if (m_free_buffers.size() < MAX_FREE_BUFFERS)
+    {
+        buffer.clear();
+        m_free_buffers.push_back(std::move(buffer));
+    }
+}
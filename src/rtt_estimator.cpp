@@ -0,0 +1,44 @@
+#include "rtt_estimator.h"
+
+#include <algorithm>
+
+RttEstimator::RttEstimator(Duration initial_rto, Duration min_rto, Duration max_rto) :
+    m_min_rto(min_rto), m_max_rto(std::max(min_rto, max_rto)), m_rto(Clamp(initial_rto))
+{
+}
+
+void RttEstimator::AddSample(Duration rtt)
+{
+    rtt = std::max(rtt, Duration::zero());
+    if (!m_has_sample)
+    {
+        m_smoothed_rtt = rtt;
+        m_rtt_variance = rtt / 2;
+        m_has_sample = true;
+    }
+    else
+    {
+        // RTTVAR = 3/4 RTTVAR + 1/4 |SRTT - R|, then SRTT = 7/8 SRTT + 1/8 R
+        const Duration error = m_smoothed_rtt > rtt ? m_smoothed_rtt - rtt : rtt - m_smoothed_rtt;
+        m_rtt_variance = (3 * m_rtt_variance + error) / 4;
+        m_smoothed_rtt = (7 * m_smoothed_rtt + rtt) / 8;
+    }
+    m_rto = Clamp(m_smoothed_rtt + std::max(CLOCK_GRANULARITY, 4 * m_rtt_variance));
+}
+
+void RttEstimator::Backoff()
+{
+    m_rto = Clamp(2 * m_rto);
+}
+
+void RttEstimator::SetBounds(Duration min_rto, Duration max_rto)
+{
+    m_min_rto = min_rto;
+    m_max_rto = std::max(min_rto, max_rto);
+    m_rto = Clamp(m_rto);
+}
+
+RttEstimator::Duration RttEstimator::Clamp(Duration rto) const
+{
+    return std::clamp(rto, m_min_rto, m_max_rto);
+}
@@ -0,0 +1,152 @@
+#include "send_scheduler.h"
+
+#include <algorithm>
+#include <utility>
+
+void SendScheduler::SetBudget(uint64_t bytes_per_second, size_t burst)
+{
+    m_rate = bytes_per_second;
+    m_burst = std::max<size_t>(burst, 1);
+    m_tokens = std::min(m_tokens, static_cast<double>(m_burst));
+}
+
+void SendScheduler::Enqueue(uint32_t stream_id, int priority, uint32_t weight, bool reliable, std::span<const char> data)
+{
+    auto it = std::find_if(m_streams.begin(), m_streams.end(), [stream_id](const StreamQueue& stream) { return stream.stream_id == stream_id; });
+    if (it == m_streams.end())
+    {
+        it = m_streams.emplace(m_streams.end());
+        it->stream_id = stream_id;
+    }
+    it->priority = priority;
+    it->reliable = reliable;
+
+    Queued& queued = it->messages.emplace_back();
+    if (!m_free_buffers.empty())
+    {
+        queued.data = std::move(m_free_buffers.back());
+        m_free_buffers.pop_back();
+    }
+    queued.data.assign(data.begin(), data.end());
+    // An idle stream starts from the current virtual time, it gets no credit for the time it sent nothing
+    queued.finish = std::max(m_virtual_time, it->last_finish) + static_cast<double>(std::max<size_t>(data.size(), 1)) / std::max<uint32_t>(weight, 1);
+    it->last_finish = queued.finish;
+    m_queued++;
+}
+
+bool SendScheduler::Pop(Clock::time_point now, uint32_t& stream_id, std::vector<char>& data)
+{
+    StreamQueue* stream = Next();
+    if (!stream)
+    {
+        return false;
+    }
+    Queued& message = stream->messages.front();
+    if (m_rate > 0)
+    {
+        Refill(now);
+        if (m_tokens < Cost(message))
+        {
+            // The head waits for the refill, reliable or not, unreliable messages of lower priority are dropped
+            DropUnreliable(stream->priority);
+            return false;
+        }
+        m_tokens -= static_cast<double>(message.data.size());
+    }
+
+    stream_id = stream->stream_id;
+    m_virtual_time = message.finish;
+    data.swap(message.data);
+    m_free_buffers.push_back(std::move(message.data));
+    stream->messages.pop_front();
+    m_queued--;
+    return true;
+}
+
+SendScheduler::Clock::time_point SendScheduler::GetNextReleaseTime() const
+{
+    const StreamQueue* stream = Next();
+    if (!stream)
+    {
+        return Clock::time_point::max();
+    }
+    const double missing = Cost(stream->messages.front()) - m_tokens;
+    if (m_rate == 0 || missing <= 0)
+    {
+        return m_refilled_at;
+    }
+    return m_refilled_at + std::chrono::ceil<Clock::duration>(std::chrono::duration<double>(missing / static_cast<double>(m_rate)));
+}
+
+void SendScheduler::Forget(uint32_t stream_id)
+{
+    std::erase_if(m_streams, [&](const StreamQueue& stream) {
+        if (stream.stream_id != stream_id)
+        {
+            return false;
+        }
+        m_queued -= stream.messages.size();
+        return true;
+    });
+}
+
+SendScheduler::StreamQueue* SendScheduler::Next()
+{
+    return const_cast<StreamQueue*>(std::as_const(*this).Next());
+}
+
+const SendScheduler::StreamQueue* SendScheduler::Next() const
+{
+    const StreamQueue* next = nullptr;
+    for (const StreamQueue& stream : m_streams)
+    {
+        if (stream.messages.empty())
+        {
+            continue;
+        }
+        if (!next || stream.priority > next->priority
+            || (stream.priority == next->priority && stream.messages.front().finish < next->messages.front().finish))
+        {
+            next = &stream;
+        }
+    }
+    return next;
+}
+
+void SendScheduler::Refill(Clock::time_point now)
+{
+    // The first message finds a full bucket
+    if (m_refilled_at == Clock::time_point{})
+    {
+        m_tokens = static_cast<double>(m_burst);
+    }
+    else if (now > m_refilled_at)
+    {
+        m_tokens = std::min(m_tokens + std::chrono::duration<double>(now - m_refilled_at).count() * static_cast<double>(m_rate),
+            static_cast<double>(m_burst));
+    }
+    m_refilled_at = std::max(m_refilled_at, now);
+}
+
+void SendScheduler::DropUnreliable(int below_priority)
+{
+    for (StreamQueue& stream : m_streams)
+    {
+        if (stream.reliable || stream.priority >= below_priority)
+        {
+            continue;
+        }
+        m_dropped += stream.messages.size();
+        m_queued -= stream.messages.size();
+        for (Queued& message : stream.messages)
+        {
+            m_free_buffers.push_back(std::move(message.data));
+        }
+        stream.messages.clear();
+    }
+}
+
+double SendScheduler::Cost(const Queued& message) const
+{
+    return static_cast<double>(std::min(message.data.size(), m_burst));
+}
@@ -0,0 +1,171 @@
+#include "snapshot_delta.h"
+#include "wire_format.h"
+#include <algorithm>
+#include <cstring>
+
+namespace snapshot
+{
+    namespace
+    {
+        // sequence, baseline sequence, kind, state size
+        constexpr size_t HEADER_SIZE = 2 + 2 + 1 + 4;
+        constexpr uint8_t FULL = 0;
+        constexpr uint8_t DELTA = 1;
+        // Shorter matches inside changed bytes cost more as a copy run than as new bytes
+        constexpr size_t MIN_MATCH = 4;
+
+        void WriteHeader(std::vector<char>& out, uint16_t sequence, uint16_t baseline, uint8_t kind, uint32_t state_size)
+        {
+            out.resize(HEADER_SIZE);
+            memcpy(&out[0], &sequence, sizeof(sequence));
+            memcpy(&out[2], &baseline, sizeof(baseline));
+            out[4] = static_cast<char>(kind);
+            memcpy(&out[5], &state_size, sizeof(state_size));
+        }
+
+        void AppendVarint(std::vector<char>& out, uint64_t value)
+        {
+            std::array<char, 10> bytes;
+            const size_t size = wire::WriteVarint(value, bytes.data());
+            out.insert(out.end(), bytes.begin(), bytes.begin() + size);
+        }
+
+        // Number of bytes from position on that match the baseline
+        size_t MatchLength(std::span<const char> state, std::span<const char> baseline, size_t position)
+        {
+            const size_t end = std::min(state.size(), baseline.size());
+            size_t length = 0;
+            while (position + length < end && state[position + length] == baseline[position + length])
+            {
+                length++;
+            }
+            return length;
+        }
+    }
+
+    void Encoder::Encode(std::span<const char> state, std::vector<char>& out)
+    {
+        const uint16_t sequence = m_next_sequence++;
+        const Entry& base = m_history[m_baseline % HISTORY_SIZE];
+        const bool has_baseline = m_has_baseline && base.used && base.sequence == m_baseline && m_baseline != sequence;
+
+        bool encoded = false;
+        if (has_baseline)
+        {
+            // Runs of bytes copied from the baseline, each followed by a run of new bytes
+            WriteHeader(out, sequence, m_baseline, DELTA, static_cast<uint32_t>(state.size()));
+            const std::span<const char> baseline(base.state);
+            size_t position = 0;
+            while (position < state.size() && out.size() < HEADER_SIZE + state.size())
+            {
+                const size_t copied = MatchLength(state, baseline, position);
+                size_t end = position + copied;
+                while (end < state.size())
+                {
+                    const size_t match = MatchLength(state, baseline, end);
+                    if (match >= MIN_MATCH || end + match == state.size())
+                    {
+                        break;
+                    }
+                    end += match + 1;
+                }
+                AppendVarint(out, copied);
+                AppendVarint(out, end - position - copied);
+                out.insert(out.end(), state.begin() + position + copied, state.begin() + end);
+                position = end;
+            }
+            // Mostly new bytes, the delta would not save anything
+            encoded = position == state.size() && out.size() < HEADER_SIZE + state.size();
+        }
+        if (!encoded)
+        {
+            WriteHeader(out, sequence, sequence, FULL, static_cast<uint32_t>(state.size()));
+            out.insert(out.end(), state.begin(), state.end());
+        }
+
+        Entry& entry = m_history[sequence % HISTORY_SIZE];
+        entry.used = true;
+        entry.sequence = sequence;
+        entry.state.assign(state.begin(), state.end());
+    }
+
+    void Encoder::OnAcknowledged(uint16_t sequence)
+    {
+        const Entry& entry = m_history[sequence % HISTORY_SIZE];
+        // Only snapshots still in the history can serve as a baseline
+        if (!entry.used || entry.sequence != sequence)
+        {
+            return;
+        }
+        if (!m_has_baseline || IsNewer(sequence, m_baseline))
+        {
+            m_has_baseline = true;
+            m_baseline = sequence;
+        }
+    }
+
+    bool Decoder::Decode(std::span<const char> message, std::string& state)
+    {
+        if (message.size() < HEADER_SIZE)
+        {
+            return false;
+        }
+        uint16_t sequence;
+        uint16_t baseline;
+        uint32_t state_size;
+        memcpy(&sequence, &message[0], sizeof(sequence));
+        memcpy(&baseline, &message[2], sizeof(baseline));
+        const uint8_t kind = static_cast<uint8_t>(message[4]);
+        memcpy(&state_size, &message[5], sizeof(state_size));
+        if (m_has_last && !IsNewer(sequence, m_last_sequence))
+        {
+            return false;
+        }
+
+        const std::span<const char> body = message.subspan(HEADER_SIZE);
+        if (kind == FULL)
+        {
+            if (body.size() != state_size)
+            {
+                return false;
+            }
+            state.assign(body.begin(), body.end());
+        }
+        else
+        {
+            const Entry& base = m_history[baseline % HISTORY_SIZE];
+            // Every byte is copied from the baseline or carried in the body, a larger size is not trusted
+            if (kind != DELTA || !base.used || base.sequence != baseline || state_size > base.state.size() + body.size())
+            {
+                return false;
+            }
+            state.resize(state_size);
+            size_t position = 0;
+            size_t pos = 0;
+            while (position < state_size)
+            {
+                uint64_t copied;
+                uint64_t added;
+                if (!wire::ReadVarint(body, pos, copied) || !wire::ReadVarint(body, pos, added)
+                    || copied > state_size - position || position + copied > base.state.size()
+                    || added > state_size - position - copied || added > body.size() - pos)
+                {
+                    return false;
+                }
+                memcpy(state.data() + position, base.state.data() + position, copied);
+                position += copied;
+                memcpy(state.data() + position, body.data() + pos, added);
+                position += added;
+                pos += added;
+            }
+        }
+
+        Entry& entry = m_history[sequence % HISTORY_SIZE];
+        entry.used = true;
+        entry.sequence = sequence;
+        entry.state.assign(state);
+        m_has_last = true;
+        m_last_sequence = sequence;
+        return true;
+    }
+}
@@ -0,0 +1,295 @@
+#include "timer_wheel.h"
+
+#include <algorithm>
+#include <bit>
+#include <limits>
+
+namespace
+{
+    uint32_t GenerationOf(TimerWheel::TimerId timer) { return static_cast<uint32_t>(timer >> 32); }
+    int32_t IndexOf(TimerWheel::TimerId timer) { return static_cast<int32_t>(timer & 0xFFFFFFFF); }
+}
+
+TimerWheel::TimerWheel(std::chrono::milliseconds tick, Clock::time_point start) :
+    m_tick(tick), m_start(start)
+{
+    m_slots.fill(NONE);
+}
+
+TimerWheel::TimerId TimerWheel::Schedule(Clock::time_point deadline, std::function<void()> callback)
+{
+    int32_t index;
+    if (m_free.empty())
+    {
+        index = static_cast<int32_t>(m_nodes.size());
+        m_nodes.emplace_back();
+    }
+    else
+    {
+        index = m_free.back();
+        m_free.pop_back();
+    }
+
+    Node& node = m_nodes[index];
+    node.alive = true;
+    node.callback = std::move(callback);
+    node.deadline_tick = ToTick(deadline);
+    Link(index);
+
+    return (static_cast<uint64_t>(node.generation) << 32) | static_cast<uint32_t>(index);
+}
+
+bool TimerWheel::Cancel(TimerId timer)
+{
+    const int32_t index = Find(timer);
+    if (index == NONE)
+    {
+        return false;
+    }
+    if (m_nodes[index].slot != NONE)
+    {
+        Unlink(index);
+    }
+    Release(index);
+    return true;
+}
+
+bool TimerWheel::Reschedule(TimerId timer, Clock::time_point deadline)
+{
+    const int32_t index = Find(timer);
+    if (index == NONE)
+    {
+        return false;
+    }
+    if (m_nodes[index].slot != NONE)
+    {
+        Unlink(index);
+    }
+    m_nodes[index].deadline_tick = ToTick(deadline);
+    Link(index);
+    return true;
+}
+
+bool TimerWheel::IsScheduled(TimerId timer) const
+{
+    const int32_t index = Find(timer);
+    return index != NONE && m_nodes[index].slot != NONE;
+}
+
+size_t TimerWheel::Advance(Clock::time_point now)
+{
+    const uint64_t target = now <= m_start ? 0 : static_cast<uint64_t>((now - m_start) / m_tick);
+    size_t fired = 0;
+
+    while (m_current_tick < target)
+    {
+        // Jump straight to the next tick that has a cascade or a timer to fire
+        const uint64_t next = NextTick();
+        if (next > target)
+        {
+            m_current_tick = target;
+            break;
+        }
+        m_current_tick = next;
+
+        int level = 1;
+        while (level < LEVELS && ((m_current_tick >> ((level - 1) * LEVEL_BITS)) & SLOT_MASK) == 0)
+        {
+            level++;
+        }
+        for (int cascade = level - 1; cascade >= 1; cascade--)
+        {
+            Cascade(cascade);
+        }
+
+        const int32_t slot = static_cast<int32_t>(m_current_tick & SLOT_MASK);
+        while (m_slots[slot] != NONE)
+        {
+            const int32_t index = m_slots[slot];
+            Unlink(index);
+            if (m_nodes[index].deadline_tick <= m_current_tick)
+            {
+                Fire(index);
+                fired++;
+            }
+            else
+            {
+                Link(index);
+            }
+        }
+    }
+    return fired;
+}
+
+TimerWheel::Clock::time_point TimerWheel::NextDeadline() const
+{
+    const uint64_t next = NextTick();
+    if (next == std::numeric_limits<uint64_t>::max())
+    {
+        return Clock::time_point::max();
+    }
+    return m_start + next * m_tick;
+}
+
+uint64_t TimerWheel::NextTick() const
+{
+    uint64_t next = std::numeric_limits<uint64_t>::max();
+    for (int level = 0; level < LEVELS; level++)
+    {
+        if (m_occupied[level] == 0)
+        {
+            continue;
+        }
+        // Bit k of the rotated mask is the slot k + 1 positions after the current one
+        const int shift = level * LEVEL_BITS;
+        const uint64_t block = m_current_tick >> shift;
+        const uint64_t rotated = std::rotr(m_occupied[level], static_cast<int>((block + 1) & SLOT_MASK));
+        next = std::min(next, (block + std::countr_zero(rotated) + 1) << shift);
+    }
+    return next;
+}
+
+int32_t TimerWheel::Find(TimerId timer) const
+{
+    const int32_t index = IndexOf(timer);
+    if (timer == INVALID_TIMER || index < 0 || static_cast<size_t>(index) >= m_nodes.size())
+    {
+        return NONE;
+    }
+    const Node& node = m_nodes[index];
+    return node.alive && node.generation == GenerationOf(timer) ? index : NONE;
+}
+
+uint64_t TimerWheel::ToTick(Clock::time_point time) const
+{
+    if (time <= m_start)
+    {
+        return 0;
+    }
+    if (time == Clock::time_point::max())
+    {
+        return std::numeric_limits<uint64_t>::max();
+    }
+    // Rounded up so a timer never fires before its deadline
+    return static_cast<uint64_t>((time - m_start + m_tick - Clock::duration(1)) / m_tick);
+}
+
+void TimerWheel::Link(int32_t index)
+{
+    Node& node = m_nodes[index];
+
+    // Slots up to the current tick were already processed, and far deadlines wait in the last level until they get closer
+    uint64_t placement = std::max(node.deadline_tick, m_current_tick + 1);
+    placement = std::min(placement, m_current_tick + MAX_RANGE - 1);
+
+    const uint64_t delta = placement - m_current_tick;
+    int level = 0;
+    while (level < LEVELS - 1 && delta >= (uint64_t(1) << ((level + 1) * LEVEL_BITS)))
+    {
+        level++;
+    }
+
+    const int32_t slot_in_level = static_cast<int32_t>((placement >> (level * LEVEL_BITS)) & SLOT_MASK);
+    const int32_t slot = level * SLOTS + slot_in_level;
+
+    node.slot = slot;
+    node.previous = NONE;
+    node.next = m_slots[slot];
+    if (node.next != NONE)
+    {
+        m_nodes[node.next].previous = index;
+    }
+    m_slots[slot] = index;
+    m_occupied[level] |= uint64_t(1) << slot_in_level;
+    m_scheduled++;
+}
+
+void TimerWheel::Unlink(int32_t index)
+{
+    Node& node = m_nodes[index];
+    if (node.previous != NONE)
+    {
+        m_nodes[node.previous].next = node.next;
+    }
+    else
+    {
+        m_slots[node.slot] = node.next;
+    }
+    if (node.next != NONE)
+    {
+        m_nodes[node.next].previous = node.previous;
+    }
+
+    if (m_slots[node.slot] == NONE)
+    {
+        m_occupied[node.slot / SLOTS] &= ~(uint64_t(1) << (node.slot % SLOTS));
+    }
+    node.slot = NONE;
+    node.previous = NONE;
+    node.next = NONE;
+    m_scheduled--;
+}
+
+void TimerWheel::Release(int32_t index)
+{
+    Node& node = m_nodes[index];
+    node.alive = false;
+    node.generation++;
+    node.callback = nullptr;
+    m_free.push_back(index);
+}
+
+void TimerWheel::Cascade(int level)
+{
+    const int32_t slot = level * SLOTS + static_cast<int32_t>((m_current_tick >> (level * LEVEL_BITS)) & SLOT_MASK);
+    int32_t index = m_slots[slot];
+    while (index != NONE)
+    {
+        const int32_t next = m_nodes[index].next;
+        Unlink(index);
+        if (m_nodes[index].deadline_tick <= m_current_tick)
+        {
+            // Due right now: the current level 0 slot is processed after the cascade
+            Node& node = m_nodes[index];
+            const int32_t current_slot = static_cast<int32_t>(m_current_tick & SLOT_MASK);
+            node.slot = current_slot;
+            node.next = m_slots[current_slot];
+            if (node.next != NONE)
+            {
+                m_nodes[node.next].previous = index;
+            }
+            m_slots[current_slot] = index;
+            m_occupied[0] |= uint64_t(1) << current_slot;
+            m_scheduled++;
+        }
+        else
+        {
+            Link(index);
+        }
+        index = next;
+    }
+}
+
+void TimerWheel::Fire(int32_t index)
+{
+    const uint32_t generation = m_nodes[index].generation;
+
+    // The callback may schedule timers and grow m_nodes, so it is moved out while it runs
+    std::function<void()> callback = std::move(m_nodes[index].callback);
+    if (callback)
+    {
+        callback();
+    }
+
+    Node& node = m_nodes[index];
+    if (!node.alive || node.generation != generation)
+    {
+        return;  // Cancelled from its own callback
+    }
+    if (node.slot != NONE)
+    {
+        node.callback = std::move(callback);  // Rescheduled from its own callback
+        return;
+    }
+    Release(index);
+}
@@ -0,0 +1,336 @@
+#include "wire_format.h"
+#include "message_schema.h"
+#include <cstring>
+
+namespace wire
+{
+    static_assert(FIXED_DATA_HEADER_SIZE == schema::Data::SIZE && FIXED_ACK_SIZE == schema::DataAck::SIZE);
+
+    namespace
+    {
+        // Fields of compact data headers
+        constexpr uint8_t HAS_MESSAGE_ID = 1 << 0;
+        constexpr uint8_t MULTIPART = 1 << 1;
+        constexpr uint8_t HAS_FLAGS = 1 << 2;
+
+        // Client ids are slot | generation << 32 | shard << 56. Their token is two varints, the slot and shard then the
+        // generation, so a client of a table of a few hundred sessions whose slot was reused a few times takes 3 bytes.
+        uint64_t TokenSlot(uint64_t client_id) { return ((client_id & 0xFFFFFFFF) << 8) | (client_id >> 56); }
+        uint64_t TokenGeneration(uint64_t client_id) { return (client_id >> 32) & 0xFFFFFF; }
+        // The mode bits of stream ids are the four high ones, moved down under the counter
+        uint32_t ToStreamToken(uint32_t stream_id) { return (stream_id << 4) | (stream_id >> 28); }
+        uint32_t FromStreamToken(uint32_t token) { return (token >> 4) | (token << 28); }
+
+        size_t TokenSize(uint64_t client_id) { return VarintSize(TokenSlot(client_id)) + VarintSize(TokenGeneration(client_id)); }
+
+        template<typename T>
+        bool ReadVarint(std::span<const char> message, size_t& pos, T& value)
+        {
+            uint64_t wide;
+            if (!wire::ReadVarint(message, pos, wide, sizeof(T) * 8))
+            {
+                return false;
+            }
+            value = static_cast<T>(wide);
+            return true;
+        }
+
+        template<typename T>
+        bool ReadFixed(std::span<const char> message, size_t& pos, T& value)
+        {
+            if (message.size() < pos + sizeof(T))
+            {
+                return false;
+            }
+            memcpy(&value, &message[pos], sizeof(T));
+            pos += sizeof(T);
+            return true;
+        }
+
+        size_t WriteToken(uint64_t client_id, char* out)
+        {
+            const size_t size = WriteVarint(TokenSlot(client_id), out);
+            return size + WriteVarint(TokenGeneration(client_id), out + size);
+        }
+
+        template<typename T>
+        size_t WriteFixed(const T& value, char* out)
+        {
+            memcpy(out, &value, sizeof(T));
+            return sizeof(T);
+        }
+
+        // Token and stream id of compact messages, right after the type
+        bool ReadCompactIds(std::span<const char> message, size_t& pos, uint64_t& client_id, uint32_t& stream_id)
+        {
+            uint64_t slot;
+            uint64_t generation;
+            uint32_t stream_token;
+            if (!wire::ReadVarint(message, pos, slot, 40) || !wire::ReadVarint(message, pos, generation, 24) || !ReadVarint(message, pos, stream_token))
+            {
+                return false;
+            }
+            client_id = (slot >> 8) | (generation << 32) | ((slot & 0xFF) << 56);
+            stream_id = FromStreamToken(stream_token);
+            return true;
+        }
+    }
+
+    size_t VarintSize(uint64_t value)
+    {
+        size_t size = 1;
+        while (value >= 0x80)
+        {
+            value >>= 7;
+            size++;
+        }
+        return size;
+    }
+
+    // Little endian base 128, 7 bits a byte and the high bit set on every byte but the last
+    size_t WriteVarint(uint64_t value, char* out)
+    {
+        size_t size = 0;
+        while (value >= 0x80)
+        {
+            out[size++] = static_cast<char>((value & 0x7F) | 0x80);
+            value >>= 7;
+        }
+        out[size++] = static_cast<char>(value);
+        return size;
+    }
+
+    bool ReadVarint(std::span<const char> message, size_t& pos, uint64_t& value, int max_bits)
+    {
+        value = 0;
+        for (int shift = 0; shift < max_bits; shift += 7)
+        {
+            if (pos >= message.size())
+            {
+                return false;
+            }
+            const uint8_t byte = static_cast<uint8_t>(message[pos++]);
+            value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+            if (!(byte & 0x80))
+            {
+                return max_bits == 64 || value >> max_bits == 0;
+            }
+        }
+        return false;
+    }
+
+    size_t MaxDataHeaderSize(uint8_t version, uint64_t client_id, uint32_t stream_id)
+    {
+        if (version < VERSION_COMPACT)
+        {
+            return FIXED_DATA_HEADER_SIZE;
+        }
+        return MAX_DATA_HEADER_SIZE - 10 - 5 + TokenSize(client_id) + VarintSize(ToStreamToken(stream_id));
+    }
+
+    size_t WriteDataHeader(uint8_t version, const DataHeader& header, bool needs_message_id, size_t payload_size,
+        std::span<char, MAX_DATA_HEADER_SIZE> out)
+    {
+        char* data = out.data();
+        size_t pos = 0;
+        if (version < VERSION_COMPACT)
+        {
+            using Layout = schema::Data;
+            schema::Writer<Layout>(out.first<Layout::SIZE>(), static_cast<uint16_t>(payload_size + Layout::SIZE))
+                .Set<Layout::ClientId>(header.client_id)
+                .Set<Layout::StreamId>(header.stream_id)
+                .Set<Layout::DataSize>(static_cast<uint16_t>(payload_size))
+                .Set<Layout::Flags>(header.flags)
+                .Set<Layout::PartId>(header.part_id)
+                .Set<Layout::PartTotal>(header.part_total)
+                .Set<Layout::MessageId>(header.message_id)
+                .Set<Layout::PartSize>(header.part_size);
+            return Layout::SIZE;
+        }
+
+        const bool multipart = header.part_total > 1;
+        uint8_t fields = 0;
+        // Multi-part messages are reassembled by id, single part ones only need it to be acknowledged
+        if (needs_message_id || multipart) fields |= HAS_MESSAGE_ID;
+        if (multipart) fields |= MULTIPART;
+        if (header.flags) fields |= HAS_FLAGS;
+
+        data[pos++] = DATA_COMPACT;
+        pos += WriteToken(header.client_id, data + pos);
+        pos += WriteVarint(ToStreamToken(header.stream_id), data + pos);
+        data[pos++] = static_cast<char>(fields);
+        // Message ids wrap around the whole 16 bit space, a varint would average more than their 2 bytes
+        if (fields & HAS_MESSAGE_ID) pos += WriteFixed(header.message_id, data + pos);
+        if (fields & MULTIPART)
+        {
+            pos += WriteVarint(header.part_id, data + pos);
+            pos += WriteVarint(header.part_total, data + pos);
+            pos += WriteVarint(header.part_size, data + pos);
+        }
+        if (fields & HAS_FLAGS) pos += WriteFixed(header.flags, data + pos);
+        return pos;
+    }
+
+    size_t WriteAck(uint8_t version, const AckHeader& ack, std::span<char, MAX_ACK_SIZE> out)
+    {
+        char* data = out.data();
+        size_t pos = 0;
+        if (version < VERSION_COMPACT)
+        {
+            using Layout = schema::DataAck;
+            schema::Writer<Layout>(out.first<Layout::SIZE>())
+                .Set<Layout::ClientId>(ack.client_id)
+                .Set<Layout::StreamId>(ack.stream_id)
+                .Set<Layout::MessageId>(ack.message_id)
+                .Set<Layout::PartId>(ack.part_id)
+                .Set<Layout::ReceiveBase>(ack.receive_base)
+                .Set<Layout::ReceiveSack>(ack.receive_sack);
+            return Layout::SIZE;
+        }
+
+        data[pos++] = DATA_ACK_COMPACT;
+        pos += WriteToken(ack.client_id, data + pos);
+        pos += WriteVarint(ToStreamToken(ack.stream_id), data + pos);
+        pos += WriteFixed(ack.message_id, data + pos);
+        pos += WriteVarint(ack.part_id, data + pos);
+        pos += WriteFixed(ack.receive_base, data + pos);
+        // Mostly empty or only its low bits set while losses are rare
+        pos += WriteVarint(ack.receive_sack, data + pos);
+        return pos;
+    }
+
+    bool ReadDataHeader(std::span<const char> message, DataHeader& header, std::span<const char>& payload)
+    {
+        if (message.empty())
+        {
+            return false;
+        }
+        size_t pos = 1;
+        if (message[0] == DATA)
+        {
+            using Layout = schema::Data;
+            const auto view = schema::View<Layout>::Of(message);
+            if (!view)
+            {
+                return false;
+            }
+            const uint16_t data_size = view->Get<Layout::DataSize>();
+            if (view->Payload().size() < data_size)
+            {
+                return false;
+            }
+            header.client_id = view->Get<Layout::ClientId>();
+            header.stream_id = view->Get<Layout::StreamId>();
+            header.flags = view->Get<Layout::Flags>();
+            header.part_id = view->Get<Layout::PartId>();
+            header.part_total = view->Get<Layout::PartTotal>();
+            header.message_id = view->Get<Layout::MessageId>();
+            header.part_size = view->Get<Layout::PartSize>();
+            payload = view->Payload().first(data_size);
+            return true;
+        }
+        if (message[0] != DATA_COMPACT || !ReadCompactIds(message, pos, header.client_id, header.stream_id))
+        {
+            return false;
+        }
+
+        uint8_t fields;
+        if (!ReadFixed(message, pos, fields))
+        {
+            return false;
+        }
+        header.message_id = 0;
+        header.part_id = 0;
+        header.part_total = 1;
+        header.flags = 0;
+        if ((fields & HAS_MESSAGE_ID) && !ReadFixed(message, pos, header.message_id))
+        {
+            return false;
+        }
+        if ((fields & MULTIPART) && (!ReadVarint(message, pos, header.part_id) || !ReadVarint(message, pos, header.part_total)
+            || !ReadVarint(message, pos, header.part_size)))
+        {
+            return false;
+        }
+        if ((fields & HAS_FLAGS) && !ReadFixed(message, pos, header.flags))
+        {
+            return false;
+        }
+        payload = message.subspan(pos);
+        if (!(fields & MULTIPART))
+        {
+            header.part_size = static_cast<uint16_t>(payload.size());
+        }
+        return true;
+    }
+
+    bool ReadAck(std::span<const char> message, AckHeader& ack)
+    {
+        if (message.empty())
+        {
+            return false;
+        }
+        size_t pos = 1;
+        if (message[0] == DATA_ACK)
+        {
+            using Layout = schema::DataAck;
+            const auto view = schema::View<Layout>::Of(message);
+            if (!view)
+            {
+                return false;
+            }
+            ack.client_id = view->Get<Layout::ClientId>();
+            ack.stream_id = view->Get<Layout::StreamId>();
+            ack.message_id = view->Get<Layout::MessageId>();
+            ack.part_id = view->Get<Layout::PartId>();
+            ack.receive_base = view->Get<Layout::ReceiveBase>();
+            ack.receive_sack = view->Get<Layout::ReceiveSack>();
+            return true;
+        }
+        return message[0] == DATA_ACK_COMPACT && ReadCompactIds(message, pos, ack.client_id, ack.stream_id)
+            && ReadFixed(message, pos, ack.message_id) && ReadVarint(message, pos, ack.part_id)
+            && ReadFixed(message, pos, ack.receive_base) && ReadVarint(message, pos, ack.receive_sack);
+    }
+
+    bool ReadClientId(std::span<const char> message, uint64_t& client_id)
+    {
+        if (message.empty())
+        {
+            return false;
+        }
+        if (message[0] == DATA_COMPACT || message[0] == DATA_ACK_COMPACT)
+        {
+            size_t pos = 1;
+            uint32_t stream_id;
+            return ReadCompactIds(message, pos, client_id, stream_id);
+        }
+        const auto view = schema::View<schema::ClientHeader>::Of(message);
+        if (!view)
+        {
+            return false;
+        }
+        client_id = view->Get<schema::ClientHeader::ClientId>();
+        return true;
+    }
+
+    bool ReadStreamId(std::span<const char> message, uint32_t& stream_id)
+    {
+        if (message.empty())
+        {
+            return false;
+        }
+        if (message[0] == DATA_COMPACT || message[0] == DATA_ACK_COMPACT)
+        {
+            size_t pos = 1;
+            uint64_t client_id;
+            return ReadCompactIds(message, pos, client_id, stream_id);
+        }
+        const auto view = schema::View<schema::StreamHeader>::Of(message);
+        if (!view)
+        {
+            return false;
+        }
+        stream_id = view->Get<schema::StreamHeader::StreamId>();
+        return true;
+    }
+}
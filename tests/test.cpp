@@ -1,17 +1,73 @@
 #include <string>
 #include <array>
 #include <span>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <random>
 
 #include <catch2/catch_test_macros.hpp>
 
 #include "falcon.h"
 #include "falcon_client.h"
 #include "falcon_server.h"
+#include "timer_wheel.h"
+#include "reassembler.h"
+#include "part_bitmap.h"
+#include "mpsc_queue.h"
+#include "session_table.h"
+#include "send_scheduler.h"
+#include "wire_format.h"
+#include "message_schema.h"
+#include "snapshot_delta.h"
+#include "lz_codec.h"
+#include "message_type.h"
 
 #include "spdlog/spdlog.h"
 
 using namespace std::chrono_literals;
 
+namespace
+{
+    std::atomic<size_t> allocation_count = 0;
+
+    // Sends are queued for the listener thread, so it gets a moment to hand them to the stream before waiting for their acknowledgements
+    void WaitForAcknowledgements(const Stream& stream, std::chrono::steady_clock::duration timeout)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        std::this_thread::sleep_for(100ms);
+        while (stream.GetUnacknowledgedCount() > 0 && std::chrono::steady_clock::now() - start < timeout)
+        {
+            std::this_thread::sleep_for(10ms);
+        }
+    }
+}
+
+void* operator new(std::size_t size)
+{
+    allocation_count++;
+    if (void* memory = std::malloc(size == 0 ? 1 : size))
+    {
+        return memory;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* memory) noexcept
+{
+    std::free(memory);
+}
+
+void operator delete(void* memory, std::size_t) noexcept
+{
+    std::free(memory);
+}
+
 TEST_CASE("Can Send", "[falcon]")
 {
     FalconServer server;
@@ -40,6 +96,159 @@ TEST_CASE("Can Receive", "[falcon]")
     REQUIRE(byte_received > 0);
 }
 
+class RawSocket : public Falcon
+{
+public:
+    void Bind(uint16_t port) { CreateServer(port); }
+    void BatchSends() { EnableSendBatching(); }
+    std::span<const Datagram> Poll(int timeout_ms) { return ReceiveBatch(timeout_ms); }
+};
+
+// Sends on a stream directly, without the client or server that normally own it
+struct StreamTestAccess
+{
+    static void SendData(Stream& stream, std::span<const char> data) { stream.SendData(data); }
+};
+
+TEST_CASE("Can Receive a batch", "[falcon]")
+{
+    RawSocket receiver;
+    receiver.Bind(5556);
+    RawSocket sender;
+    sender.Bind(5557);
+
+    for (int i = 0; i < 5; i++)
+    {
+        sender.SendTo("127.0.0.1", 5556, "hello");
+    }
+
+    std::vector<std::array<char, 65535>> buffers(Falcon::MAX_BATCH_SIZE);
+    std::array<Datagram, Falcon::MAX_BATCH_SIZE> datagrams;
+    for (size_t i = 0; i < Falcon::MAX_BATCH_SIZE; i++)
+    {
+        datagrams[i].buffer = buffers[i];
+    }
+
+    int received = 0;
+    for (int attempt = 0; attempt < 10 && received < 5; attempt++)
+    {
+        received += receiver.ReceiveFromBatch(std::span(datagrams).subspan(received));
+    }
+    REQUIRE(received == 5);
+    REQUIRE(datagrams[4].size == 6);
+    REQUIRE(datagrams[4].from == Endpoint::Resolve("127.0.0.1", 5557));
+    REQUIRE(datagrams[4].from.ToString() == "127.0.0.1:5557");
+}
+
+TEST_CASE("Batched sends wait for flush", "[falcon]")
+{
+    RawSocket receiver;
+    receiver.Bind(5556);
+    RawSocket sender;
+    sender.Bind(5557);
+    sender.BatchSends();
+
+    for (int i = 0; i < 3; i++)
+    {
+        sender.SendTo("127.0.0.1", 5556, "hello");
+    }
+
+    std::string from_ip;
+    std::array<char, 65535> buffer;
+    REQUIRE(receiver.ReceiveFrom(from_ip, buffer) <= 0);
+
+    REQUIRE(sender.FlushSendQueue() == 3);
+    REQUIRE(receiver.ReceiveFrom(from_ip, buffer) > 0);
+}
+
+TEST_CASE("Gathered parts arrive as one datagram", "[falcon]")
+{
+    RawSocket receiver;
+    receiver.Bind(5556);
+    RawSocket sender;
+    sender.Bind(5557);
+
+    std::string header("head");
+    std::string payload(60000, 'x');
+    const std::span<const char> parts[] = { header, payload };
+    REQUIRE(sender.SendTo(Endpoint::Resolve("127.0.0.1", 5556), parts) == 60004);
+
+    std::string from_ip;
+    std::array<char, 65535> buffer;
+    REQUIRE(receiver.ReceiveFrom(from_ip, buffer) == 60004);
+    REQUIRE(std::string_view(buffer.data(), 4) == "head");
+    REQUIRE(buffer[60003] == 'x');
+}
+
+TEST_CASE("Coalesced sends share one datagram", "[falcon]")
+{
+    RawSocket receiver;
+    receiver.Bind(5556);
+    RawSocket sender;
+    sender.Bind(5557);
+    sender.SetCoalescingWindow(50ms);
+    const Endpoint receiver_endpoint = Endpoint::Resolve("127.0.0.1", 5556);
+
+    for (int i = 0; i < 10; i++)
+    {
+        sender.SendTo(receiver_endpoint, "message " + std::to_string(i));
+    }
+    std::string from_ip;
+    std::array<char, 65535> buffer;
+    REQUIRE(receiver.ReceiveFrom(from_ip, buffer) <= 0);
+
+    sender.Flush();
+    REQUIRE(receiver.ReceiveFrom(from_ip, buffer) == 3 + 10 * (2 + 9));
+    REQUIRE(buffer[0] == BATCH);
+
+    // The receiving side unpacks them in order
+    for (int i = 0; i < 3; i++)
+    {
+        sender.SendTo(receiver_endpoint, "message " + std::to_string(i));
+    }
+    sender.Flush();
+    std::vector<std::string> messages;
+    for (int attempt = 0; attempt < 10 && messages.size() < 3; attempt++)
+    {
+        for (const Datagram& datagram : receiver.Poll(100))
+        {
+            messages.emplace_back(datagram.buffer.data(), datagram.size);
+        }
+    }
+    REQUIRE(messages == std::vector<std::string>{ "message 0", "message 1", "message 2" });
+
+    // A lone message goes out as is
+    sender.SendTo(receiver_endpoint, std::string("alone"));
+    sender.Flush();
+    REQUIRE(receiver.ReceiveFrom(from_ip, buffer) == 5);
+}
+
+TEST_CASE("Coalesced connections carry data, acknowledgements and pings", "[falcon]")
+{
+    FalconServer server;
+    server.SetCoalescingWindow(5ms);
+    server.Listen(5555);
+
+    FalconClient client;
+    client.SetCoalescingWindow(5ms);
+    client.ConnectTo("127.0.0.1", 5555);
+    std::this_thread::sleep_for(300ms);
+    REQUIRE(client.IsConnected());
+
+    auto stream = client.CreateStream(true);
+    for (int i = 0; i < 20; i++)
+    {
+        client.SendData("tick " + std::to_string(i), stream->GetStreamID());
+    }
+    client.Flush();
+
+    // Longer than the connection timeout, kept alive by coalesced pings
+    std::this_thread::sleep_for(1200ms);
+    REQUIRE(client.IsConnected());
+    REQUIRE(stream->GetUnacknowledgedCount() == 0);
+    REQUIRE(server.GetStream(client.GetId(), stream->GetStreamID())->getLastData() == "tick 19");
+}
+
 TEST_CASE( "Connection failed", "[falcon client]" ) {
     FalconClient client;
     client.ConnectTo("127.0.0.1", 5555);
@@ -81,6 +290,16 @@ TEST_CASE("Disconnection from server death", "[falcon client]") {
     REQUIRE(client.IsConnected() == false);
 }
 
+TEST_CASE("Shutdown wakes the listener", "[falcon server]") {
+    auto server = std::make_unique<FalconServer>();
+    server->Listen(5555);
+    std::this_thread::sleep_for(100ms);
+
+    const auto start = std::chrono::steady_clock::now();
+    server.reset();
+    REQUIRE(std::chrono::steady_clock::now() - start < 50ms);
+}
+
 TEST_CASE("Client count updated", "[falcon server]") {
     FalconServer server;
     server.Listen(5555);
@@ -92,6 +311,39 @@ TEST_CASE("Client count updated", "[falcon server]") {
     REQUIRE(server.GetActiveClientCount() == 1);
 }
 
+TEST_CASE("Sharded server serves clients from every shard", "[falcon server]") {
+    FalconServer server;
+    std::atomic<int> connected = 0;
+    server.m_on_client_connect = [&connected](uint64_t) { connected++; };
+    server.Listen(5555, 4);
+
+    std::vector<std::unique_ptr<FalconClient>> clients;
+    for (int i = 0; i < 16; i++)
+    {
+        clients.push_back(std::make_unique<FalconClient>());
+        clients.back()->ConnectTo("127.0.0.1", 5555);
+    }
+    std::this_thread::sleep_for(200ms);
+
+    REQUIRE(server.GetActiveClientCount() == 16);
+    REQUIRE(connected == 16);
+
+    std::vector<std::shared_ptr<Stream>> streams;
+    for (const std::unique_ptr<FalconClient>& client : clients)
+    {
+        REQUIRE(client->IsConnected());
+        streams.push_back(server.CreateStream(client->GetId(), false));
+        REQUIRE(streams.back() != nullptr);
+        REQUIRE(server.SendData(std::string_view("hello"), client->GetId(), streams.back()->GetStreamID()));
+    }
+    std::this_thread::sleep_for(200ms);
+
+    for (size_t i = 0; i < clients.size(); i++)
+    {
+        REQUIRE(clients[i]->GetStream(streams[i]->GetStreamID()) != nullptr);
+    }
+}
+
 TEST_CASE("Disconnection from client death", "[falcon server]") {
     FalconServer server;
     {
@@ -140,8 +392,8 @@ TEST_CASE("Can create a stream", "[falcon client]")
     auto streamReliable = client.CreateStream(true);
     auto streamUnreliable = client.CreateStream(false);
 
-    REQUIRE(streamReliable->GetStreamID() >= (1 << 31));
-    REQUIRE(streamUnreliable->GetStreamID() < (1 << 31));
+    REQUIRE(streamReliable->GetStreamID() >= (1u << 31));
+    REQUIRE(streamUnreliable->GetStreamID() < (1u << 31));
 }
 
 TEST_CASE("Can create a stream", "[falcon server]")
@@ -157,8 +409,8 @@ TEST_CASE("Can create a stream", "[falcon server]")
     auto streamReliable = server.CreateStream(0, true);
     auto streamUnreliable = server.CreateStream(0, false);
 
-    REQUIRE(streamReliable->GetStreamID() >= (1 << 31));
-    REQUIRE(streamUnreliable->GetStreamID() < (1 << 31));
+    REQUIRE(streamReliable->GetStreamID() >= (1u << 31));
+    REQUIRE(streamUnreliable->GetStreamID() < (1u << 31));
 }
 
 
@@ -166,6 +418,10 @@ TEST_CASE("Can create a stream", "[falcon server]")
 TEST_CASE("Stream Acknowledge registers", "[falcon client]")
 {
     FalconServer server;
+    // Holds the acknowledgement back while the client listener registers the queued data
+    NetworkConditions conditions;
+    conditions.latency = 200ms;
+    server.SimulateNetworkConditions(conditions);
 
     server.Listen(5555);
 
@@ -175,12 +431,13 @@ TEST_CASE("Stream Acknowledge registers", "[falcon client]")
 
     auto stream = client.CreateStream(true);
     std::this_thread::sleep_for(200ms);
-    client.SendData("Helo", stream->GetStreamID());
-    REQUIRE(client.GetStreamsAck().size() == 1);
+    REQUIRE(client.SendData("Helo", stream->GetStreamID()));
+    std::this_thread::sleep_for(50ms);
+    REQUIRE(client.GetStreamsAwaitingAck() == 1);
 
     std::this_thread::sleep_for(800ms);
 
-    REQUIRE(client.GetStreamsAck().size() == 0);
+    REQUIRE(client.GetStreamsAwaitingAck() == 0);
 }
 
 TEST_CASE("Stream Acknowledge registers", "[falcon server]")
@@ -190,65 +447,1963 @@ TEST_CASE("Stream Acknowledge registers", "[falcon server]")
     server.Listen(5555);
 
     FalconClient client;
+    NetworkConditions conditions;
+    conditions.latency = 200ms;
+    client.SimulateNetworkConditions(conditions);
     client.ConnectTo("127.0.0.1", 5555);
     std::this_thread::sleep_for(500ms);
 
     auto stream = server.CreateStream(0, true);
     std::this_thread::sleep_for(200ms);
-    server.SendData("Helo", client.GetId(), stream->GetStreamID());
+    REQUIRE(server.SendData("Helo", client.GetId(), stream->GetStreamID()));
+    std::this_thread::sleep_for(50ms);
 
-    REQUIRE(server.GetStreamsAck().size() == 1);
+    REQUIRE(server.GetStreamsAwaitingAck(client.GetId()) == 1);
 
     std::this_thread::sleep_for(800ms);
 
-    REQUIRE(server.GetStreamsAck().size() == 0);
+    REQUIRE(server.GetStreamsAwaitingAck(client.GetId()) == 0);
 }
 
-TEST_CASE("Can close stream", "[falcon]")
+TEST_CASE("Command queue keeps the order of each producer", "[mpsc queue]")
 {
-    FalconServer server;
+    constexpr int producer_count = 4;
+    constexpr uint32_t per_producer = 20000;
+    MpscQueue<uint64_t> queue(1000);
+    REQUIRE(queue.Capacity() == 1024);
+
+    std::vector<std::thread> producers;
+    for (int producer = 0; producer < producer_count; producer++)
+    {
+        producers.emplace_back([&queue, producer]() {
+            for (uint32_t i = 0; i < per_producer; i++)
+            {
+                // Full queue: the producer decides what to do, here it retries
+                while (!queue.TryPush((static_cast<uint64_t>(producer) << 32) | i))
+                {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+
+    std::array<uint32_t, producer_count> next{};
+    uint32_t received = 0;
+    uint32_t out_of_order = 0;
+    uint64_t value;
+    while (received < producer_count * per_producer)
+    {
+        if (!queue.TryPop(value))
+        {
+            std::this_thread::yield();
+            continue;
+        }
+        const uint32_t producer = static_cast<uint32_t>(value >> 32) % producer_count;
+        if (static_cast<uint32_t>(value) != next[producer])
+        {
+            out_of_order++;
+        }
+        next[producer]++;
+        received++;
+    }
+    for (std::thread& producer : producers)
+    {
+        producer.join();
+    }
+    REQUIRE(out_of_order == 0);
+    REQUIRE_FALSE(queue.TryPop(value));
+}
 
+TEST_CASE("Streams can be used from many threads at once", "[falcon]")
+{
+    FalconServer server;
     server.Listen(5555);
 
     FalconClient client;
     client.ConnectTo("127.0.0.1", 5555);
-    std::this_thread::sleep_for(500ms);
-    auto stream = client.CreateStream(true);
-    auto streamId = stream->GetStreamID();
-    client.SendData("helo", streamId);
-    std::this_thread::sleep_for(500ms);
+    std::this_thread::sleep_for(300ms);
+    REQUIRE(client.IsConnected());
+
+    constexpr int thread_count = 8;
+    constexpr int message_count = 200;
+    std::vector<std::shared_ptr<Stream>> streams(thread_count);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < thread_count; t++)
+    {
+        threads.emplace_back([&, t]() {
+            // Both calls fail while the other threads keep the queue full
+            std::shared_ptr<Stream> stream;
+            while (!(stream = client.CreateStream(true)))
+            {
+                std::this_thread::yield();
+            }
+            const std::string msg = "thread " + std::to_string(t);
+            for (int i = 0; i < message_count; i++)
+            {
+                while (!client.SendData(msg, stream->GetStreamID()))
+                {
+                    std::this_thread::yield();
+                }
+            }
+            streams[t] = std::move(stream);
+        });
+    }
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
 
-    auto& serverStreams = server.GetStreams();
-    REQUIRE(serverStreams.contains(client.GetId()));
+    for (const std::shared_ptr<Stream>& stream : streams)
+    {
+        WaitForAcknowledgements(*stream, 5s);
+        REQUIRE(stream->GetUnacknowledgedCount() == 0);
+    }
+    // Every stream got its own id
+    std::vector<uint32_t> ids;
+    for (const std::shared_ptr<Stream>& stream : streams)
+    {
+        ids.push_back(stream->GetStreamID());
+    }
+    std::sort(ids.begin(), ids.end());
+    REQUIRE(std::adjacent_find(ids.begin(), ids.end()) == ids.end());
+}
 
-    REQUIRE(serverStreams.at(client.GetId()).contains(streamId));
-    auto serverStream = serverStreams.at(client.GetId()).at(streamId);
-    
-    server.CloseStream(*serverStream);
-    std::this_thread::sleep_for(500ms);
+namespace
+{
+    // Hands every datagram waiting on the socket to handler, until none arrives for a few milliseconds
+    template<typename Handler>
+    int Drain(RawSocket& socket, Handler&& handler)
+    {
+        int count = 0;
+        for (std::span<const Datagram> datagrams = socket.Poll(10); !datagrams.empty(); datagrams = socket.Poll(10))
+        {
+            for (const Datagram& datagram : datagrams)
+            {
+                handler(std::span<const char>(datagram.buffer.first(datagram.size)), count++);
+            }
+        }
+        return count;
+    }
+}
+
+TEST_CASE("Reliable streams resend only the lost messages", "[stream]")
+{
+    RawSocket sender_socket;
+    sender_socket.Bind(5556);
+    RawSocket receiver_socket;
+    receiver_socket.Bind(5557);
+    Stream sender(Stream::RELIABLE_STREAM_BIT, 0, Endpoint::Resolve("127.0.0.1", 5557), &sender_socket);
+    Stream receiver(Stream::RELIABLE_STREAM_BIT, 0, Endpoint::Resolve("127.0.0.1", 5556), &receiver_socket);
+
+    for (int i = 0; i < 10; i++)
+    {
+        StreamTestAccess::SendData(sender, "message " + std::to_string(i));
+    }
 
-    REQUIRE(client.GetStreams().contains(client.GetId()) == false);
+    // Messages 1, 4 and 7 are lost
+    Drain(receiver_socket, [&](std::span<const char> data, int index) {
+        if (index % 3 != 1)
+        {
+            receiver.OnDataReceived(data);
+        }
+    });
+    Drain(sender_socket, [&](std::span<const char> data, int) { sender.OnAckReceived(data); });
+    REQUIRE(sender.GetUnacknowledgedCount() == 3);
+
+    REQUIRE(sender.ResendUnacknowledged(0ms));
+    const int resent = Drain(receiver_socket, [&](std::span<const char> data, int) { receiver.OnDataReceived(data); });
+    REQUIRE(resent == 3);
+    REQUIRE(receiver.getLastData() == "message 7");
+
+    Drain(sender_socket, [&](std::span<const char> data, int) { sender.OnAckReceived(data); });
+    REQUIRE(sender.GetUnacknowledgedCount() == 0);
+    REQUIRE_FALSE(sender.ResendUnacknowledged(0ms));
 }
 
-TEST_CASE("Can receive data", "[falcon]")
+TEST_CASE("Reliable streams hold messages past the window", "[stream]")
+{
+    RawSocket sender_socket;
+    sender_socket.Bind(5556);
+    RawSocket receiver_socket;
+    receiver_socket.Bind(5557);
+    Stream sender(Stream::RELIABLE_STREAM_BIT, 0, Endpoint::Resolve("127.0.0.1", 5557), &sender_socket);
+    Stream receiver(Stream::RELIABLE_STREAM_BIT, 0, Endpoint::Resolve("127.0.0.1", 5556), &receiver_socket);
+
+    constexpr int message_count = Stream::WINDOW_SIZE + 8;
+    for (int i = 0; i < message_count; i++)
+    {
+        StreamTestAccess::SendData(sender, "message " + std::to_string(i));
+    }
+    REQUIRE(Drain(receiver_socket, [&](std::span<const char> data, int) { receiver.OnDataReceived(data); }) == Stream::WINDOW_SIZE);
+
+    // The acknowledgements slide the window and release the held messages
+    Drain(sender_socket, [&](std::span<const char> data, int) { sender.OnAckReceived(data); });
+    REQUIRE(Drain(receiver_socket, [&](std::span<const char> data, int) { receiver.OnDataReceived(data); }) == 8);
+    REQUIRE(receiver.getLastData() == "message " + std::to_string(message_count - 1));
+
+    Drain(sender_socket, [&](std::span<const char> data, int) { sender.OnAckReceived(data); });
+    REQUIRE(sender.GetUnacknowledgedCount() == 0);
+}
+
+TEST_CASE("Received messages wait in the stream until polled", "[stream]")
+{
+    RawSocket sender_socket;
+    sender_socket.Bind(5556);
+    RawSocket receiver_socket;
+    receiver_socket.Bind(5557);
+    Stream sender(0, 0, Endpoint::Resolve("127.0.0.1", 5557), &sender_socket);
+    Stream receiver(0, 0, Endpoint::Resolve("127.0.0.1", 5556), &receiver_socket);
+
+    const size_t message_count = Stream::RECEIVE_QUEUE_SIZE + 10;
+    for (size_t i = 0; i < message_count; i++)
+    {
+        StreamTestAccess::SendData(sender, "message " + std::to_string(i));
+        // Leaves the socket buffer room for every datagram
+        if (i % 64 == 63)
+        {
+            Drain(receiver_socket, [&](std::span<const char> data, int) { receiver.OnDataReceived(data); });
+        }
+    }
+    Drain(receiver_socket, [&](std::span<const char> data, int) { receiver.OnDataReceived(data); });
+    REQUIRE(receiver.GetDroppedMessageCount() == 10);
+
+    std::array<Message, 100> messages;
+    size_t received = 0;
+    for (size_t count = receiver.PollMessages(messages); count > 0; count = receiver.PollMessages(messages))
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            REQUIRE(std::string(messages[i].data.begin(), messages[i].data.end()) == "message " + std::to_string(received++));
+        }
+    }
+    REQUIRE(received == Stream::RECEIVE_QUEUE_SIZE);
+
+    // A handler takes over, the executor decides where it runs
+    std::vector<std::function<void()>> tasks;
+    std::vector<std::string> handled;
+    receiver.SetMessageHandler([&](const Message& message) { handled.emplace_back(message.data.begin(), message.data.end()); },
+        [&](std::function<void()> task) { tasks.push_back(std::move(task)); });
+    StreamTestAccess::SendData(sender, std::string("deferred"));
+    Drain(receiver_socket, [&](std::span<const char> data, int) { receiver.OnDataReceived(data); });
+    REQUIRE(handled.empty());
+    REQUIRE(tasks.size() == 1);
+    tasks[0]();
+    REQUIRE(handled == std::vector<std::string>{ "deferred" });
+
+    receiver.SetMessageHandler([&](const Message& message) { handled.emplace_back(message.data.begin(), message.data.end()); });
+    StreamTestAccess::SendData(sender, std::string("direct"));
+    Drain(receiver_socket, [&](std::span<const char> data, int) { receiver.OnDataReceived(data); });
+    REQUIRE(handled.back() == "direct");
+    REQUIRE(receiver.PollMessages(messages) == 0);
+}
+
+TEST_CASE("Round trip time estimation", "[rtt]")
+{
+    RttEstimator rtt(500ms, 10ms, 1000ms);
+    REQUIRE_FALSE(rtt.HasSample());
+    REQUIRE(rtt.GetRto() == 500ms);
+
+    rtt.AddSample(20ms);
+    REQUIRE(rtt.GetRtt() == 20ms);
+    REQUIRE(rtt.GetRttVariance() == 10ms);
+    REQUIRE(rtt.GetRto() == 60ms);
+
+    // A stable link converges towards its round trip time
+    for (int i = 0; i < 50; i++)
+    {
+        rtt.AddSample(20ms);
+    }
+    REQUIRE(rtt.GetRtt() == 20ms);
+    REQUIRE(rtt.GetRto() < 25ms);
+    REQUIRE(rtt.GetRto() >= 21ms);
+
+    rtt.Backoff();
+    REQUIRE(rtt.GetRto() >= 42ms);
+    for (int i = 0; i < 10; i++)
+    {
+        rtt.Backoff();
+    }
+    REQUIRE(rtt.GetRto() == 1000ms);
+}
+
+namespace
+{
+    // Counts the datagrams of a type arriving on socket for duration, and remembers who sent the last one
+    int CountReceived(RawSocket& socket, MessageType type, std::chrono::milliseconds duration, Endpoint* from = nullptr)
+    {
+        int count = 0;
+        const auto end = std::chrono::steady_clock::now() + duration;
+        while (std::chrono::steady_clock::now() < end)
+        {
+            for (const Datagram& datagram : socket.Poll(5))
+            {
+                if (datagram.size > 0 && MessageType(datagram.buffer[0]) == type)
+                {
+                    count++;
+                    if (from != nullptr)
+                    {
+                        *from = datagram.from;
+                    }
+                }
+            }
+        }
+        return count;
+    }
+}
+
+TEST_CASE("Clients only ping over an idle link", "[falcon client]")
+{
+    // A third of the timeout by default, the windows below assume a shorter interval
+    REQUIRE(ConnectionSettings{}.GetPingInterval() == 333ms);
+    ConnectionSettings settings;
+    settings.ping_interval = 100ms;
+
+    // Plays the server by hand to see every datagram the client sends
+    RawSocket server;
+    server.Bind(5555);
+    FalconClient client;
+    client.SetConnectionSettings(settings);
+    client.ConnectTo("127.0.0.1", 5555);
+
+    Endpoint client_endpoint;
+    REQUIRE(CountReceived(server, CONNECT, 100ms, &client_endpoint) == 1);
+    constexpr uint16_t ack_size = 12;
+    std::array<char, ack_size> ack{};
+    ack[0] = CONNECT_ACK;
+    memcpy(&ack[1], &ack_size, sizeof(ack_size));
+    server.SendTo(client_endpoint, ack);
+    // The first check finds the link idle
+    REQUIRE(CountReceived(server, PING, 50ms) == 1);
+    REQUIRE(client.IsConnected());
+
+    // Data flowing to the server keeps the connection alive without pings
+    auto stream = client.CreateStream(false);
+    int pings = 0;
+    for (int i = 0; i < 40; i++)
+    {
+        client.SendData(std::string("data"), stream->GetStreamID());
+        pings += CountReceived(server, PING, 10ms);
+    }
+    REQUIRE(pings == 0);
+
+    // Then one per interval once it stops
+    const int idle_pings = CountReceived(server, PING, 450ms);
+    REQUIRE(idle_pings >= 3);
+    REQUIRE(idle_pings <= 5);
+}
+
+TEST_CASE("Servers ping idle clients", "[falcon server]")
+{
+    ConnectionSettings settings;
+    settings.ping_interval = 100ms;
+    FalconServer server;
+    server.SetConnectionSettings(settings);
+    server.Listen(5555);
+
+    // Plays the client by hand to see every datagram the server sends
+    RawSocket client;
+    client.Bind(5556);
+    constexpr uint16_t connect_size = 4;
+    std::array<char, connect_size> connect{};
+    connect[0] = CONNECT;
+    memcpy(&connect[1], &connect_size, sizeof(connect_size));
+    client.SendTo("127.0.0.1", 5555, connect);
+    REQUIRE(CountReceived(client, CONNECT_ACK, 50ms) == 1);
+
+    const int idle_pings = CountReceived(client, PING, 450ms);
+    REQUIRE(idle_pings >= 3);
+    REQUIRE(idle_pings <= 5);
+
+    auto stream = server.CreateStream(0, false);
+    REQUIRE(stream != nullptr);
+    int pings = 0;
+    for (int i = 0; i < 40; i++)
+    {
+        server.SendData(std::string("data"), 0, stream->GetStreamID());
+        pings += CountReceived(client, PING, 10ms);
+    }
+    // At most one before the stream got registered
+    REQUIRE(pings <= 1);
+
+    // A client pinging on its own gets pongs, which keep the link alive, and no pings
+    schema::Message<schema::Ping> ping;
+    ping.Set<schema::Ping::ClientId>(0).Set<schema::Ping::PingId>(0).Set<schema::Ping::Time>(std::chrono::steady_clock::now());
+    int pongs = 0;
+    pings = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        client.SendTo("127.0.0.1", 5555, ping.Bytes());
+        const auto end = std::chrono::steady_clock::now() + 50ms;
+        while (std::chrono::steady_clock::now() < end)
+        {
+            for (const Datagram& datagram : client.Poll(5))
+            {
+                pongs += datagram.size > 0 && MessageType(datagram.buffer[0]) == PONG;
+                pings += datagram.size > 0 && MessageType(datagram.buffer[0]) == PING;
+            }
+        }
+    }
+    REQUIRE(pongs == 8);
+    REQUIRE(pings == 0);
+}
+
+TEST_CASE("Wire version negotiated at CONNECT", "[falcon server]")
 {
     FalconServer server;
+    server.Listen(5555);
+
+    // Plays a client of each version by hand to see the layout the server sends
+    for (const uint8_t version : { wire::VERSION_FIXED, wire::VERSION_COMPACT })
+    {
+        RawSocket client;
+        client.Bind(5556);
+        constexpr uint16_t connect_size = 4;
+        std::array<char, connect_size> connect{};
+        connect[0] = CONNECT;
+        memcpy(&connect[1], &connect_size, sizeof(connect_size));
+        connect[3] = static_cast<char>(version);
+        client.SendTo("127.0.0.1", 5555, connect);
+
+        uint64_t client_id = 0;
+        uint8_t server_version = 0;
+        const auto end = std::chrono::steady_clock::now() + 100ms;
+        while (client_id == 0 && std::chrono::steady_clock::now() < end)
+        {
+            for (const Datagram& datagram : client.Poll(5))
+            {
+                if (datagram.size >= 12 && MessageType(datagram.buffer[0]) == CONNECT_ACK)
+                {
+                    memcpy(&client_id, &datagram.buffer[3], sizeof(client_id));
+                    server_version = static_cast<uint8_t>(datagram.buffer[11]);
+                }
+            }
+        }
+        REQUIRE(server_version == server.m_version);
+
+        auto stream = server.CreateStream(client_id, false);
+        REQUIRE(stream != nullptr);
+        for (int i = 0; i < 5; i++)
+        {
+            server.SendData(std::string("data"), client_id, stream->GetStreamID());
+        }
+        const MessageType expected = version == wire::VERSION_FIXED ? DATA : DATA_COMPACT;
+        const MessageType other = version == wire::VERSION_FIXED ? DATA_COMPACT : DATA;
+        int expected_count = 0;
+        int other_count = 0;
+        Drain(client, [&](std::span<const char> data, int) {
+            expected_count += MessageType(data[0]) == expected;
+            other_count += MessageType(data[0]) == other;
+        });
+        REQUIRE(expected_count == 5);
+        REQUIRE(other_count == 0);
+    }
+}
 
+TEST_CASE("Round trip time measured from ping", "[falcon client]")
+{
+    FalconServer server;
     server.Listen(5555);
 
     FalconClient client;
     client.ConnectTo("127.0.0.1", 5555);
     std::this_thread::sleep_for(500ms);
-    auto client_stream = client.CreateStream(true);
 
-    client_stream->SetFlag(8, true);
-    std::string msg("helo");
+    REQUIRE(client.GetRtt() > 0us);
+    REQUIRE(client.GetRtt() < 50ms);
+    REQUIRE(client.GetRto() < client.GetConnectionSettings().resend_interval);
+}
 
-    auto streamId = client_stream->GetStreamID();
-    client.SendData(msg, streamId);
-    std::this_thread::sleep_for(500ms);
-    auto server_stream = server.GetStreams().at(client.GetId()).at(streamId);
+TEST_CASE("Round trip time measured from acknowledgements", "[falcon server]")
+{
+    FalconServer server;
+    server.Listen(5555);
 
-    REQUIRE(server_stream->getLastData() == msg);
-    REQUIRE(server_stream->GetFlag(8) == true);
-}
\ No newline at end of file
+    FalconClient client;
+    client.ConnectTo("127.0.0.1", 5555);
+    std::this_thread::sleep_for(200ms);
+    REQUIRE(server.GetRto(client.GetId()) == server.GetConnectionSettings().resend_interval);
+
+    auto stream = server.CreateStream(client.GetId(), true);
+    for (int i = 0; i < 10; i++)
+    {
+        server.SendData("Helo", client.GetId(), stream->GetStreamID());
+    }
+    std::this_thread::sleep_for(200ms);
+
+    REQUIRE(server.GetRtt(client.GetId()) > 0us);
+    REQUIRE(server.GetRto(client.GetId()) < server.GetConnectionSettings().resend_interval);
+}
+
+TEST_CASE("Reassembler rebuilds messages from parts in any order", "[reassembly]")
+{
+    const auto now = std::chrono::steady_clock::now();
+    Reassembler reassembler(1024 * 1024, 1s);
+
+    std::string original(10000, '\0');
+    for (size_t i = 0; i < original.size(); i++)
+    {
+        original[i] = static_cast<char>(i * 31);
+    }
+    constexpr size_t part_size = 4096;
+    constexpr uint8_t part_total = 3;
+    auto part = [&](uint8_t part_id) {
+        return std::span<const char>(original).subspan(part_id * part_size, std::min(part_size, original.size() - part_id * part_size));
+    };
+
+    std::string message;
+    REQUIRE(reassembler.AddPart(1, 7, 2, part_total, part_size, part(2), true, message, now) == Reassembler::Status::Incomplete);
+    REQUIRE(reassembler.AddPart(1, 7, 0, part_total, part_size, part(0), true, message, now) == Reassembler::Status::Incomplete);
+    REQUIRE(reassembler.AddPart(1, 7, 0, part_total, part_size, part(0), true, message, now) == Reassembler::Status::Duplicate);
+    REQUIRE(reassembler.GetBufferedBytes() == part_total * part_size);
+    REQUIRE(reassembler.AddPart(1, 7, 1, part_total, part_size, part(1), true, message, now) == Reassembler::Status::Complete);
+    REQUIRE(message == original);
+    REQUIRE(reassembler.GetBufferedBytes() == 0);
+    REQUIRE(reassembler.GetIncompleteCount() == 0);
+
+    // Only the last part may be shorter
+    REQUIRE(reassembler.AddPart(1, 8, 0, part_total, part_size, part(2), true, message, now) == Reassembler::Status::Rejected);
+}
+
+TEST_CASE("Reassembler limits memory and drops stale messages", "[reassembly]")
+{
+    const auto now = std::chrono::steady_clock::now();
+    const std::string part(1000, 'x');
+    std::string message;
+    Reassembler reassembler(4000, 100ms);
+
+    REQUIRE(reassembler.AddPart(1, 0, 0, 2, part.size(), part, true, message, now) == Reassembler::Status::Incomplete);
+    REQUIRE(reassembler.AddPart(2, 0, 0, 2, part.size(), part, false, message, now) == Reassembler::Status::Incomplete);
+    REQUIRE(reassembler.AddPart(3, 0, 0, 2, part.size(), part, true, message, now) == Reassembler::Status::Rejected);
+
+    // Unreliable messages expire, reliable ones wait for their retransmissions
+    REQUIRE(reassembler.AddPart(3, 0, 0, 2, part.size(), part, true, message, now + 200ms) == Reassembler::Status::Incomplete);
+    REQUIRE(reassembler.GetIncompleteCount() == 2);
+    REQUIRE(reassembler.AddPart(2, 0, 1, 2, part.size(), part, false, message, now + 200ms) == Reassembler::Status::Complete);
+    REQUIRE(message == part + part);
+
+    reassembler.Forget(3);
+    REQUIRE(reassembler.GetIncompleteCount() == 0);
+    REQUIRE(reassembler.GetBufferedBytes() == 0);
+}
+
+TEST_CASE("Part bitmaps are sized to their message", "[reassembly]")
+{
+    PartBitmap single(1);
+    single.Set(0);
+    REQUIRE(single.Test(0));
+    REQUIRE(single.Count() == 1);
+    // Out of range bits are never set
+    single.Set(1);
+    REQUIRE_FALSE(single.Test(1));
+    REQUIRE(single.Count() == 1);
+
+    PartBitmap parts(Reassembler::MAX_PARTS);
+    for (size_t part = 0; part < Reassembler::MAX_PARTS; part += 63)
+    {
+        parts.Set(part);
+    }
+    REQUIRE(parts.Count() == (Reassembler::MAX_PARTS + 62) / 63);
+    REQUIRE(parts.Test(63 * 200));
+    parts.Reset(63 * 200);
+    REQUIRE_FALSE(parts.Test(63 * 200));
+    REQUIRE_FALSE(parts.Test(64));
+
+    // Resizing clears, and a small size goes back inline
+    parts.Resize(64);
+    REQUIRE(parts.Count() == 0);
+    parts.Set(63);
+    REQUIRE(parts.Test(63));
+    REQUIRE(parts.Size() == 64);
+}
+
+TEST_CASE("Messages larger than a datagram are reassembled", "[falcon]")
+{
+    FalconServer server;
+    server.Listen(5555);
+
+    FalconClient client;
+    client.ConnectTo("127.0.0.1", 5555);
+    std::this_thread::sleep_for(300ms);
+    REQUIRE(client.IsConnected());
+
+    std::string msg(300000, '\0');
+    for (size_t i = 0; i < msg.size(); i++)
+    {
+        msg[i] = static_cast<char>(i % 251);
+    }
+    auto stream = client.CreateStream(true);
+    REQUIRE(client.SendData(msg, stream->GetStreamID()));
+
+    WaitForAcknowledgements(*stream, 5s);
+    REQUIRE(stream->GetUnacknowledgedCount() == 0);
+    REQUIRE(server.GetStream(client.GetId(), stream->GetStreamID())->getLastData() == msg);
+}
+
+TEST_CASE("Path MTU discovery searches the largest datagram that gets through", "[path mtu]")
+{
+    auto now = std::chrono::steady_clock::now();
+    PathMtuDiscovery discovery(1200, 9000, 10min);
+    constexpr uint16_t path_size = 1400;
+
+    int probes = 0;
+    for (uint16_t size = discovery.OnProbeTimer(now); size > 0; size = discovery.OnProbeTimer(now))
+    {
+        probes++;
+        if (size <= path_size)
+        {
+            REQUIRE(discovery.OnProbeAcked(size, now));
+        }
+        now += 100ms;
+    }
+    REQUIRE(probes < 40);
+    REQUIRE_FALSE(discovery.IsSearching());
+    REQUIRE(discovery.GetMaxDatagramSize() <= path_size);
+    REQUIRE(discovery.GetMaxDatagramSize() > path_size - PathMtuDiscovery::SEARCH_PRECISION);
+
+    // The search starts again once the raise interval elapsed
+    REQUIRE(discovery.OnProbeTimer(now + 5min) == 0);
+    REQUIRE(discovery.OnProbeTimer(now + 11min) > path_size);
+}
+
+TEST_CASE("Message parts fit the discovered path MTU", "[falcon]")
+{
+    FalconServer server;
+    NetworkConditions conditions;
+    conditions.max_datagram_size = 1400;
+    server.SimulateNetworkConditions(conditions);
+    server.Listen(5555);
+
+    FalconClient client;
+    ConnectionSettings settings;
+    settings.max_datagram_size = 9000;
+    client.SetConnectionSettings(settings);
+    client.ConnectTo("127.0.0.1", 5555);
+    std::this_thread::sleep_for(300ms);
+    REQUIRE(client.IsConnected());
+
+    const auto start = std::chrono::steady_clock::now();
+    while ((client.GetMaxDatagramSize() <= 1392 || server.GetMaxDatagramSize(client.GetId()) < 1472)
+        && std::chrono::steady_clock::now() - start < 5s)
+    {
+        std::this_thread::sleep_for(10ms);
+    }
+    REQUIRE(client.GetMaxDatagramSize() > 1392);
+    REQUIRE(client.GetMaxDatagramSize() <= 1400);
+    // Nothing limits the way back, up to the default maximum
+    REQUIRE(server.GetMaxDatagramSize(client.GetId()) == 1472);
+
+    std::string msg(200000, '\0');
+    for (size_t i = 0; i < msg.size(); i++)
+    {
+        msg[i] = static_cast<char>(i % 253);
+    }
+    auto stream = client.CreateStream(true);
+    REQUIRE(client.SendData(msg, stream->GetStreamID()));
+    WaitForAcknowledgements(*stream, 10s);
+    REQUIRE(stream->GetUnacknowledgedCount() == 0);
+    REQUIRE(server.GetStream(client.GetId(), stream->GetStreamID())->getLastData() == msg);
+}
+
+TEST_CASE("Send scheduler serves priorities first and shares by weight", "[scheduler]")
+{
+    using Clock = std::chrono::steady_clock;
+    SendScheduler scheduler;
+    const std::string message(100, 'm');
+    for (int i = 0; i < 40; i++)
+    {
+        scheduler.Enqueue(1, 0, 1, true, message);
+        scheduler.Enqueue(2, 0, 3, true, message);
+    }
+    scheduler.Enqueue(3, 1, 1, false, std::string("input"));
+    REQUIRE(scheduler.GetQueuedCount() == 81);
+
+    uint32_t stream_id;
+    std::vector<char> data;
+    const Clock::time_point now = Clock::now();
+    REQUIRE(scheduler.Pop(now, stream_id, data));
+    REQUIRE(stream_id == 3);
+    REQUIRE(std::string(data.begin(), data.end()) == "input");
+
+    // Equal priorities, three times as much for the stream of three times the weight
+    std::array<int, 3> sent{};
+    for (int i = 0; i < 40; i++)
+    {
+        REQUIRE(scheduler.Pop(now, stream_id, data));
+        sent[stream_id]++;
+    }
+    REQUIRE(sent[1] == 10);
+    REQUIRE(sent[2] == 30);
+
+    scheduler.Forget(2);
+    REQUIRE(scheduler.GetQueuedCount() == 30);
+    REQUIRE(scheduler.GetNextReleaseTime() <= now);
+}
+
+TEST_CASE("Send scheduler holds to its budget", "[scheduler]")
+{
+    using Clock = std::chrono::steady_clock;
+    SendScheduler scheduler;
+    scheduler.SetBudget(10000, 1000);
+    const std::string message(500, 'm');
+    for (int i = 0; i < 5; i++)
+    {
+        scheduler.Enqueue(1, 1, 1, true, message);
+        scheduler.Enqueue(2, 0, 1, false, message);
+    }
+
+    // The burst lets two messages out, then the unreliable ones are dropped and the reliable ones wait
+    uint32_t stream_id;
+    std::vector<char> data;
+    const Clock::time_point now = Clock::now();
+    REQUIRE(scheduler.Pop(now, stream_id, data));
+    REQUIRE(scheduler.Pop(now, stream_id, data));
+    REQUIRE_FALSE(scheduler.Pop(now, stream_id, data));
+    REQUIRE(scheduler.GetDroppedCount() == 5);
+    REQUIRE(scheduler.GetQueuedCount() == 3);
+
+    // 500 bytes at 10000 bytes per second
+    const Clock::time_point next = scheduler.GetNextReleaseTime();
+    REQUIRE(next >= now + 49ms);
+    REQUIRE(next <= now + 51ms);
+    REQUIRE_FALSE(scheduler.Pop(next - 5ms, stream_id, data));
+    REQUIRE(scheduler.Pop(next, stream_id, data));
+    REQUIRE(stream_id == 1);
+
+    // Larger than the burst, it waits for a full bucket and leaves it in debt
+    scheduler.Forget(1);
+    scheduler.Enqueue(1, 1, 1, true, std::string(5000, 'm'));
+    REQUIRE_FALSE(scheduler.Pop(next + 60ms, stream_id, data));
+    REQUIRE(scheduler.Pop(next + 100ms, stream_id, data));
+    scheduler.Enqueue(1, 1, 1, true, message);
+    REQUIRE_FALSE(scheduler.Pop(next + 500ms, stream_id, data));
+    REQUIRE(scheduler.Pop(next + 560ms, stream_id, data));
+
+    // An unreliable stream of the highest priority waits for the refill, only those of lower priority are dropped
+    SendScheduler urgent;
+    urgent.SetBudget(10000, 1000);
+    for (int i = 0; i < 3; i++)
+    {
+        urgent.Enqueue(3, 2, 1, false, message);
+    }
+    urgent.Enqueue(4, 1, 1, true, message);
+    urgent.Enqueue(5, 0, 1, false, message);
+    REQUIRE(urgent.Pop(now, stream_id, data));
+    REQUIRE(urgent.Pop(now, stream_id, data));
+    REQUIRE_FALSE(urgent.Pop(now, stream_id, data));
+    REQUIRE(urgent.GetDroppedCount() == 1);
+    REQUIRE(urgent.GetQueuedCount() == 2);
+    REQUIRE(urgent.Pop(urgent.GetNextReleaseTime(), stream_id, data));
+    REQUIRE(stream_id == 3);
+    REQUIRE(urgent.GetDroppedCount() == 1);
+}
+
+TEST_CASE("Server holds each client to its send budget", "[falcon server]")
+{
+    ConnectionSettings settings;
+    settings.send_budget = 10000;
+    settings.send_burst = 1000;
+    FalconServer server;
+    server.SetConnectionSettings(settings);
+    server.Listen(5555);
+    FalconClient client;
+    client.ConnectTo("127.0.0.1", 5555);
+    std::this_thread::sleep_for(300ms);
+
+    auto events = server.CreateStream(client.GetId(), true);
+    events->SetPriority(1);
+    auto updates = server.CreateStream(client.GetId(), false);
+    std::this_thread::sleep_for(50ms);
+    const std::string message(500, 'm');
+    for (int i = 0; i < 10; i++)
+    {
+        REQUIRE(server.SendData(message, client.GetId(), events->GetStreamID()));
+        REQUIRE(server.SendData(message, client.GetId(), updates->GetStreamID()));
+    }
+
+    // 5000 bytes of events take half a second at 10000 bytes per second, updates past the burst are dropped
+    // The client registers a stream on its listener thread when the first message arrives
+    std::array<Message, 16> messages;
+    const auto poll = [&](uint32_t stream_id) -> size_t {
+        const auto stream = client.GetStream(stream_id);
+        return stream ? stream->PollMessages(messages) : 0;
+    };
+    std::this_thread::sleep_for(150ms);
+    size_t events_received = poll(events->GetStreamID());
+    REQUIRE(events_received < 10);
+    std::this_thread::sleep_for(800ms);
+    events_received += poll(events->GetStreamID());
+    REQUIRE(events_received == 10);
+    REQUIRE(poll(updates->GetStreamID()) <= 2);
+}
+
+TEST_CASE("NewReno window reacts to acknowledgements and losses", "[congestion]")
+{
+    using Clock = std::chrono::steady_clock;
+    NewRenoController congestion;
+    const Clock::time_point start = Clock::now();
+    REQUIRE(congestion.GetWindow() == NewRenoController::INITIAL_WINDOW);
+
+    // Slow start grows the window by what was acknowledged
+    congestion.OnPacketSent(1000, start);
+    REQUIRE(congestion.GetBytesInFlight() == 1000);
+    congestion.OnPacketsAcked(1000, start);
+    REQUIRE(congestion.GetBytesInFlight() == 0);
+    REQUIRE(congestion.GetWindow() == NewRenoController::INITIAL_WINDOW + 1000);
+
+    // Losses from one round trip halve the window once
+    const size_t window = congestion.GetWindow();
+    congestion.OnPacketSent(1000, start + 1ms);
+    congestion.OnPacketSent(1000, start + 2ms);
+    congestion.OnPacketsLost(1000, start + 1ms, start + 10ms);
+    congestion.OnPacketsLost(1000, start + 2ms, start + 10ms);
+    REQUIRE(congestion.GetWindow() == window / 2);
+    REQUIRE(congestion.GetSlowStartThreshold() == window / 2);
+    REQUIRE(congestion.GetBytesInFlight() == 0);
+
+    congestion.OnRetransmissionTimeout(start + 20ms);
+    REQUIRE(congestion.GetWindow() == NewRenoController::MINIMUM_WINDOW);
+
+    REQUIRE(congestion.HasWindowFor(100000));
+    congestion.OnPacketSent(NewRenoController::MINIMUM_WINDOW, start + 30ms);
+    REQUIRE_FALSE(congestion.HasWindowFor(1));
+}
+
+TEST_CASE("Sends are paced over the round trip time", "[congestion]")
+{
+    using Clock = std::chrono::steady_clock;
+    NewRenoController congestion;
+    const Clock::time_point start = Clock::now();
+
+    // Unpaced until the round trip time is known
+    congestion.OnPacketSent(1000, start);
+    REQUIRE(congestion.GetNextSendTime() <= start);
+
+    congestion.SetSmoothedRtt(100ms);
+    int burst = 0;
+    while (congestion.GetNextSendTime() <= start)
+    {
+        congestion.OnPacketSent(CongestionController::MAX_SEGMENT_SIZE, start);
+        burst++;
+    }
+    // A short burst goes out at once, the rest of the window is spread over the round trip
+    REQUIRE(burst > 1);
+    REQUIRE(burst <= 11);
+    const Clock::time_point burst_end = congestion.GetNextSendTime();
+    congestion.OnPacketSent(CongestionController::MAX_SEGMENT_SIZE, burst_end);
+    const Clock::duration interval = congestion.GetNextSendTime() - burst_end;
+    REQUIRE(interval > 5ms);
+    REQUIRE(interval < 10ms);
+}
+
+TEST_CASE("Simulated network conditions drop and delay datagrams", "[falcon]")
+{
+    RawSocket receiver;
+    receiver.Bind(5556);
+    RawSocket sender;
+    sender.Bind(5557);
+    const Endpoint receiver_endpoint = Endpoint::Resolve("127.0.0.1", 5556);
+
+    NetworkConditions conditions;
+    conditions.latency = 50ms;
+    receiver.SimulateNetworkConditions(conditions);
+
+    const auto start = std::chrono::steady_clock::now();
+    sender.SendTo(receiver_endpoint, "delayed");
+    size_t received = receiver.Poll(20).size();
+    REQUIRE(received == 0);
+    while (received == 0 && std::chrono::steady_clock::now() - start < 500ms)
+    {
+        received = receiver.Poll(100).size();
+    }
+    REQUIRE(received == 1);
+    REQUIRE(std::chrono::steady_clock::now() - start >= 50ms);
+
+    conditions.latency = 0ms;
+    conditions.loss_rate = 1.0;
+    receiver.SimulateNetworkConditions(conditions);
+    sender.SendTo(receiver_endpoint, "lost");
+    REQUIRE(receiver.Poll(50).size() == 0);
+}
+
+TEST_CASE("Reliable data gets through a lossy link", "[falcon]")
+{
+    FalconServer server;
+    NetworkConditions conditions;
+    conditions.loss_rate = 0.1;
+    conditions.latency = 10ms;
+    server.SimulateNetworkConditions(conditions);
+    server.Listen(5555);
+
+    // The handshake is not retransmitted, retry it past the simulated losses
+    std::unique_ptr<FalconClient> client;
+    for (int attempt = 0; attempt < 5 && !(client && client->IsConnected()); attempt++)
+    {
+        client = std::make_unique<FalconClient>();
+        client->ConnectTo("127.0.0.1", 5555);
+        std::this_thread::sleep_for(300ms);
+    }
+    REQUIRE(client->IsConnected());
+
+    auto stream = client->CreateStream(true);
+    const std::string msg(1000, 'x');
+    for (int i = 0; i < 300; i++)
+    {
+        REQUIRE(client->SendData(msg, stream->GetStreamID()));
+    }
+
+    WaitForAcknowledgements(*stream, 5s);
+    REQUIRE(stream->GetUnacknowledgedCount() == 0);
+    REQUIRE(server.GetStream(client->GetId(), stream->GetStreamID())->getLastData() == msg);
+}
+
+TEST_CASE("Can close stream", "[falcon]")
+{
+    FalconServer server;
+
+    server.Listen(5555);
+
+    FalconClient client;
+    client.ConnectTo("127.0.0.1", 5555);
+    std::this_thread::sleep_for(500ms);
+    auto stream = client.CreateStream(true);
+    auto streamId = stream->GetStreamID();
+    client.SendData("helo", streamId);
+    std::this_thread::sleep_for(500ms);
+
+    REQUIRE(server.GetStreamCount(client.GetId()) == 1);
+    auto serverStream = server.GetStream(client.GetId(), streamId);
+    REQUIRE(serverStream != nullptr);
+    
+    REQUIRE(server.CloseStream(*serverStream));
+    std::this_thread::sleep_for(500ms);
+
+    REQUIRE(server.GetStreamCount(client.GetId()) == 0);
+
+    REQUIRE(client.GetStream(streamId) == nullptr);
+    REQUIRE(client.GetStreamCount() == 0);
+}
+
+TEST_CASE("Client can close stream", "[falcon]")
+{
+    FalconServer server;
+    server.Listen(5555);
+    FalconClient client;
+    client.ConnectTo("127.0.0.1", 5555);
+    std::this_thread::sleep_for(500ms);
+
+    auto stream = client.CreateStream(true);
+    REQUIRE(client.SendData(std::string_view("helo"), stream->GetStreamID()));
+    std::this_thread::sleep_for(500ms);
+    REQUIRE(server.GetStreamCount(client.GetId()) == 1);
+    REQUIRE(client.GetStream(stream->GetStreamID()) != nullptr);
+
+    REQUIRE(client.CloseStream(*stream));
+    std::this_thread::sleep_for(500ms);
+    REQUIRE(client.GetStream(stream->GetStreamID()) == nullptr);
+    REQUIRE(client.GetStreamsAwaitingAck() == 0);
+    REQUIRE(server.GetStreamCount(client.GetId()) == 0);
+}
+
+TEST_CASE("Can receive data", "[falcon]")
+{
+    FalconServer server;
+
+    server.Listen(5555);
+
+    FalconClient client;
+    client.ConnectTo("127.0.0.1", 5555);
+    std::this_thread::sleep_for(500ms);
+    auto client_stream = client.CreateStream(true);
+
+    client_stream->SetFlag(8, true);
+    std::string msg("helo");
+
+    auto streamId = client_stream->GetStreamID();
+    client.SendData(msg, streamId);
+    std::this_thread::sleep_for(500ms);
+    auto server_stream = server.GetStream(client.GetId(), streamId);
+
+    REQUIRE(server_stream->getLastData() == msg);
+    REQUIRE(server_stream->GetFlag(8) == true);
+}
+
+TEST_CASE("Steady state traffic does not allocate", "[falcon]")
+{
+    FalconServer server;
+
+    server.Listen(5555);
+
+    FalconClient client;
+    client.ConnectTo("127.0.0.1", 5555);
+    std::this_thread::sleep_for(500ms);
+    REQUIRE(client.IsConnected());
+
+    auto stream = client.CreateStream(false);
+    auto streamId = stream->GetStreamID();
+    std::string msg(32, 'x');
+
+    // The first packets create the server side stream and size its receive buffer
+    for (int i = 0; i < 10; i++)
+    {
+        client.SendData(msg, streamId);
+    }
+    std::this_thread::sleep_for(200ms);
+    std::atomic<int> handled = 0;
+    server.GetStream(client.GetId(), streamId)->SetMessageHandler([&handled](const Message&) { handled++; });
+    for (int i = 0; i < 10; i++)
+    {
+        client.SendData(msg, streamId);
+    }
+    std::this_thread::sleep_for(200ms);
+
+    const size_t allocations_before = allocation_count;
+    for (int i = 0; i < 1000; i++)
+    {
+        client.SendData(msg, streamId);
+    }
+    std::this_thread::sleep_for(200ms);
+    const size_t allocations_after = allocation_count;
+
+    REQUIRE(allocations_after == allocations_before);
+    // Unreliable, the burst may overflow the socket buffer
+    REQUIRE(handled > 10);
+    REQUIRE(server.GetStream(client.GetId(), streamId)->getLastData() == msg);
+}
+
+TEST_CASE("Session table keys are checked against reused slots", "[session table]")
+{
+    SessionTable<std::string> sessions;
+    const auto first = sessions.Insert("first");
+    const auto second = sessions.Insert("second");
+    REQUIRE(first == 0);
+    REQUIRE(*sessions.Find(second) == "second");
+
+    REQUIRE(sessions.Erase(first));
+    REQUIRE_FALSE(sessions.Erase(first));
+    const auto third = sessions.Insert("third");
+    // Same slot, another generation
+    REQUIRE((third & 0xFFFFFFFF) == (first & 0xFFFFFFFF));
+    REQUIRE(sessions.Find(first) == nullptr);
+    REQUIRE(*sessions.Find(third) == "third");
+    REQUIRE(sessions.Size() == 2);
+
+    // A table only knows the keys of its own base
+    SessionTable<std::string> shard(uint64_t(3) << SessionTable<std::string>::KEY_BITS);
+    const auto shard_key = shard.Insert("shard");
+    REQUIRE(shard_key >> SessionTable<std::string>::KEY_BITS == 3);
+    REQUIRE(shard.Find(shard_key & SessionTable<std::string>::KEY_MASK) == nullptr);
+    REQUIRE(sessions.Find(shard_key) == nullptr);
+}
+
+TEST_CASE("Wire headers of both versions read back what was written", "[wire format]")
+{
+    wire::DataHeader header;
+    header.client_id = (uint64_t(2) << 56) | (uint64_t(1) << 32) | 5;
+    header.stream_id = Stream::RELIABLE_STREAM_BIT | 3;
+    header.message_id = 65000;
+    const std::string payload = "payload";
+
+    for (const uint8_t version : { wire::VERSION_FIXED, wire::VERSION_COMPACT })
+    {
+        std::array<char, wire::MAX_DATA_HEADER_SIZE + 64> message;
+        const size_t header_size = wire::WriteDataHeader(version, header, true, payload.size(),
+            std::span<char, wire::MAX_DATA_HEADER_SIZE>(message.data(), wire::MAX_DATA_HEADER_SIZE));
+        REQUIRE(header_size <= wire::MaxDataHeaderSize(version, header.client_id, header.stream_id));
+        memcpy(&message[header_size], payload.data(), payload.size());
+        const std::span<const char> datagram = std::span<const char>(message).first(header_size + payload.size());
+
+        uint64_t client_id;
+        uint32_t stream_id;
+        REQUIRE(wire::ReadClientId(datagram, client_id));
+        REQUIRE(wire::ReadStreamId(datagram, stream_id));
+        REQUIRE(client_id == header.client_id);
+        REQUIRE(stream_id == header.stream_id);
+
+        wire::DataHeader read;
+        std::span<const char> read_payload;
+        REQUIRE(wire::ReadDataHeader(datagram, read, read_payload));
+        REQUIRE(read.message_id == header.message_id);
+        REQUIRE(read.part_total == 1);
+        REQUIRE(std::string(read_payload.begin(), read_payload.end()) == payload);
+        // Truncated headers are rejected
+        REQUIRE_FALSE(wire::ReadDataHeader(datagram.first(header_size - 1), read, read_payload));
+    }
+
+    // Small messages of a small server carry a fraction of the fixed header
+    std::array<char, wire::MAX_DATA_HEADER_SIZE> compact;
+    REQUIRE(wire::WriteDataHeader(wire::VERSION_COMPACT, header, true, payload.size(), compact) <= 8);
+    REQUIRE(wire::WriteDataHeader(wire::VERSION_COMPACT, header, false, payload.size(), compact) <= 6);
+
+    // Parts and flags only when needed
+    header.flags = 0x8001;
+    header.part_id = 300;
+    header.part_total = 301;
+    header.part_size = 1180;
+    const size_t multipart_size = wire::WriteDataHeader(wire::VERSION_COMPACT, header, true, 10, compact);
+    wire::DataHeader read;
+    std::span<const char> read_payload;
+    REQUIRE(wire::ReadDataHeader(std::span<const char>(compact).first(multipart_size), read, read_payload));
+    REQUIRE(read.flags == header.flags);
+    REQUIRE(read.part_id == header.part_id);
+    REQUIRE(read.part_total == header.part_total);
+    REQUIRE(read.part_size == header.part_size);
+    REQUIRE(read_payload.empty());
+
+    wire::AckHeader ack;
+    ack.client_id = header.client_id;
+    ack.stream_id = header.stream_id;
+    ack.message_id = 12;
+    ack.part_id = 4;
+    ack.receive_base = 65535;
+    ack.receive_sack = 0b101;
+    for (const uint8_t version : { wire::VERSION_FIXED, wire::VERSION_COMPACT })
+    {
+        std::array<char, wire::MAX_ACK_SIZE> message;
+        const size_t size = wire::WriteAck(version, ack, message);
+        wire::AckHeader read_ack;
+        REQUIRE(wire::ReadAck(std::span<const char>(message).first(size), read_ack));
+        REQUIRE(read_ack.client_id == ack.client_id);
+        REQUIRE(read_ack.stream_id == ack.stream_id);
+        REQUIRE(read_ack.message_id == ack.message_id);
+        REQUIRE(read_ack.part_id == ack.part_id);
+        REQUIRE(read_ack.receive_base == ack.receive_base);
+        REQUIRE(read_ack.receive_sack == ack.receive_sack);
+    }
+}
+
+TEST_CASE("Message schema places fields at fixed offsets", "[message schema]")
+{
+    schema::Message<schema::Ping> ping;
+    const auto time = std::chrono::steady_clock::now();
+    ping.Set<schema::Ping::ClientId>(42).Set<schema::Ping::PingId>(7).Set<schema::Ping::Time>(time);
+    const std::span<const char> bytes = ping.Bytes();
+    REQUIRE(bytes.size() == 13 + sizeof(time));
+    REQUIRE(MessageType(bytes[0]) == PING);
+
+    // Same bytes as the hand written layout
+    uint16_t size;
+    uint64_t client_id;
+    uint16_t ping_id;
+    memcpy(&size, &bytes[1], sizeof(size));
+    memcpy(&client_id, &bytes[3], sizeof(client_id));
+    memcpy(&ping_id, &bytes[11], sizeof(ping_id));
+    REQUIRE(size == bytes.size());
+    REQUIRE(client_id == 42);
+    REQUIRE(ping_id == 7);
+
+    const auto view = schema::View<schema::Pong>::Of(bytes);
+    REQUIRE(view);
+    REQUIRE(view->Get<schema::Pong::ClientId>() == 42);
+    REQUIRE(view->Get<schema::Pong::PingId>() == 7);
+    REQUIRE(view->Get<schema::Pong::Time>() == time);
+    REQUIRE(view->Payload().empty());
+
+    // Too short for the layout
+    REQUIRE_FALSE(schema::View<schema::Ping>::Of(bytes.first(bytes.size() - 1)));
+    REQUIRE(schema::View<schema::ClientHeader>::Of(bytes.first(11)));
+    REQUIRE_FALSE(schema::View<schema::ClientHeader>::Of(bytes.first(10)));
+}
+
+TEST_CASE("Snapshots are rebuilt from deltas against acknowledged baselines", "[snapshot]")
+{
+    snapshot::Encoder encoder;
+    snapshot::Decoder decoder;
+    std::string world(1000, 'w');
+    std::vector<char> message;
+    std::string state;
+
+    // Nothing acknowledged yet, sent whole
+    encoder.Encode(world, message);
+    REQUIRE(message.size() > world.size());
+    REQUIRE(decoder.Decode(message, state));
+    REQUIRE(state == world);
+    encoder.OnAcknowledged(decoder.GetLastSequence());
+
+    world[10] = 'a';
+    world[500] = 'b';
+    encoder.Encode(world, message);
+    REQUIRE(message.size() < 32);
+    REQUIRE(decoder.Decode(message, state));
+    REQUIRE(state == world);
+
+    // Still against the first snapshot until this one is acknowledged, and a grown state
+    world.append(20, 'c');
+    encoder.Encode(world, message);
+    const std::vector<char> late = message;
+    world[0] = 'd';
+    encoder.Encode(world, message);
+    REQUIRE(message.size() < 64);
+    REQUIRE(decoder.Decode(message, state));
+    REQUIRE(state == world);
+    // Older than the last one decoded
+    REQUIRE_FALSE(decoder.Decode(late, state));
+
+    // A receiver that never saw the baseline drops the delta
+    snapshot::Decoder late_joiner;
+    REQUIRE_FALSE(late_joiner.Decode(message, state));
+    REQUIRE_FALSE(decoder.Decode(std::span<const char>(message).first(message.size() - 1), state));
+
+    // A new baseline once acknowledged, and a shrunk state
+    encoder.OnAcknowledged(decoder.GetLastSequence());
+    world.resize(900);
+    encoder.Encode(world, message);
+    REQUIRE(message.size() < 32);
+    REQUIRE(decoder.Decode(message, state));
+    REQUIRE(state == world);
+
+    // A delta claiming a state larger than its baseline and body together is dropped before anything is allocated
+    std::vector<char> forged = message;
+    const uint16_t next_sequence = decoder.GetLastSequence() + 1;
+    const uint32_t huge = 0xFFFFFFFF;
+    memcpy(&forged[0], &next_sequence, sizeof(next_sequence));
+    memcpy(&forged[5], &huge, sizeof(huge));
+    REQUIRE_FALSE(decoder.Decode(forged, state));
+    REQUIRE(state == world);
+}
+
+TEST_CASE("Snapshot streams deliver whole states", "[falcon]")
+{
+    FalconServer server;
+    server.Listen(5555);
+    FalconClient client;
+    client.ConnectTo("127.0.0.1", 5555);
+    std::this_thread::sleep_for(100ms);
+
+    auto stream = client.CreateSnapshotStream();
+    REQUIRE(stream != nullptr);
+    REQUIRE(stream->IsSnapshot());
+    REQUIRE_FALSE(stream->IsReliable());
+    std::string world(4000, 'w');
+    for (int tick = 0; tick < 20; tick++)
+    {
+        world[(tick * 97) % world.size()] = static_cast<char>('a' + tick);
+        REQUIRE(client.SendData(world, stream->GetStreamID()));
+        std::this_thread::sleep_for(5ms);
+    }
+    std::this_thread::sleep_for(100ms);
+
+    auto server_stream = server.GetStream(client.GetId(), stream->GetStreamID());
+    REQUIRE(server_stream != nullptr);
+    std::array<Message, 32> messages;
+    const size_t count = server_stream->PollMessages(messages);
+    REQUIRE(count > 0);
+    REQUIRE(std::string(messages[count - 1].data.begin(), messages[count - 1].data.end()) == world);
+}
+
+TEST_CASE("LZ codec round trips any input", "[lz codec]")
+{
+    std::string text;
+    for (int i = 0; i < 200; i++)
+    {
+        text += "{\"player\": " + std::to_string(i % 7) + ", \"message\": \"good game, well played\"}\n";
+    }
+    std::string random_bytes(5000, 0);
+    std::minstd_rand random(42);
+    for (char& byte : random_bytes)
+    {
+        byte = static_cast<char>(random());
+    }
+    const std::string inputs[] = { "", "abc", std::string(100000, 'x'), text, random_bytes, text + random_bytes + text };
+
+    std::vector<char> compressed;
+    std::string decompressed;
+    for (const std::string& input : inputs)
+    {
+        lz::Compress(input, compressed);
+        REQUIRE(compressed.size() <= lz::MaxCompressedSize(input.size()));
+        REQUIRE(lz::Decompress(compressed, input.size(), decompressed));
+        REQUIRE(decompressed == input);
+    }
+    lz::Compress(text, compressed);
+    REQUIRE(compressed.size() * 10 < text.size());
+    REQUIRE_FALSE(lz::Decompress(std::span<const char>(compressed).first(compressed.size() - 1), text.size(), decompressed));
+    REQUIRE_FALSE(lz::Decompress(compressed, text.size() + 1, decompressed));
+
+    // A short message compresses against the dictionary, which the decompressor needs as well
+    const lz::Dictionary dictionary(text);
+    const std::string message = "{\"player\": 3, \"message\": \"good game, well played\"}\n";
+    lz::Compress(message, compressed);
+    const size_t alone = compressed.size();
+    lz::Compress(message, compressed, &dictionary);
+    REQUIRE(compressed.size() * 4 < alone);
+    REQUIRE(lz::Decompress(compressed, message.size(), decompressed, &dictionary));
+    REQUIRE(decompressed == message);
+    REQUIRE_FALSE(lz::Decompress(compressed, message.size(), decompressed));
+}
+
+TEST_CASE("Compressed streams send fewer bytes", "[stream]")
+{
+    RawSocket sender_socket;
+    sender_socket.Bind(5556);
+    RawSocket receiver_socket;
+    receiver_socket.Bind(5557);
+    Stream sender(Stream::RELIABLE_STREAM_BIT, 0, Endpoint::Resolve("127.0.0.1", 5557), &sender_socket);
+    Stream receiver(Stream::RELIABLE_STREAM_BIT, 0, Endpoint::Resolve("127.0.0.1", 5556), &receiver_socket);
+    sender.SetCompression(true);
+    sender.SetFlag(3, true);
+    // Reserved for compression
+    sender.SetFlag(Stream::COMPRESSED_FLAG, true);
+    REQUIRE_FALSE(sender.GetFlag(Stream::COMPRESSED_FLAG));
+
+    std::string state;
+    for (int i = 0; i < 100; i++)
+    {
+        state += "entity " + std::to_string(i % 10) + " at 0,0,0; ";
+    }
+    const std::string small = "short chat line";
+    size_t bytes = 0;
+    for (const std::string& message : { state, small })
+    {
+        StreamTestAccess::SendData(sender, message);
+        Drain(receiver_socket, [&](std::span<const char> data, int) {
+            bytes = data.size();
+            receiver.OnDataReceived(data);
+        });
+        REQUIRE(receiver.getLastData() == message);
+        REQUIRE(receiver.GetFlag(3));
+        REQUIRE_FALSE(receiver.GetFlag(Stream::COMPRESSED_FLAG));
+        if (message == state)
+        {
+            REQUIRE(bytes * 4 < message.size());
+        }
+        else
+        {
+            // Too small to be worth it
+            REQUIRE(bytes > message.size());
+        }
+    }
+
+    // Against a dictionary both sides know
+    const std::vector<std::shared_ptr<const lz::Dictionary>> dictionaries = { std::make_shared<const lz::Dictionary>(state) };
+    sender.SetCompressionDictionaries(dictionaries);
+    receiver.SetCompressionDictionaries(dictionaries);
+    sender.SetCompression(true, 1);
+    const std::string update = "entity 4 at 0,0,0; entity 5 at 0,0,0; entity 6 at 1,0,0; entity 7 at 0,0,0; ";
+    StreamTestAccess::SendData(sender, update);
+    Drain(receiver_socket, [&](std::span<const char> data, int) {
+        bytes = data.size();
+        receiver.OnDataReceived(data);
+    });
+    REQUIRE(receiver.getLastData() == update);
+    REQUIRE(bytes < update.size());
+}
+
+TEST_CASE("Sequenced streams drop late messages", "[stream]")
+{
+    RawSocket sender_socket;
+    sender_socket.Bind(5556);
+    RawSocket receiver_socket;
+    receiver_socket.Bind(5557);
+    Stream sender(Stream::SEQUENCED_STREAM_BIT, 0, Endpoint::Resolve("127.0.0.1", 5557), &sender_socket);
+    Stream receiver(Stream::SEQUENCED_STREAM_BIT, 0, Endpoint::Resolve("127.0.0.1", 5556), &receiver_socket);
+    REQUIRE(sender.IsSequenced());
+    REQUIRE_FALSE(sender.IsReliable());
+    // Compact headers leave message ids out of unreliable messages, unless they are sequenced
+    sender.SetWireVersion(wire::VERSION_COMPACT);
+    receiver.SetWireVersion(wire::VERSION_COMPACT);
+
+    // Message ids wrap around between the second and third update
+    while (sender.GetNewMessageID() != 65533)
+    {
+    }
+    std::vector<std::string> datagrams;
+    for (int i = 0; i < 4; i++)
+    {
+        StreamTestAccess::SendData(sender, "update " + std::to_string(i));
+        Drain(receiver_socket, [&](std::span<const char> data, int) { datagrams.emplace_back(data.begin(), data.end()); });
+    }
+    REQUIRE(datagrams.size() == 4);
+
+    for (int index : { 0, 2, 1, 3, 3, 0 })
+    {
+        receiver.OnDataReceived(datagrams[index]);
+    }
+    std::array<Message, 8> messages;
+    const size_t count = receiver.PollMessages(messages);
+    REQUIRE(count == 3);
+    REQUIRE(std::string(messages[0].data.begin(), messages[0].data.end()) == "update 0");
+    REQUIRE(std::string(messages[1].data.begin(), messages[1].data.end()) == "update 2");
+    REQUIRE(std::string(messages[2].data.begin(), messages[2].data.end()) == "update 3");
+}
+
+TEST_CASE("Ordered streams deliver messages in the order they were sent", "[stream]")
+{
+    RawSocket sender_socket;
+    sender_socket.Bind(5556);
+    RawSocket receiver_socket;
+    receiver_socket.Bind(5557);
+    constexpr uint32_t ordered = Stream::RELIABLE_STREAM_BIT | Stream::SEQUENCED_STREAM_BIT;
+    Stream sender(ordered, 0, Endpoint::Resolve("127.0.0.1", 5557), &sender_socket);
+    Stream receiver(ordered, 0, Endpoint::Resolve("127.0.0.1", 5556), &receiver_socket);
+    REQUIRE(receiver.IsOrdered());
+    REQUIRE_FALSE(receiver.IsSequenced());
+
+    for (int i = 0; i < 10; i++)
+    {
+        StreamTestAccess::SendData(sender, "message " + std::to_string(i));
+    }
+    std::string first;
+    // Messages 1, 4 and 7 are lost, the others wait for them
+    Drain(receiver_socket, [&](std::span<const char> data, int index) {
+        if (index == 0)
+        {
+            first.assign(data.begin(), data.end());
+        }
+        if (index % 3 != 1)
+        {
+            receiver.OnDataReceived(data);
+        }
+    });
+    std::array<Message, 16> messages;
+    REQUIRE(receiver.PollMessages(messages) == 1);
+    REQUIRE(std::string(messages[0].data.begin(), messages[0].data.end()) == "message 0");
+
+    // A duplicate is acknowledged again, not delivered again
+    receiver.OnDataReceived(first);
+    Drain(sender_socket, [&](std::span<const char> data, int) { sender.OnAckReceived(data); });
+    REQUIRE(sender.GetUnacknowledgedCount() == 3);
+    REQUIRE(sender.ResendUnacknowledged(0ms));
+    Drain(receiver_socket, [&](std::span<const char> data, int) { receiver.OnDataReceived(data); });
+
+    REQUIRE(receiver.PollMessages(messages) == 9);
+    for (int i = 0; i < 9; i++)
+    {
+        REQUIRE(std::string(messages[i].data.begin(), messages[i].data.end()) == "message " + std::to_string(i + 1));
+    }
+    REQUIRE(receiver.getLastData() == "message 9");
+}
+
+TEST_CASE("Timer wheel fires due timers", "[timer wheel]")
+{
+    const auto start = std::chrono::steady_clock::now();
+    TimerWheel timers(1ms, start);
+
+    int fired = 0;
+    timers.Schedule(start + 10ms, [&fired]() { fired++; });
+    timers.Schedule(start + 5s, [&fired]() { fired += 10; });
+    REQUIRE(timers.NextDeadline() == start + 10ms);
+
+    timers.Advance(start + 9ms);
+    REQUIRE(fired == 0);
+    timers.Advance(start + 10ms);
+    REQUIRE(fired == 1);
+
+    timers.Advance(start + 5s);
+    REQUIRE(fired == 11);
+    REQUIRE(timers.Size() == 0);
+    REQUIRE(timers.NextDeadline() == std::chrono::steady_clock::time_point::max());
+}
+
+TEST_CASE("Timer wheel cancels and reschedules", "[timer wheel]")
+{
+    const auto start = std::chrono::steady_clock::now();
+    TimerWheel timers(1ms, start);
+
+    int fired = 0;
+    auto cancelled = timers.Schedule(start + 10ms, [&fired]() { fired++; });
+    auto moved = timers.Schedule(start + 10ms, [&fired]() { fired += 10; });
+
+    REQUIRE(timers.Cancel(cancelled));
+    REQUIRE_FALSE(timers.Cancel(cancelled));
+    REQUIRE(timers.Reschedule(moved, start + 100s));
+
+    timers.Advance(start + 1s);
+    REQUIRE(fired == 0);
+    REQUIRE(timers.IsScheduled(moved));
+
+    timers.Advance(start + 100s);
+    REQUIRE(fired == 10);
+    REQUIRE_FALSE(timers.IsScheduled(moved));
+}
+
+TEST_CASE("Timer wheel timers can re-arm themselves", "[timer wheel]")
+{
+    const auto start = std::chrono::steady_clock::now();
+    TimerWheel timers(1ms, start);
+
+    int fired = 0;
+    TimerWheel::TimerId periodic = TimerWheel::INVALID_TIMER;
+    periodic = timers.Schedule(start + 100ms, [&]() {
+        fired++;
+        timers.Reschedule(periodic, start + (fired + 1) * 100ms);
+    });
+
+    for (auto now = start; now <= start + 1s; now += 1ms)
+    {
+        timers.Advance(now);
+    }
+    REQUIRE(fired == 10);
+    REQUIRE(timers.IsScheduled(periodic));
+}
+
+TEST_CASE("Connection timeout is configurable", "[falcon client]")
+{
+    FalconClient client;
+    ConnectionSettings settings;
+    settings.timeout = 200ms;
+    client.SetConnectionSettings(settings);
+    {
+        FalconServer server;
+        server.Listen(5555);
+
+        client.ConnectTo("127.0.0.1", 5555);
+        std::this_thread::sleep_for(100ms);
+        REQUIRE(client.IsConnected());
+    }
+    std::this_thread::sleep_for(400ms);
+
+    REQUIRE(client.IsConnected() == false);
+}
+
+// Run with: tests "[benchmark]"
+TEST_CASE("Sharded server packet rate", "[.][benchmark]")
+{
+    constexpr int sender_count = 8;
+    constexpr int sockets_per_sender = 8;
+    constexpr auto duration = 2s;
+    const Endpoint server_endpoint = Endpoint::Resolve("127.0.0.1", 5555);
+
+    for (uint32_t shard_count : { 1u, 2u, 4u, 8u })
+    {
+        FalconServer server;
+        server.Listen(5555, shard_count);
+
+        std::atomic<bool> running = true;
+        std::atomic<uint64_t> pongs = 0;
+        std::vector<std::thread> senders;
+        for (int sender = 0; sender < sender_count; sender++)
+        {
+            senders.emplace_back([&]() {
+                // Each socket has its own source port, so the kernel hashes them onto different shards
+                std::array<RawSocket, sockets_per_sender> sockets;
+                std::array<uint64_t, sockets_per_sender> ids{};
+                for (int i = 0; i < sockets_per_sender; i++)
+                {
+                    sockets[i].Bind(0);
+                    const std::array<char, 3> connect = { CONNECT, 3, 0 };
+                    sockets[i].SendTo(server_endpoint, connect);
+                    for (const Datagram& datagram : sockets[i].Poll(1000))
+                    {
+                        if (datagram.size >= 11 && datagram.buffer[0] == CONNECT_ACK)
+                        {
+                            memcpy(&ids[i], &datagram.buffer[3], sizeof(ids[i]));
+                        }
+                    }
+                }
+
+                constexpr uint16_t ping_size = 13 + sizeof(std::chrono::steady_clock::time_point);
+                std::array<char, ping_size> ping{};
+                ping[0] = PING;
+                memcpy(&ping[1], &ping_size, sizeof(ping_size));
+
+                uint64_t received = 0;
+                while (running)
+                {
+                    for (int i = 0; i < sockets_per_sender; i++)
+                    {
+                        memcpy(&ping[3], &ids[i], sizeof(ids[i]));
+                        sockets[i].SendTo(server_endpoint, ping);
+                    }
+                    for (RawSocket& socket : sockets)
+                    {
+                        received += socket.Poll(0).size();
+                    }
+                }
+                pongs += received;
+            });
+        }
+
+        std::this_thread::sleep_for(duration);
+        running = false;
+        for (std::thread& sender : senders)
+        {
+            sender.join();
+        }
+
+        const double seconds = std::chrono::duration<double>(duration).count();
+        std::cout << shard_count << " shard(s): " << static_cast<uint64_t>(pongs / seconds) << " pongs/s" << std::endl;
+    }
+}
+
+// Run with: tests "[benchmark]"
+TEST_CASE("Congestion control goodput and queueing delay", "[.][benchmark]")
+{
+    // A 1 MB/s bottleneck with a 32 KB queue and 20 ms of latency
+    NetworkConditions conditions;
+    conditions.latency = 20ms;
+    conditions.bandwidth = 1000000;
+    conditions.queue_size = 32000;
+    conditions.loss_rate = 0.005;
+
+    constexpr int message_count = 2000;
+    const std::string msg(1000, 'x');
+
+    for (const bool congestion_control : { false, true })
+    {
+        ConnectionSettings settings;
+        if (!congestion_control)
+        {
+            settings.congestion_controller = nullptr;
+        }
+
+        FalconServer server;
+        server.SimulateNetworkConditions(conditions);
+        server.SetConnectionSettings(settings);
+        server.Listen(5555);
+
+        FalconClient client;
+        client.SetConnectionSettings(settings);
+        client.ConnectTo("127.0.0.1", 5555);
+        std::this_thread::sleep_for(300ms);
+
+        auto stream = client.CreateStream(true);
+        const auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < message_count; i++)
+        {
+            client.SendData(msg, stream->GetStreamID());
+        }
+
+        std::chrono::microseconds rtt_total{};
+        int rtt_samples = 0;
+        // The sends are queued, the first sleep lets the listener hand them to the stream
+        do
+        {
+            std::this_thread::sleep_for(10ms);
+            rtt_total += client.GetRtt();
+            rtt_samples++;
+        } while (stream->GetUnacknowledgedCount() > 0 && std::chrono::steady_clock::now() - start < 30s);
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        const double goodput = (message_count - static_cast<double>(stream->GetUnacknowledgedCount())) * msg.size() / seconds;
+        const auto queueing_delay = std::chrono::duration_cast<std::chrono::milliseconds>(rtt_total / std::max(rtt_samples, 1) - conditions.latency);
+
+        std::cout << (congestion_control ? "NewReno + pacing" : "Uncontrolled") << ": "
+            << static_cast<uint64_t>(goodput / 1000) << " KB/s goodput, "
+            << queueing_delay.count() << " ms mean queueing delay" << std::endl;
+    }
+}
+
+// Run with: tests "[benchmark]"
+TEST_CASE("Reassembly throughput", "[.][benchmark]")
+{
+    constexpr size_t message_size = 8 * 1024 * 1024;
+    // Parts are cut to fit a datagram, thousands of them make a message this large
+    const size_t part_size = ConnectionSettings{}.max_datagram_size - wire::FIXED_DATA_HEADER_SIZE;
+    const uint16_t part_total = static_cast<uint16_t>((message_size + part_size - 1) / part_size);
+    REQUIRE(part_total <= Reassembler::MAX_PARTS);
+    constexpr int message_count = 100;
+
+    const std::string original(message_size, 'x');
+    std::vector<uint16_t> order(part_total);
+    for (uint16_t i = 0; i < part_total; i++)
+    {
+        order[i] = i;
+    }
+    std::minstd_rand random(42);
+
+    Reassembler reassembler(64 * 1024 * 1024, 1s);
+    std::string message;
+    int completed = 0;
+    const auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < message_count; i++)
+    {
+        std::shuffle(order.begin(), order.end(), random);
+        for (uint16_t part_id : order)
+        {
+            const size_t offset = part_id * part_size;
+            const std::span<const char> part = std::span<const char>(original).subspan(offset, std::min(part_size, message_size - offset));
+            if (reassembler.AddPart(1, static_cast<uint16_t>(i), part_id, part_total, part_size, part, true, message, std::chrono::steady_clock::now())
+                == Reassembler::Status::Complete)
+            {
+                completed++;
+            }
+        }
+    }
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    REQUIRE(completed == message_count);
+    REQUIRE(message == original);
+    std::cout << "Reassembled " << message_count << " messages of " << message_size / (1024 * 1024) << " MB, " << part_total
+        << " parts each, in shuffled order: "
+        << static_cast<uint64_t>(message_count * message_size / seconds / (1024 * 1024)) << " MB/s" << std::endl;
+}
+
+TEST_CASE("Bytes on the wire per message", "[.][benchmark]")
+{
+    constexpr int message_count = 10000;
+    const std::string payload(20, 'x');
+    RawSocket sender_socket;
+    sender_socket.Bind(5556);
+    RawSocket receiver_socket;
+    receiver_socket.Bind(5557);
+
+    for (const bool reliable : { false, true })
+    {
+        for (const uint8_t version : { wire::VERSION_FIXED, wire::VERSION_COMPACT })
+        {
+            // A client of a server with a few hundred connections, on its first streams
+            const uint64_t client_id = (uint64_t(1) << 32) | 300;
+            const uint32_t stream_id = (reliable ? Stream::RELIABLE_STREAM_BIT : 0) | 7;
+            Stream sender(stream_id, client_id, Endpoint::Resolve("127.0.0.1", 5557), &sender_socket);
+            Stream receiver(stream_id, client_id, Endpoint::Resolve("127.0.0.1", 5556), &receiver_socket);
+            sender.SetWireVersion(version);
+            receiver.SetWireVersion(version);
+
+            size_t data_bytes = 0;
+            size_t ack_bytes = 0;
+            int received = 0;
+            for (int i = 0; i < message_count; i += Stream::WINDOW_SIZE)
+            {
+                for (int j = 0; j < Stream::WINDOW_SIZE; j++)
+                {
+                    StreamTestAccess::SendData(sender, payload);
+                }
+                Drain(receiver_socket, [&](std::span<const char> data, int) {
+                    data_bytes += data.size();
+                    received++;
+                    receiver.OnDataReceived(data);
+                });
+                Drain(sender_socket, [&](std::span<const char> data, int) {
+                    ack_bytes += data.size();
+                    sender.OnAckReceived(data);
+                });
+            }
+
+            std::array<Message, 64> messages;
+            while (receiver.PollMessages(messages) > 0) {}
+            std::cout << (reliable ? "Reliable" : "Unreliable") << " messages of " << payload.size() << " bytes, version "
+                << static_cast<int>(version) << ": " << static_cast<double>(data_bytes) / received << " bytes of data and "
+                << static_cast<double>(ack_bytes) / received << " bytes of acknowledgement per message" << std::endl;
+        }
+    }
+}
+
+TEST_CASE("Message schema against hand written offsets", "[.][benchmark]")
+{
+    constexpr int iterations = 50'000'000;
+    using Layout = schema::Data;
+    std::array<char, Layout::SIZE> message;
+    uint64_t checksum = 0;
+
+    const auto raw_start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++)
+    {
+        const uint64_t client_id = i;
+        const uint32_t stream_id = i * 3;
+        const uint16_t part_id = static_cast<uint16_t>(i);
+        message[0] = DATA;
+        memcpy(&message[3], &client_id, sizeof(client_id));
+        memcpy(&message[11], &stream_id, sizeof(stream_id));
+        memcpy(&message[19], &part_id, sizeof(part_id));
+
+        uint64_t read_client_id;
+        uint32_t read_stream_id;
+        uint16_t read_part_id;
+        if (message.size() >= Layout::SIZE)
+        {
+            memcpy(&read_client_id, &message[3], sizeof(read_client_id));
+            memcpy(&read_stream_id, &message[11], sizeof(read_stream_id));
+            memcpy(&read_part_id, &message[19], sizeof(read_part_id));
+            checksum += read_client_id + read_stream_id + read_part_id;
+        }
+    }
+    const double raw_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - raw_start).count();
+
+    const auto schema_start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++)
+    {
+        schema::Writer<Layout>(message)
+            .Set<Layout::ClientId>(i)
+            .Set<Layout::StreamId>(i * 3)
+            .Set<Layout::PartId>(static_cast<uint16_t>(i));
+
+        if (const auto view = schema::View<Layout>::Of(message))
+        {
+            checksum -= view->Get<Layout::ClientId>() + view->Get<Layout::StreamId>() + view->Get<Layout::PartId>();
+        }
+    }
+    const double schema_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - schema_start).count();
+
+    REQUIRE(checksum == 0);
+    std::cout << "Encoding and decoding a data header: " << raw_seconds * 1e9 / iterations << " ns with raw offsets, "
+        << schema_seconds * 1e9 / iterations << " ns with the schema" << std::endl;
+}
+
+TEST_CASE("Snapshot bandwidth of a mostly static world", "[.][benchmark]")
+{
+    constexpr int ticks = 600;
+    // 200 entities of 64 bytes, 2 of them move every tick
+    constexpr size_t entity_size = 64;
+    constexpr size_t entity_count = 200;
+    RawSocket sender_socket;
+    sender_socket.Bind(5556);
+    RawSocket receiver_socket;
+    receiver_socket.Bind(5557);
+
+    size_t bytes[2] = {};
+    for (const bool snapshots : { false, true })
+    {
+        const uint32_t stream_id = snapshots ? Stream::SNAPSHOT_STREAM_BIT : 0;
+        Stream sender(stream_id, 0, Endpoint::Resolve("127.0.0.1", 5557), &sender_socket);
+        Stream receiver(stream_id, 0, Endpoint::Resolve("127.0.0.1", 5556), &receiver_socket);
+        std::minstd_rand random(42);
+        std::string world(entity_size * entity_count, 'w');
+        int delivered = 0;
+        std::array<Message, 8> messages;
+        for (int tick = 0; tick < ticks; tick++)
+        {
+            for (int moved = 0; moved < 2; moved++)
+            {
+                const size_t entity = random() % entity_count;
+                for (size_t i = 0; i < 12; i++)
+                {
+                    world[entity * entity_size + i] = static_cast<char>(random());
+                }
+            }
+            StreamTestAccess::SendData(sender, world);
+            Drain(receiver_socket, [&](std::span<const char> data, int) {
+                bytes[snapshots] += data.size();
+                receiver.OnDataReceived(data);
+            });
+            Drain(sender_socket, [&](std::span<const char> data, int) { sender.OnSnapshotAckReceived(data); });
+            for (size_t count = receiver.PollMessages(messages); count > 0; count = receiver.PollMessages(messages))
+            {
+                delivered += static_cast<int>(count);
+            }
+        }
+        REQUIRE(delivered == ticks);
+        REQUIRE(receiver.getLastData() == world);
+    }
+
+    std::cout << "World of " << entity_size * entity_count << " bytes, " << ticks << " ticks: " << bytes[0] / ticks
+        << " bytes per tick as full snapshots, " << bytes[1] / ticks << " as deltas" << std::endl;
+    REQUIRE(bytes[1] * 10 < bytes[0]);
+}
+
+TEST_CASE("Payload compression ratio and speed", "[.][benchmark]")
+{
+    std::minstd_rand random(42);
+    std::string chat;
+    const char* words[] = { "gg", "push", "mid", "nice", "shot", "reload", "cover", "me", "left", "right", "enemy", "spotted" };
+    while (chat.size() < 64 * 1024)
+    {
+        chat += "{\"from\": " + std::to_string(random() % 100) + ", \"text\": \"";
+        for (int i = 0; i < 6; i++)
+        {
+            chat += words[random() % 12];
+            chat += ' ';
+        }
+        chat += "\"}\n";
+    }
+    std::string snapshot(64 * 1024, 0);
+    for (size_t i = 0; i < snapshot.size(); i += 32)
+    {
+        // Entities with a few varying bytes among constant fields
+        snapshot[i] = static_cast<char>(random());
+        snapshot[i + 1] = static_cast<char>(random() % 4);
+    }
+    const lz::Dictionary dictionary(std::span<const char>(chat).first(16 * 1024));
+    const std::string line = chat.substr(chat.size() / 2, 120);
+
+    struct Case
+    {
+        const char* name;
+        std::span<const char> input;
+        const lz::Dictionary* dictionary;
+    };
+    const Case cases[] = {
+        { "chat, 64 KB", chat, nullptr },
+        { "snapshot, 64 KB", snapshot, nullptr },
+        { "chat line of 120 bytes", line, nullptr },
+        { "chat line of 120 bytes with a dictionary", line, &dictionary },
+    };
+    std::vector<char> compressed;
+    std::string decompressed;
+    for (const Case& test : cases)
+    {
+        const int iterations = static_cast<int>(64 * 1024 * 1024 / test.input.size());
+        const auto encode_start = std::chrono::steady_clock::now();
+        for (int i = 0; i < iterations; i++)
+        {
+            lz::Compress(test.input, compressed, test.dictionary);
+        }
+        const double encode_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - encode_start).count();
+        const auto decode_start = std::chrono::steady_clock::now();
+        for (int i = 0; i < iterations; i++)
+        {
+            lz::Decompress(compressed, test.input.size(), decompressed, test.dictionary);
+        }
+        const double decode_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - decode_start).count();
+        REQUIRE(std::equal(decompressed.begin(), decompressed.end(), test.input.begin(), test.input.end()));
+
+        const double bytes = static_cast<double>(iterations) * test.input.size();
+        std::cout << test.name << ": ratio " << static_cast<double>(test.input.size()) / compressed.size() << ", encode "
+            << encode_seconds * 1e9 / bytes << " ns/byte, decode " << decode_seconds * 1e9 / bytes << " ns/byte" << std::endl;
+    }
+}
+
+// Run with: tests "[benchmark]"
+TEST_CASE("Ordered stream throughput and latency under loss", "[.][benchmark]")
+{
+    constexpr int message_count = 2000;
+    for (const double loss_rate : { 0.0, 0.01, 0.05 })
+    {
+        FalconServer server;
+        NetworkConditions conditions;
+        conditions.loss_rate = loss_rate;
+        conditions.latency = 10ms;
+        server.SimulateNetworkConditions(conditions);
+        server.Listen(5555);
+
+        // The handshake is not retransmitted, retry it past the simulated losses
+        std::unique_ptr<FalconClient> client;
+        for (int attempt = 0; attempt < 10 && !(client && client->IsConnected()); attempt++)
+        {
+            client = std::make_unique<FalconClient>();
+            client->ConnectTo("127.0.0.1", 5555);
+            std::this_thread::sleep_for(300ms);
+        }
+        REQUIRE(client->IsConnected());
+
+        auto stream = client->CreateOrderedStream();
+        // Each message carries its index and the time it was sent
+        const auto start = std::chrono::steady_clock::now();
+        std::array<char, 200> message{};
+        for (int i = 0; i < message_count; i++)
+        {
+            const auto now = std::chrono::steady_clock::now();
+            memcpy(message.data(), &i, sizeof(i));
+            memcpy(message.data() + sizeof(i), &now, sizeof(now));
+            // Waits for the listener when its command queue is full
+            while (!client->SendData(message, stream->GetStreamID()))
+            {
+                std::this_thread::sleep_for(100us);
+            }
+        }
+
+        std::vector<double> latencies;
+        std::array<Message, 64> received;
+        int expected = 0;
+        while (expected < message_count && std::chrono::steady_clock::now() - start < 30s)
+        {
+            std::this_thread::sleep_for(1ms);
+            const auto server_stream = server.GetStream(client->GetId(), stream->GetStreamID());
+            const size_t count = server_stream ? server_stream->PollMessages(received) : 0;
+            const auto now = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < count; i++)
+            {
+                int index;
+                std::chrono::steady_clock::time_point sent_at;
+                memcpy(&index, received[i].data.data(), sizeof(index));
+                memcpy(&sent_at, received[i].data.data() + sizeof(index), sizeof(sent_at));
+                REQUIRE(index == expected++);
+                latencies.push_back(std::chrono::duration<double, std::milli>(now - sent_at).count());
+            }
+        }
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        REQUIRE(expected == message_count);
+
+        std::sort(latencies.begin(), latencies.end());
+        std::cout << loss_rate * 100 << "% loss: " << static_cast<int>(message_count / seconds) << " messages/s, latency "
+            << latencies[latencies.size() / 2] << " ms median, " << latencies[latencies.size() * 99 / 100] << " ms p99" << std::endl;
+    }
+}